@@ -153,7 +153,9 @@
                                              (((i == 1) || (i == 2)) ? 512 : 1024))
 
 /// Returns the number of FIFO banks for the given endpoint.
-#define BOARD_USB_ENDPOINTS_BANKS(i)        ((i == 0) ? 1 : ((i == 1) || (i == 2)) ? 2 : 3)
+/// The endpoint FIFO RAM is 4 KB: double banks for CDC data OUT (1) and the
+/// mass storage endpoints (5, 6), single banks for the rest.
+#define BOARD_USB_ENDPOINTS_BANKS(i)        (((i == 1) || (i == 5) || (i == 6)) ? 2 : 1)
 
 /// USB attributes configuration descriptor (bus or self powered, remote wakeup)
 #define BOARD_USB_BMATTRIBUTES              USBConfigurationDescriptor_SELFPOWERED_RWAKEUP
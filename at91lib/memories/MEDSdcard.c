@@ -182,6 +182,34 @@ static void ConfigurePIO(unsigned char mciID)
     }
 }
 
+//------------------------------------------------------------------------------
+//! \brief Callback invoked when SD/MMC transfer done
+//------------------------------------------------------------------------------
+static void SdMmcCallback(unsigned char status, void *pCommand)
+{
+    SdCmd       * pCmd = (SdCmd*)pCommand;
+    Media       * pMed = pCmd->pArg;
+    MEDTransfer * pXfr = &pMed->transfer;
+
+    TRACE_INFO_WP("SDCb ");
+
+    // Error
+    if (status == SD_ERROR_BUSY) {
+        status = MED_STATUS_BUSY;
+    }
+    else if (status) {
+        status = MED_STATUS_ERROR;
+    }
+
+    pMed->state = MED_STATE_READY;
+    if (pXfr->callback) {
+        pXfr->callback(pXfr->argument,
+                       status,
+                       pXfr->length * pMed->blockSize,
+                       0);
+    }
+}
+
 //------------------------------------------------------------------------------
 //! \brief  Reads a specified amount of data from a SDCARD memory
 //! \param  media    Pointer to a Media instance
@@ -221,17 +249,41 @@ static unsigned char MEDSdcard_Read(Media         *media,
     // Enter Busy state
     media->state = MED_STATE_BUSY;
 
+    // With a callback the multi-block DMA transfer runs in the background,
+    // SdMmcCallback() reports the end of it
+    if (callback != 0) {
+
+        MEDTransfer * pXfr = &media->transfer;
+        pXfr->data     = data;
+        pXfr->address  = address;
+        pXfr->length   = length;
+        pXfr->callback = callback;
+        pXfr->argument = argument;
+
+        error = SD_Read((SdCard*)media->interface,
+                        address,
+                        data,
+                        length,
+                        SdMmcCallback,
+                        media);
+        if (error) {
+
+            media->state = MED_STATE_READY;
+            return MED_STATUS_ERROR;
+        }
+        return MED_STATUS_SUCCESS;
+    }
+
     error = SD_ReadBlock((SdCard*)media->interface, address, length, data);
 
     // Leave the Busy state
     media->state = MED_STATE_READY;
 
-    // Invoke callback
-    if (callback != 0) {
+    if (error) {
 
-        callback(argument, MED_STATUS_SUCCESS, 0, 0);
+        TRACE_ERROR("MEDSdcard_Read: %d\n\r", error);
+        return MED_STATUS_ERROR;
     }
-
     return MED_STATUS_SUCCESS;
 }
 
@@ -274,46 +326,41 @@ static unsigned char MEDSdcard_Write(Media         *media,
     // Put the media in Busy state
     media->state = MED_STATE_BUSY;
 
-    error = SD_WriteBlock((SdCard*)media->interface, address, length, data);
-
-    // Leave the Busy state
-    media->state = MED_STATE_READY;
-
-    // Invoke the callback if it exists
+    // Background transfer, see MEDSdcard_Read()
     if (callback != 0) {
 
-        callback(argument, MED_STATUS_SUCCESS, 0, 0);
+        MEDTransfer * pXfr = &media->transfer;
+        pXfr->data     = data;
+        pXfr->address  = address;
+        pXfr->length   = length;
+        pXfr->callback = callback;
+        pXfr->argument = argument;
+
+        error = SD_Write((SdCard*)media->interface,
+                         address,
+                         data,
+                         length,
+                         SdMmcCallback,
+                         media);
+        if (error) {
+
+            media->state = MED_STATE_READY;
+            return MED_STATUS_ERROR;
+        }
+        return MED_STATUS_SUCCESS;
     }
 
-    return MED_STATUS_SUCCESS;
-}
-
-//------------------------------------------------------------------------------
-//! \brief Callback invoked when SD/MMC transfer done
-//------------------------------------------------------------------------------
-static void SdMmcCallback(unsigned char status, void *pCommand)
-{
-    SdCmd       * pCmd = (SdCmd*)pCommand;
-    Media       * pMed = pCmd->pArg;
-    MEDTransfer * pXfr = &pMed->transfer;
+    error = SD_WriteBlock((SdCard*)media->interface, address, length, data);
 
-    TRACE_INFO_WP("SDCb ");
+    // Leave the Busy state
+    media->state = MED_STATE_READY;
 
-    // Error
-    if (status == SD_ERROR_BUSY) {
-        status = MED_STATUS_BUSY;
-    }
-    else if (status) {
-        status = MED_STATUS_ERROR;
-    }
+    if (error) {
 
-    pMed->state = MED_STATE_READY;
-    if (pXfr->callback) {
-        pXfr->callback(pXfr->argument,
-                       status,
-                       pXfr->length * pMed->blockSize,
-                       0);
+        TRACE_ERROR("MEDSdcard_Write: %d\n\r", error);
+        return MED_STATUS_ERROR;
     }
+    return MED_STATUS_SUCCESS;
 }
 
 //------------------------------------------------------------------------------
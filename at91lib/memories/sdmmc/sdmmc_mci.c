@@ -46,6 +46,10 @@
 
 unsigned char gSdmmcAutoHsEnable = 1;
 
+/// Called while the card is polled out of its power-up sequence, which can
+/// take up to a second, so the application can keep other work running.
+void (*gSdmmcIdleHook)(void) = 0;
+
 //------------------------------------------------------------------------------
 //         Local constants
 //------------------------------------------------------------------------------
@@ -661,6 +665,11 @@ static unsigned char SendCommand(SdCard *pSd)
     }
   #endif
 
+    // Background transfer started, the callback reports the result
+    // (a failed submit returned SD_ERROR_DRIVER above, never PENDING)
+    if (pCommand->callback)
+        return 0;
+
     return pCommand->status;
 }
 
@@ -1402,6 +1411,9 @@ static unsigned char Acmd41(SdCard *pSd, unsigned char hcs, unsigned char *pCCS)
             return error;
         }
         *pCCS  = ((response & AT91C_CCS) != 0);
+        if (gSdmmcIdleHook) {
+            gSdmmcIdleHook();
+        }
     }
     while ((response & AT91C_CARD_POWER_UP_BUSY) != AT91C_CARD_POWER_UP_BUSY);
 
@@ -2080,7 +2092,7 @@ unsigned char SD_Read(SdCard        *pSd,
                                pCallback, pArgs);
     }
 
-    return 0;    
+    return error;
 }
 
 unsigned char SD_Write(SdCard        *pSd,
@@ -2113,7 +2125,7 @@ unsigned char SD_Write(SdCard        *pSd,
         pSd->preBlock = address + (length - 1);
     }
     
-    return 0;
+    return error;
 }
 
 
@@ -2303,6 +2315,9 @@ static unsigned char SdMmcInit(SdCard *pSd, SdDriver *pSdDriver)
             }
             do {
                 error = Cmd1(pSd, 1, &isHdSupport);
+                if (gSdmmcIdleHook) {
+                    gSdmmcIdleHook();
+                }
             }
             while ((error) && (cmd1Retries-- > 0));
             if (error) {
@@ -740,6 +740,12 @@ typedef struct _SdCmd6Arg {
                  mode:1;        /// [31   ] Mode, 0: Check, 1: Switch
 } SdCmd6Arg;
 
+//------------------------------------------------------------------------------
+//         Global variables
+//------------------------------------------------------------------------------
+
+extern void (*gSdmmcIdleHook)(void);
+
 //------------------------------------------------------------------------------
 //         Global functions
 //------------------------------------------------------------------------------
@@ -82,10 +82,37 @@
 /// Returns the minimum between two values.
 #define MIN(a, b)       ((a < b) ? a : b)
 
+/// Device class for a composite device with interface associations.
+#define COMPOSITE_CLASS         0xEF
+#define COMPOSITE_SUBCLASS      0x02
+#define COMPOSITE_PROTOCOL      0x01
+
+/// Mass storage class, SCSI transparent command set, bulk-only transport.
+#define MSD_CLASS               0x08
+#define MSD_SUBCLASS_SCSI       0x06
+#define MSD_PROTOCOL_BULKONLY   0x50
+
 //------------------------------------------------------------------------------
 //         Internal structures
 //------------------------------------------------------------------------------
 
+//------------------------------------------------------------------------------
+/// Interface association descriptor, groups the CDC communication and data
+/// interfaces into one function of the composite device.
+//------------------------------------------------------------------------------
+typedef struct {
+
+    unsigned char bLength;
+    unsigned char bDescriptorType;
+    unsigned char bFirstInterface;
+    unsigned char bInterfaceCount;
+    unsigned char bFunctionClass;
+    unsigned char bFunctionSubClass;
+    unsigned char bFunctionProtocol;
+    unsigned char iFunction;
+
+} __attribute__ ((packed)) USBInterfaceAssociationDescriptor;
+
 //------------------------------------------------------------------------------
 /// Configuration descriptor list for a device implementing a CDC serial driver.
 //------------------------------------------------------------------------------
@@ -97,6 +124,8 @@ typedef struct {
     // OTG descriptor
     USBOtgDescriptor otgDescriptor;
 #endif
+    /// Interface association of the two CDC interfaces.
+    USBInterfaceAssociationDescriptor cdcAssociation;
     /// Communication interface descriptor.
     USBInterfaceDescriptor  communication;
     /// CDC header functional descriptor.
@@ -115,6 +144,12 @@ typedef struct {
     USBEndpointDescriptor dataOut;
     /// Data IN endpoint descriptor.
     USBEndpointDescriptor dataIn;
+    /// Mass storage interface descriptor.
+    USBInterfaceDescriptor msd;
+    /// Mass storage bulk OUT endpoint descriptor.
+    USBEndpointDescriptor msdOut;
+    /// Mass storage bulk IN endpoint descriptor.
+    USBEndpointDescriptor msdIn;
 
 } __attribute__ ((packed)) CDCDSerialDriverConfigurationDescriptors;
 
@@ -128,9 +163,9 @@ const USBDeviceDescriptor deviceDescriptor = {
     sizeof(USBDeviceDescriptor),
     USBGenericDescriptor_DEVICE,
     USBDeviceDescriptor_USB2_00,
-    CDCDeviceDescriptor_CLASS,
-    CDCDeviceDescriptor_SUBCLASS,
-    CDCDeviceDescriptor_PROTOCOL,
+    COMPOSITE_CLASS,
+    COMPOSITE_SUBCLASS,
+    COMPOSITE_PROTOCOL,
     BOARD_USB_ENDPOINTS_MAXPACKETSIZE(0),
     CDCDSerialDriverDescriptors_VENDORID,
     CDCDSerialDriverDescriptors_PRODUCTID,
@@ -149,9 +184,9 @@ const USBDeviceQualifierDescriptor qualifierDescriptor = {
     sizeof(USBDeviceQualifierDescriptor),
     USBGenericDescriptor_DEVICEQUALIFIER,
     USBDeviceDescriptor_USB2_00,
-    CDCDeviceDescriptor_CLASS,
-    CDCDeviceDescriptor_SUBCLASS,
-    CDCDeviceDescriptor_PROTOCOL,
+    COMPOSITE_CLASS,
+    COMPOSITE_SUBCLASS,
+    COMPOSITE_PROTOCOL,
     BOARD_USB_ENDPOINTS_MAXPACKETSIZE(0),
     1, // Device has one possible configuration
     0 // Reserved
@@ -167,7 +202,7 @@ const CDCDSerialDriverConfigurationDescriptors configurationDescriptors = {
         sizeof(USBConfigurationDescriptor),
         USBGenericDescriptor_CONFIGURATION,
         sizeof(CDCDSerialDriverConfigurationDescriptors),
-        2, // There are two interfaces in this configuration
+        3, // CDC communication, CDC data and mass storage interface
         1, // This is configuration #1
         0, // No string descriptor for this configuration
         BOARD_USB_BMATTRIBUTES,
@@ -181,6 +216,17 @@ const CDCDSerialDriverConfigurationDescriptors configurationDescriptors = {
         USBOTGDescriptor_HNP_SRP
     },
 #endif
+    // Interface association for the CDC function
+    {
+        sizeof(USBInterfaceAssociationDescriptor),
+        USBGenericDescriptor_INTERFACEASSOCIATION,
+        0, // First interface is #0
+        2, // Communication and data interface
+        CDCCommunicationInterfaceDescriptor_CLASS,
+        CDCCommunicationInterfaceDescriptor_ABSTRACTCONTROLMODEL,
+        CDCCommunicationInterfaceDescriptor_NOPROTOCOL,
+        0  // No string descriptor for this function
+    },
     // Communication class interface standard descriptor
     {
         sizeof(USBInterfaceDescriptor),
@@ -268,6 +314,40 @@ const CDCDSerialDriverConfigurationDescriptors configurationDescriptors = {
             USBEndpointDescriptor_MAXBULKSIZE_FS),
         0 // Must be 0 for full-speed bulk endpoints
     },
+    // Mass storage interface standard descriptor
+    {
+        sizeof(USBInterfaceDescriptor),
+        USBGenericDescriptor_INTERFACE,
+        CDCDSerialDriverDescriptors_MSDINTERFACE,
+        0, // This is alternate setting #0 for this interface
+        2, // This interface uses 2 endpoints
+        MSD_CLASS,
+        MSD_SUBCLASS_SCSI,
+        MSD_PROTOCOL_BULKONLY,
+        0  // No string descriptor for this interface
+    },
+    // Mass storage bulk-OUT endpoint descriptor
+    {
+        sizeof(USBEndpointDescriptor),
+        USBGenericDescriptor_ENDPOINT,
+        USBEndpointDescriptor_ADDRESS(USBEndpointDescriptor_OUT,
+                                      CDCDSerialDriverDescriptors_MSDOUT),
+        USBEndpointDescriptor_BULK,
+        MIN(BOARD_USB_ENDPOINTS_MAXPACKETSIZE(CDCDSerialDriverDescriptors_MSDOUT),
+            USBEndpointDescriptor_MAXBULKSIZE_FS),
+        0 // Must be 0 for full-speed bulk endpoints
+    },
+    // Mass storage bulk-IN endpoint descriptor
+    {
+        sizeof(USBEndpointDescriptor),
+        USBGenericDescriptor_ENDPOINT,
+        USBEndpointDescriptor_ADDRESS(USBEndpointDescriptor_IN,
+                                      CDCDSerialDriverDescriptors_MSDIN),
+        USBEndpointDescriptor_BULK,
+        MIN(BOARD_USB_ENDPOINTS_MAXPACKETSIZE(CDCDSerialDriverDescriptors_MSDIN),
+            USBEndpointDescriptor_MAXBULKSIZE_FS),
+        0 // Must be 0 for full-speed bulk endpoints
+    },
 };
 
 /// Language ID string descriptor
@@ -287,7 +367,7 @@ const CDCDSerialDriverConfigurationDescriptors otherSpeedDescriptorsFS = {
         sizeof(USBConfigurationDescriptor),
         USBGenericDescriptor_OTHERSPEEDCONFIGURATION,
         sizeof(CDCDSerialDriverConfigurationDescriptors),
-        2, // There are two interfaces in this configuration
+        3, // CDC communication, CDC data and mass storage interface
         1, // This is configuration #1
         0, // No string descriptor for this configuration
         BOARD_USB_BMATTRIBUTES,
@@ -301,6 +381,17 @@ const CDCDSerialDriverConfigurationDescriptors otherSpeedDescriptorsFS = {
         USBOTGDescriptor_HNP_SRP
     },
 #endif
+    // Interface association for the CDC function
+    {
+        sizeof(USBInterfaceAssociationDescriptor),
+        USBGenericDescriptor_INTERFACEASSOCIATION,
+        0, // First interface is #0
+        2, // Communication and data interface
+        CDCCommunicationInterfaceDescriptor_CLASS,
+        CDCCommunicationInterfaceDescriptor_ABSTRACTCONTROLMODEL,
+        CDCCommunicationInterfaceDescriptor_NOPROTOCOL,
+        0  // No string descriptor for this function
+    },
     // Communication class interface standard descriptor
     {
         sizeof(USBInterfaceDescriptor),
@@ -388,6 +479,40 @@ const CDCDSerialDriverConfigurationDescriptors otherSpeedDescriptorsFS = {
             USBEndpointDescriptor_MAXBULKSIZE_HS),
         0 // Must be 0 for full-speed bulk endpoints
     },
+    // Mass storage interface standard descriptor
+    {
+        sizeof(USBInterfaceDescriptor),
+        USBGenericDescriptor_INTERFACE,
+        CDCDSerialDriverDescriptors_MSDINTERFACE,
+        0, // This is alternate setting #0 for this interface
+        2, // This interface uses 2 endpoints
+        MSD_CLASS,
+        MSD_SUBCLASS_SCSI,
+        MSD_PROTOCOL_BULKONLY,
+        0  // No string descriptor for this interface
+    },
+    // Mass storage bulk-OUT endpoint descriptor
+    {
+        sizeof(USBEndpointDescriptor),
+        USBGenericDescriptor_ENDPOINT,
+        USBEndpointDescriptor_ADDRESS(USBEndpointDescriptor_OUT,
+                                      CDCDSerialDriverDescriptors_MSDOUT),
+        USBEndpointDescriptor_BULK,
+        MIN(BOARD_USB_ENDPOINTS_MAXPACKETSIZE(CDCDSerialDriverDescriptors_MSDOUT),
+            USBEndpointDescriptor_MAXBULKSIZE_HS),
+        0 // Must be 0 for full-speed bulk endpoints
+    },
+    // Mass storage bulk-IN endpoint descriptor
+    {
+        sizeof(USBEndpointDescriptor),
+        USBGenericDescriptor_ENDPOINT,
+        USBEndpointDescriptor_ADDRESS(USBEndpointDescriptor_IN,
+                                      CDCDSerialDriverDescriptors_MSDIN),
+        USBEndpointDescriptor_BULK,
+        MIN(BOARD_USB_ENDPOINTS_MAXPACKETSIZE(CDCDSerialDriverDescriptors_MSDIN),
+            USBEndpointDescriptor_MAXBULKSIZE_HS),
+        0 // Must be 0 for full-speed bulk endpoints
+    },
 };
 
 
@@ -399,7 +524,7 @@ const CDCDSerialDriverConfigurationDescriptors configurationDescriptorsHS = {
         sizeof(USBConfigurationDescriptor),
         USBGenericDescriptor_CONFIGURATION,
         sizeof(CDCDSerialDriverConfigurationDescriptors),
-        2, // There are two interfaces in this configuration
+        3, // CDC communication, CDC data and mass storage interface
         1, // This is configuration #1
         0, // No string descriptor for this configuration
         BOARD_USB_BMATTRIBUTES,
@@ -413,6 +538,17 @@ const CDCDSerialDriverConfigurationDescriptors configurationDescriptorsHS = {
         USBOTGDescriptor_HNP_SRP
     },
 #endif
+    // Interface association for the CDC function
+    {
+        sizeof(USBInterfaceAssociationDescriptor),
+        USBGenericDescriptor_INTERFACEASSOCIATION,
+        0, // First interface is #0
+        2, // Communication and data interface
+        CDCCommunicationInterfaceDescriptor_CLASS,
+        CDCCommunicationInterfaceDescriptor_ABSTRACTCONTROLMODEL,
+        CDCCommunicationInterfaceDescriptor_NOPROTOCOL,
+        0  // No string descriptor for this function
+    },
     // Communication class interface standard descriptor
     {
         sizeof(USBInterfaceDescriptor),
@@ -500,6 +636,40 @@ const CDCDSerialDriverConfigurationDescriptors configurationDescriptorsHS = {
             USBEndpointDescriptor_MAXBULKSIZE_HS),
         0 // Must be 0 for full-speed bulk endpoints
     },
+    // Mass storage interface standard descriptor
+    {
+        sizeof(USBInterfaceDescriptor),
+        USBGenericDescriptor_INTERFACE,
+        CDCDSerialDriverDescriptors_MSDINTERFACE,
+        0, // This is alternate setting #0 for this interface
+        2, // This interface uses 2 endpoints
+        MSD_CLASS,
+        MSD_SUBCLASS_SCSI,
+        MSD_PROTOCOL_BULKONLY,
+        0  // No string descriptor for this interface
+    },
+    // Mass storage bulk-OUT endpoint descriptor
+    {
+        sizeof(USBEndpointDescriptor),
+        USBGenericDescriptor_ENDPOINT,
+        USBEndpointDescriptor_ADDRESS(USBEndpointDescriptor_OUT,
+                                      CDCDSerialDriverDescriptors_MSDOUT),
+        USBEndpointDescriptor_BULK,
+        MIN(BOARD_USB_ENDPOINTS_MAXPACKETSIZE(CDCDSerialDriverDescriptors_MSDOUT),
+            USBEndpointDescriptor_MAXBULKSIZE_HS),
+        0 // Must be 0 for full-speed bulk endpoints
+    },
+    // Mass storage bulk-IN endpoint descriptor
+    {
+        sizeof(USBEndpointDescriptor),
+        USBGenericDescriptor_ENDPOINT,
+        USBEndpointDescriptor_ADDRESS(USBEndpointDescriptor_IN,
+                                      CDCDSerialDriverDescriptors_MSDIN),
+        USBEndpointDescriptor_BULK,
+        MIN(BOARD_USB_ENDPOINTS_MAXPACKETSIZE(CDCDSerialDriverDescriptors_MSDIN),
+            USBEndpointDescriptor_MAXBULKSIZE_HS),
+        0 // Must be 0 for full-speed bulk endpoints
+    },
 };
 
 /// Other-speed configuration descriptor (when in high-speed).
@@ -510,7 +680,7 @@ const CDCDSerialDriverConfigurationDescriptors otherSpeedDescriptorsHS = {
         sizeof(USBConfigurationDescriptor),
         USBGenericDescriptor_OTHERSPEEDCONFIGURATION,
         sizeof(CDCDSerialDriverConfigurationDescriptors),
-        2, // There are two interfaces in this configuration
+        3, // CDC communication, CDC data and mass storage interface
         1, // This is configuration #1
         0, // No string descriptor for this configuration
         BOARD_USB_BMATTRIBUTES,
@@ -524,6 +694,17 @@ const CDCDSerialDriverConfigurationDescriptors otherSpeedDescriptorsHS = {
         USBOTGDescriptor_HNP_SRP
     },
 #endif
+    // Interface association for the CDC function
+    {
+        sizeof(USBInterfaceAssociationDescriptor),
+        USBGenericDescriptor_INTERFACEASSOCIATION,
+        0, // First interface is #0
+        2, // Communication and data interface
+        CDCCommunicationInterfaceDescriptor_CLASS,
+        CDCCommunicationInterfaceDescriptor_ABSTRACTCONTROLMODEL,
+        CDCCommunicationInterfaceDescriptor_NOPROTOCOL,
+        0  // No string descriptor for this function
+    },
     // Communication class interface standard descriptor
     {
         sizeof(USBInterfaceDescriptor),
@@ -611,6 +792,40 @@ const CDCDSerialDriverConfigurationDescriptors otherSpeedDescriptorsHS = {
             USBEndpointDescriptor_MAXBULKSIZE_FS),
         0 // Must be 0 for full-speed bulk endpoints
     },
+    // Mass storage interface standard descriptor
+    {
+        sizeof(USBInterfaceDescriptor),
+        USBGenericDescriptor_INTERFACE,
+        CDCDSerialDriverDescriptors_MSDINTERFACE,
+        0, // This is alternate setting #0 for this interface
+        2, // This interface uses 2 endpoints
+        MSD_CLASS,
+        MSD_SUBCLASS_SCSI,
+        MSD_PROTOCOL_BULKONLY,
+        0  // No string descriptor for this interface
+    },
+    // Mass storage bulk-OUT endpoint descriptor
+    {
+        sizeof(USBEndpointDescriptor),
+        USBGenericDescriptor_ENDPOINT,
+        USBEndpointDescriptor_ADDRESS(USBEndpointDescriptor_OUT,
+                                      CDCDSerialDriverDescriptors_MSDOUT),
+        USBEndpointDescriptor_BULK,
+        MIN(BOARD_USB_ENDPOINTS_MAXPACKETSIZE(CDCDSerialDriverDescriptors_MSDOUT),
+            USBEndpointDescriptor_MAXBULKSIZE_FS),
+        0 // Must be 0 for full-speed bulk endpoints
+    },
+    // Mass storage bulk-IN endpoint descriptor
+    {
+        sizeof(USBEndpointDescriptor),
+        USBGenericDescriptor_ENDPOINT,
+        USBEndpointDescriptor_ADDRESS(USBEndpointDescriptor_IN,
+                                      CDCDSerialDriverDescriptors_MSDIN),
+        USBEndpointDescriptor_BULK,
+        MIN(BOARD_USB_ENDPOINTS_MAXPACKETSIZE(CDCDSerialDriverDescriptors_MSDIN),
+            USBEndpointDescriptor_MAXBULKSIZE_FS),
+        0 // Must be 0 for full-speed bulk endpoints
+    },
 };
 #endif
 
@@ -64,6 +64,12 @@
 #define CDCDSerialDriverDescriptors_DATAIN              2
 /// Notification endpoint number.
 #define CDCDSerialDriverDescriptors_NOTIFICATION        3
+/// Mass storage bulk OUT endpoint number.
+#define CDCDSerialDriverDescriptors_MSDOUT              5
+/// Mass storage bulk IN endpoint number.
+#define CDCDSerialDriverDescriptors_MSDIN               6
+/// Mass storage interface number.
+#define CDCDSerialDriverDescriptors_MSDINTERFACE        2
 //------------------------------------------------------------------------------
 
 //------------------------------------------------------------------------------
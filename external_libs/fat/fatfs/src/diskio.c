@@ -20,6 +20,51 @@
 //         Internal variables
 //------------------------------------------------------------------------------
 #define SECTOR_SIZE_DEFAULT 512
+
+/// Write-back cache: runs of sequential sector writes are collected and go
+/// to the card as one multi-block transfer when the run is full, broken by
+/// a write elsewhere, read back or synced (CTRL_SYNC, i.e. f_sync/f_close).
+#define WRITE_CACHE_SECTORS 8
+
+static unsigned char writeCache[WRITE_CACHE_SECTORS * SECTOR_SIZE_DEFAULT]
+                                __attribute__((aligned(4)));
+static BYTE cacheDrv;
+static unsigned int cacheAddr;      // first block of the cached run
+static unsigned int cacheLen = 0;   // blocks in the cache, 0 = empty
+
+//------------------------------------------------------------------------------
+/// Writes the cached run to the media.
+//------------------------------------------------------------------------------
+static DRESULT cache_flush(void)
+{
+    unsigned char result;
+
+    if (cacheLen == 0)
+        return RES_OK;
+
+    result = MED_Write(&medias[cacheDrv],
+                       cacheAddr,
+                       (void*)writeCache,
+                       cacheLen,
+                       NULL,
+                       NULL);
+    cacheLen = 0;
+
+    if( result != MED_STATUS_SUCCESS ) {
+        TRACE_ERROR("MED_Write pb: 0x%X\n\r", result);
+        return RES_ERROR;
+    }
+    return RES_OK;
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if the given blocks are (partly) in the cache.
+//------------------------------------------------------------------------------
+static unsigned char cache_overlaps(BYTE drv, unsigned int addr, unsigned int len)
+{
+    return cacheLen && drv == cacheDrv
+           && addr < cacheAddr + cacheLen && addr + len > cacheAddr;
+}
 /*-----------------------------------------------------------------------*/
 /* Initialize a Drive                                                    */
 /*-----------------------------------------------------------------------*/
@@ -70,6 +115,10 @@ DRESULT disk_read (
         len  = count;
     }
     
+    // the card must see cached data before it is read back
+    if (cache_overlaps(drv, addr, len) && cache_flush() != RES_OK)
+        return RES_ERROR;
+
     result = MED_Read(&medias[drv],
                       addr,               // address
                       (void*)buff,          // data                                            
@@ -116,6 +165,43 @@ DRESULT disk_write (
         len  = count;
     }
     
+    if (medias[drv].blockSize == SECTOR_SIZE_DEFAULT
+        && len < WRITE_CACHE_SECTORS) {
+
+        // rewrite of a cached sector (FAT, directory, partial file sector)
+        if (cache_overlaps(drv, addr, len)
+            && addr >= cacheAddr && addr + len <= cacheAddr + cacheLen) {
+
+            memcpy(&writeCache[(addr - cacheAddr) * SECTOR_SIZE_DEFAULT],
+                   buff, len * SECTOR_SIZE_DEFAULT);
+            return RES_OK;
+        }
+
+        // not the continuation of the cached run
+        if (cacheLen && (drv != cacheDrv
+                         || addr != cacheAddr + cacheLen
+                         || cacheLen + len > WRITE_CACHE_SECTORS)) {
+            if (cache_flush() != RES_OK)
+                return RES_ERROR;
+        }
+
+        if (cacheLen == 0) {
+            cacheDrv = drv;
+            cacheAddr = addr;
+        }
+        memcpy(&writeCache[cacheLen * SECTOR_SIZE_DEFAULT],
+               buff, len * SECTOR_SIZE_DEFAULT);
+        cacheLen += len;
+
+        if (cacheLen == WRITE_CACHE_SECTORS)
+            return cache_flush();
+        return RES_OK;
+    }
+
+    // long runs go straight to the card, after what is cached
+    if (cache_flush() != RES_OK)
+        return RES_ERROR;
+
     result = MED_Write(&medias[drv],
                        addr,              // address
                        (void*)tmp,         // data
@@ -190,9 +276,14 @@ DRESULT disk_ioctl (
             break;
 
         case CTRL_SYNC :   /* Make sure that data has been written */ 
-            res = RES_OK; 
+            res = cache_flush(); 
             break; 
 
+        case CTRL_EJECT :   /* Card is gone, drop what is cached */
+            cacheLen = 0;
+            res = RES_OK;
+            break;
+
         default: 
             res = RES_PARERR; 
     }
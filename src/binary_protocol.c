@@ -0,0 +1,195 @@
+/*
+ Binary motion protocol
+ Frame decoder for the compact binary move stream (see binary_protocol.h)
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <inttypes.h>
+#include <string.h>
+
+#include "binary_protocol.h"
+
+enum DecoderPhase {
+	WAIT_SYNC,
+	WAIT_TYPE,
+	WAIT_SEQ,
+	WAIT_LEN,
+	WAIT_PAYLOAD,
+	WAIT_CRC_LO,
+	WAIT_CRC_HI,
+};
+
+typedef struct
+{
+	unsigned char state;
+	uint8_t pos;
+	uint16_t crc;
+	uint16_t rx_crc;
+	binproto_frame frame;
+} DecoderState;
+
+static DecoderState decoder;
+
+
+//--------------------------------------------------
+// CRC16 CCITT (x^16 + x^12 + x^5 + 1), MSB first
+//--------------------------------------------------
+uint16_t binproto_crc16(uint16_t crc, uint8_t data)
+{
+	unsigned char cnt_c;
+
+	crc ^= (uint16_t)data << 8;
+	for(cnt_c = 0;cnt_c < 8;cnt_c++)
+	{
+		if(crc & 0x8000)
+			crc = (crc << 1) ^ 0x1021;
+		else
+			crc <<= 1;
+	}
+	return crc;
+}
+
+void binproto_reset(void)
+{
+	memset(&decoder,0,sizeof(DecoderState));
+	decoder.state = WAIT_SYNC;
+}
+
+const binproto_frame* binproto_get_frame(void)
+{
+	return &decoder.frame;
+}
+
+//--------------------------------------------------
+// Feed one received byte into the frame decoder
+// returns BINPROTO_FRAME_OK when a complete frame with valid CRC is available,
+// BINPROTO_FRAME_BAD for a damaged frame and BINPROTO_PENDING otherwise
+//--------------------------------------------------
+int binproto_receive(uint8_t chr)
+{
+	switch(decoder.state)
+	{
+		case WAIT_SYNC:
+			if (chr == BINPROTO_SYNC)
+			{
+				decoder.crc = 0xFFFF;
+				decoder.state = WAIT_TYPE;
+			}
+			break;
+		case WAIT_TYPE:
+			decoder.frame.type = chr;
+			decoder.crc = binproto_crc16(decoder.crc,chr);
+			decoder.state = WAIT_SEQ;
+			break;
+		case WAIT_SEQ:
+			decoder.frame.seq = chr;
+			decoder.crc = binproto_crc16(decoder.crc,chr);
+			decoder.state = WAIT_LEN;
+			break;
+		case WAIT_LEN:
+			if (chr > BINPROTO_MAX_PAYLOAD)
+			{
+				decoder.state = WAIT_SYNC;
+				return BINPROTO_FRAME_BAD;
+			}
+			decoder.frame.len = chr;
+			decoder.crc = binproto_crc16(decoder.crc,chr);
+			decoder.pos = 0;
+			decoder.state = chr ? WAIT_PAYLOAD : WAIT_CRC_LO;
+			break;
+		case WAIT_PAYLOAD:
+			decoder.frame.payload[decoder.pos++] = chr;
+			decoder.crc = binproto_crc16(decoder.crc,chr);
+			if (decoder.pos >= decoder.frame.len)
+				decoder.state = WAIT_CRC_LO;
+			break;
+		case WAIT_CRC_LO:
+			decoder.rx_crc = chr;
+			decoder.state = WAIT_CRC_HI;
+			break;
+		case WAIT_CRC_HI:
+			decoder.rx_crc |= (uint16_t)chr << 8;
+			decoder.state = WAIT_SYNC;
+			return (decoder.rx_crc == decoder.crc) ? BINPROTO_FRAME_OK : BINPROTO_FRAME_BAD;
+		default:
+			decoder.state = WAIT_SYNC;
+			break;
+	}
+	return BINPROTO_PENDING;
+}
+
+//--------------------------------------------------
+// Build a frame in out (len + 6 bytes), returns the frame length
+//--------------------------------------------------
+int binproto_encode(uint8_t type, uint8_t seq, const uint8_t* payload, uint8_t len, uint8_t* out)
+{
+	uint16_t crc = 0xFFFF;
+	uint8_t cnt_c;
+
+	out[0] = BINPROTO_SYNC;
+	out[1] = type;
+	out[2] = seq;
+	out[3] = len;
+	memcpy(&out[4],payload,len);
+
+	for(cnt_c = 1;cnt_c < len + 4;cnt_c++)
+		crc = binproto_crc16(crc,out[cnt_c]);
+
+	out[len + 4] = crc & 0xFF;
+	out[len + 5] = crc >> 8;
+	return len + 6;
+}
+
+static int32_t get_int32(const uint8_t* ptr)
+{
+	return (int32_t)((uint32_t)ptr[0] | ((uint32_t)ptr[1] << 8) | ((uint32_t)ptr[2] << 16) | ((uint32_t)ptr[3] << 24));
+}
+
+//--------------------------------------------------
+// Unpack a move record, returns 0 if the payload length doesn't match the flags
+//--------------------------------------------------
+int binproto_decode_move(const binproto_frame* frame, binproto_move* move)
+{
+	const uint8_t* ptr = frame->payload;
+	const uint8_t* end = frame->payload + frame->len;
+	unsigned char cnt_c;
+
+	if (frame->len < 1)
+		return 0;
+
+	move->flags = *ptr++;
+
+	for(cnt_c = 0;cnt_c < 4;cnt_c++)
+	{
+		move->axis[cnt_c] = 0;
+		if (move->flags & (1<<cnt_c))
+		{
+			if (ptr + 4 > end)
+				return 0;
+			move->axis[cnt_c] = get_int32(ptr);
+			ptr += 4;
+		}
+	}
+
+	move->feedrate = 0;
+	if (move->flags & BINPROTO_MOVE_F)
+	{
+		if (ptr + 2 > end)
+			return 0;
+		move->feedrate = (uint16_t)ptr[0] | ((uint16_t)ptr[1] << 8);
+		ptr += 2;
+	}
+
+	return ptr == end;
+}
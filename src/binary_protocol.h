@@ -0,0 +1,79 @@
+/*
+ Binary motion protocol
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef BINARY_PROTOCOL_H_7KQ2MZP4
+#define BINARY_PROTOCOL_H_7KQ2MZP4
+
+#include <inttypes.h>
+
+// Frame layout (all values little endian):
+//
+//   SYNC | type | seq | len | payload[len] | crc16 lo | crc16 hi
+//
+// The CRC16 (CCITT, start 0xFFFF) covers type, seq, len and the payload.
+// SYNC is never part of ASCII G-code, so the decoder can resynchronise
+// on it after a damaged frame.
+#define BINPROTO_SYNC			0xFE
+#define BINPROTO_MAX_PAYLOAD	96
+
+// Frames the host may have in flight without acknowledge
+#define BINPROTO_WINDOW			8
+
+// Frame types host --> firmware
+#define BINPROTO_TYPE_MOVE		0x01	// fixed point move record
+#define BINPROTO_TYPE_LINE		0x02	// ASCII G-code line without N and checksum
+#define BINPROTO_TYPE_EXIT		0x03	// leave binary mode, back to ASCII
+
+// Frame types firmware --> host
+#define BINPROTO_TYPE_TELEMETRY	0x81	// status record, see telemetry.h
+
+// Move record flags
+#define BINPROTO_MOVE_X			(1<<0)
+#define BINPROTO_MOVE_Y			(1<<1)
+#define BINPROTO_MOVE_Z			(1<<2)
+#define BINPROTO_MOVE_E			(1<<3)
+#define BINPROTO_MOVE_F			(1<<4)
+
+// Move record on the wire: flags (1 byte), X Y Z E as int32 in 1/1000 mm,
+// F as uint16 in mm/min. Axes without flag are not transmitted.
+#define BINPROTO_AXIS_SCALE		1000.0f
+
+// Decoder results
+#define BINPROTO_PENDING		0
+#define BINPROTO_FRAME_OK		1
+#define BINPROTO_FRAME_BAD		-1
+
+typedef struct {
+	uint8_t type;
+	uint8_t seq;
+	uint8_t len;
+	uint8_t payload[BINPROTO_MAX_PAYLOAD];
+} binproto_frame;
+
+typedef struct {
+	uint8_t flags;
+	int32_t axis[4];
+	uint16_t feedrate;
+} binproto_move;
+
+void binproto_reset(void);
+int binproto_receive(uint8_t chr);
+const binproto_frame* binproto_get_frame(void);
+int binproto_decode_move(const binproto_frame* frame, binproto_move* move);
+uint16_t binproto_crc16(uint16_t crc, uint8_t data);
+int binproto_encode(uint8_t type, uint8_t seq, const uint8_t* payload, uint8_t len, uint8_t* out);
+
+#endif /* end of include guard: BINARY_PROTOCOL_H_7KQ2MZP4 */
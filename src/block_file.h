@@ -0,0 +1,80 @@
+/*
+ Block files
+ Pre-planned motion for SD replay: the output of the firmware's own
+ planner, compiled on the host with blockc (see blockc.c), pushed into the
+ block buffer without parsing or planning.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef BLOCK_FILE_H_H6XK1R8D
+#define BLOCK_FILE_H_H6XK1R8D
+
+#include <inttypes.h>
+
+// Layout, all values little endian, the structs have the same layout on
+// the host and the SAM3U (only naturally aligned 8/16/32 bit fields):
+//
+//   0    BlockFileHeader
+//   64   records: uint8 type, uint8 payload length, payload
+//
+// BLOCKFILE_BLOCK carries a BlockRecord. BLOCKFILE_LINE carries a G-code
+// line (without line end) for everything that isn't a move, it goes
+// through the G-code parser when it's reached. Lines that wait for the
+// motion (G4, G28, M109, ...) follow the last block planned before them,
+// the next block starts from rest like after st_synchronize().
+// The blocks are replanned when they are pushed, so the last block in the
+// buffer always ends at the minimum speed, also when the replay falls
+// behind.
+#define BLOCKFILE_MAGIC			"4PBF"
+#define BLOCKFILE_VERSION		1
+#define BLOCKFILE_HEADER_SIZE	64
+
+#define BLOCKFILE_BLOCK			1
+#define BLOCKFILE_LINE			2
+#define BLOCKFILE_MAX_PAYLOAD	96
+
+typedef struct
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t blocks;
+	uint32_t lines;
+	float steps_per_unit[4];			// the blocks are only valid for these
+	uint8_t reserved[BLOCKFILE_HEADER_SIZE - 32];
+} BlockFileHeader;
+
+typedef struct
+{
+	int32_t delta[4];					// planner position change in steps (E without extrudemultiply)
+	uint32_t steps_e;					// E steps with extrudemultiply
+	uint32_t step_event_count;
+	int32_t accelerate_until;
+	int32_t decelerate_after;
+	int32_t acceleration_rate;
+	int32_t nominal_rate;
+	int32_t initial_rate;
+	int32_t final_rate;
+	int32_t acceleration_st;
+	float nominal_speed;				// planner fields, the firmware replans the
+	float entry_speed;					// junctions with them like its own blocks
+	float max_entry_speed;				// (entry speed and rates are recomputed)
+	float millimeters;
+	float acceleration;
+	uint8_t direction_bits;
+	uint8_t active_extruder;
+	uint8_t nominal_length_flag;
+	uint8_t reserved;
+} BlockRecord;
+
+#endif /* end of include guard: BLOCK_FILE_H_H6XK1R8D */
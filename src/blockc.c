@@ -0,0 +1,534 @@
+/*
+ Block file compiler (host tool)
+ Runs a G-code file through the firmware's own planner.c and arc_func.c
+ and writes the planned blocks as a block file (see block_file.h):
+
+   make blockc
+   bin/blockc [-s settings.g] part.gcode PART.BLK
+
+ settings.g holds the machine's planner settings as G-code (M92, M201,
+ M202, M204, M205, M520, M522 lines as printed by M503), without it the
+ defaults from init_configuration.h are used. The firmware refuses files
+ made for other steps per unit.
+
+ The planner sees the G-code the same way as on the printer with a full
+ block buffer: a block is written out when the buffer is full, i.e. with
+ the same look ahead it gets while the printer streams. Only moves and
+ the planner settings are handled here, every other line goes into the
+ file and is run by the firmware's G-code parser during the replay.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#include "init_configuration.h"
+#include "parameters.h"
+#include "planner.h"
+#include "heaters.h"
+#include "globals.h"
+#include "block_file.h"
+
+#define LINE_SIZE	256
+
+// firmware symbols the planner needs, without the hardware
+parameter_struct pa;
+heater_struct heaters[NUM_HEATERS];
+volatile unsigned long timestamp = 0;
+
+extern block_t block_buffer[];
+extern volatile unsigned char block_buffer_head;
+extern volatile unsigned char block_buffer_tail;
+extern long position[];
+
+static char lineBuffer[LINE_SIZE];
+static char* parsePos = lineBuffer;
+static unsigned char motionMode = 1;
+
+static FILE* out;
+static BlockFileHeader header;
+static int32_t blockDelta[BLOCK_BUFFER_SIZE][NUM_AXIS];	// planner position change of each queued block
+
+
+void motor_enaxis(unsigned char axis, unsigned char en)
+{
+}
+
+void heater_switch(unsigned char heater, unsigned char en)
+{
+}
+
+void st_set_position(long x, long y, long z, long e)
+{
+}
+
+void heater_task(void)
+{
+}
+
+// planner.c is built with printf --> blockc_trace, its debug output isn't wanted
+int blockc_trace(const char* format, ...)
+{
+	return 0;
+}
+
+//--------------------------------------------------
+// The parser interface get_coordinates() uses
+//--------------------------------------------------
+int32_t get_int(char chr)
+{
+	char* ptr = strchr(parsePos,chr);
+	return ptr ? strtol(ptr+1,NULL,10) : 0;
+}
+
+uint32_t get_uint(char chr)
+{
+	char* ptr = strchr(parsePos,chr);
+	return ptr ? strtoul(ptr+1,NULL,10) : 0;
+}
+
+float get_float(char chr)
+{
+	char* ptr = strchr(parsePos,chr);
+	return ptr ? strtod(ptr+1,NULL) : 0;
+}
+
+const char* get_str(char chr)
+{
+	char* ptr = strchr(parsePos,chr);
+	return ptr ? ptr+1 : NULL;
+}
+
+int has_code(char chr)
+{
+	return strchr(parsePos,chr) != NULL;
+}
+
+static void init_planner_parameters(void)
+{
+	float maxFeedrate[NUM_AXIS] = _MAX_FEEDRATE;
+	float stepsPerUnit[NUM_AXIS] = _AXIS_STEP_PER_UNIT;
+	float homingFeedrate[3] = _HOMING_FEEDRATE;
+	unsigned long maxAcceleration[NUM_AXIS] = _MAX_ACCELERATION_UNITS_PER_SQ_SECOND;
+	int i;
+
+	for(i = 0;i < NUM_AXIS;i++)
+	{
+		pa.max_feedrate[i] = maxFeedrate[i];
+		pa.axis_steps_per_unit[i] = stepsPerUnit[i];
+		pa.max_acceleration_units_per_sq_second[i] = maxAcceleration[i];
+		if (i < 3)
+			pa.homing_feedrate[i] = homingFeedrate[i];
+	}
+	pa.minimumfeedrate = DEFAULT_MINIMUMFEEDRATE;
+	pa.retract_acceleration = _RETRACT_ACCELERATION;
+	pa.max_xy_jerk = _MAX_XY_JERK;
+	pa.max_z_jerk = _MAX_Z_JERK;
+	pa.max_e_jerk = _MAX_E_JERK;
+	pa.mintravelfeedrate = DEFAULT_MINTRAVELFEEDRATE;
+	pa.move_acceleration = _ACCELERATION;
+	pa.min_software_endstops = _MIN_SOFTWARE_ENDSTOPS;
+	pa.max_software_endstops = _MAX_SOFTWARE_ENDSTOPS;
+	pa.x_max_length = _X_MAX_LENGTH;
+	pa.y_max_length = _Y_MAX_LENGTH;
+	pa.z_max_length = _Z_MAX_LENGTH;
+	pa.x_home_dir = X_HOME_DIR;
+	pa.y_home_dir = Y_HOME_DIR;
+	pa.z_home_dir = Z_HOME_DIR;
+}
+
+//--------------------------------------------------
+// Output
+//--------------------------------------------------
+static void write_record(uint8_t type, const void* payload, uint8_t len)
+{
+	fputc(type,out);
+	fputc(len,out);
+	fwrite(payload,1,len,out);
+}
+
+// the oldest block, as the stepper interrupt would take it
+static void emit_block(void)
+{
+	unsigned char index = block_buffer_tail;
+	block_t* block = plan_get_current_block();
+	BlockRecord rec;
+	int i;
+
+	memset(&rec,0,sizeof(rec));
+	for(i = 0;i < NUM_AXIS;i++)
+		rec.delta[i] = blockDelta[index][i];
+	rec.steps_e = block->steps_e;
+	rec.step_event_count = block->step_event_count;
+	rec.accelerate_until = block->accelerate_until;
+	rec.decelerate_after = block->decelerate_after;
+	rec.acceleration_rate = block->acceleration_rate;
+	rec.nominal_rate = block->nominal_rate;
+	rec.initial_rate = block->initial_rate;
+	rec.final_rate = block->final_rate;
+	rec.acceleration_st = block->acceleration_st;
+	rec.nominal_speed = block->nominal_speed;
+	rec.entry_speed = block->entry_speed;
+	rec.max_entry_speed = block->max_entry_speed;
+	rec.millimeters = block->millimeters;
+	rec.acceleration = block->acceleration;
+	rec.direction_bits = block->direction_bits;
+	rec.active_extruder = block->active_extruder;
+	rec.nominal_length_flag = block->nominal_length_flag;
+
+	write_record(BLOCKFILE_BLOCK,&rec,sizeof(rec));
+	header.blocks++;
+	plan_discard_current_block();
+}
+
+// everything queued goes out, the next move starts from rest
+static void flush_planner(void)
+{
+	while (calc_plannerpuffer_fill())
+		emit_block();
+	plan_set_position(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS]);
+}
+
+static void emit_line(const char* line)
+{
+	size_t len = strlen(line);
+
+	if (len > BLOCKFILE_MAX_PAYLOAD)
+	{
+		fprintf(stderr,"blockc: line too long, skipped: %s\n",line);
+		return;
+	}
+	write_record(BLOCKFILE_LINE,line,len);
+	header.lines++;
+}
+
+//--------------------------------------------------
+// Moves: a free slot before every block keeps plan_buffer_line()
+// from waiting, the planner position change is kept for the record
+//--------------------------------------------------
+static void make_room(void)
+{
+	if (calc_plannerpuffer_free() < 1)
+		emit_block();
+}
+
+static void record_delta(const long* before)
+{
+	unsigned char index = (block_buffer_head - 1) & (BLOCK_BUFFER_SIZE - 1);
+	int i;
+
+	for(i = 0;i < NUM_AXIS;i++)
+		blockDelta[index][i] = position[i] - before[i];
+}
+
+// arc_func.c is built with plan_buffer_line --> blockc_buffer_line
+void blockc_buffer_line(float x, float y, float z, float e, float feed_rate, unsigned char extruder)
+{
+	long before[NUM_AXIS];
+	unsigned char head;
+
+	make_room();
+	memcpy(before,position,sizeof(before));
+	head = block_buffer_head;
+	plan_buffer_line(x,y,z,e,feed_rate,extruder);
+	if (block_buffer_head != head)
+		record_delta(before);
+}
+
+static void move(unsigned char mode)
+{
+	long before[NUM_AXIS];
+	unsigned char head;
+
+	if (mode <= 1)
+	{
+		get_coordinates();
+		make_room();
+		memcpy(before,position,sizeof(before));
+		head = block_buffer_head;
+		prepare_move();
+		if (block_buffer_head != head)
+			record_delta(before);
+	}
+	else
+	{
+		get_arc_coordinates();
+		prepare_arc_move(mode == 2);
+	}
+}
+
+//--------------------------------------------------
+// Planner settings, same as in the G-code parser
+//--------------------------------------------------
+static int settings(int code)
+{
+	int i;
+
+	switch(code)
+	{
+		case 92:
+			for(i = 0;i < NUM_AXIS;i++)
+			{
+				if (has_code(axis_codes[i]))
+				{
+					pa.axis_steps_per_unit[i] = get_float(axis_codes[i]);
+					axis_steps_per_sqr_second[i] = pa.max_acceleration_units_per_sq_second[i] * pa.axis_steps_per_unit[i];
+				}
+			}
+			return 1;
+		case 201:
+			for(i = 0;i < NUM_AXIS;i++)
+			{
+				if (has_code(axis_codes[i]))
+				{
+					pa.max_acceleration_units_per_sq_second[i] = get_float(axis_codes[i]);
+					axis_steps_per_sqr_second[i] = pa.max_acceleration_units_per_sq_second[i] * pa.axis_steps_per_unit[i];
+				}
+			}
+			return 1;
+		case 202:
+			for(i = 0;i < NUM_AXIS;i++)
+				if (has_code(axis_codes[i]))
+					pa.max_feedrate[i] = get_float(axis_codes[i]);
+			return 1;
+		case 204:
+			if (has_code('S'))
+				pa.move_acceleration = get_float('S');
+			if (has_code('T'))
+				pa.retract_acceleration = get_float('T');
+			return 1;
+		case 205:
+			if (has_code('S'))
+				pa.minimumfeedrate = get_float('S');
+			if (has_code('T'))
+				pa.mintravelfeedrate = get_float('T');
+			if (has_code('X'))
+				pa.max_xy_jerk = get_float('X');
+			if (has_code('Z'))
+				pa.max_z_jerk = get_float('Z');
+			if (has_code('E'))
+				pa.max_e_jerk = get_float('E');
+			return 1;
+		case 520:
+			if (has_code('X'))
+				pa.x_max_length = get_int('X');
+			if (has_code('Y'))
+				pa.y_max_length = get_int('Y');
+			if (has_code('Z'))
+				pa.z_max_length = get_int('Z');
+			return 1;
+		case 522:
+			if (has_code('I'))
+				pa.min_software_endstops = get_int('I') ? 1 : 0;
+			if (has_code('A'))
+				pa.max_software_endstops = get_int('A') ? 1 : 0;
+			return 1;
+		case 220:
+			if (has_code('S'))
+				feedmultiply = constrain(get_uint('S'), 20, 200);
+			return 1;
+		case 221:
+			if (has_code('S'))
+				extrudemultiply = constrain(get_uint('S'), 40, 200);
+			return 1;
+	}
+	return 0;
+}
+
+// G28 ends where homing_routine() leaves the axis
+static void home_axis(unsigned char axis, signed short dir, signed short length)
+{
+	current_position[axis] = (dir == -1) ? 0 : length;
+	current_position[axis] += add_homing[axis];
+}
+
+//--------------------------------------------------
+// One line of G-code, forward = 0 for the settings file
+//--------------------------------------------------
+static void process_line(char* line, int forward)
+{
+	char* ptr;
+	char* end;
+	int code;
+	int all;
+
+	if ((ptr = strchr(line,';')) != NULL)
+		*ptr = 0;
+	if ((ptr = strchr(line,'*')) != NULL)
+		*ptr = 0;
+	while (*line && isspace((unsigned char)*line))
+		line++;
+	if (*line == 'N')
+	{
+		line++;
+		while (isdigit((unsigned char)*line) || *line == '-' || *line == ' ')
+			line++;
+	}
+	end = line + strlen(line);
+	while (end > line && isspace((unsigned char)end[-1]))
+		*--end = 0;
+	if (!*line)
+		return;
+
+	parsePos = line;
+	code = get_int(line[0]);
+
+	// coordinate only lines repeat the last motion command,
+	// F alone only sets the feedrate
+	if (strchr("XYZEFIJ",line[0]))
+	{
+		if (has_code('X') || has_code('Y') || has_code('Z') || has_code('E') || has_code('I') || has_code('J'))
+			move(motionMode);
+		else if (get_int('F') > 0)
+			feedrate = get_int('F');
+		return;
+	}
+
+	if (line[0] == 'G')
+	{
+		switch(code)
+		{
+			case 0:
+			case 1:
+			case 2:
+			case 3:
+				motionMode = code;
+				move(code);
+				return;
+			case 90:
+				relative_mode = 0;
+				break;
+			case 91:
+				relative_mode = 1;
+				break;
+			case 92:
+				flush_planner();
+				for(code = 0;code < NUM_AXIS;code++)
+					if (has_code(axis_codes[code]))
+						current_position[code] = get_float(axis_codes[code]);
+				plan_set_position(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS]);
+				break;
+			case 28:
+				flush_planner();
+				all = !has_code('X') && !has_code('Y') && !has_code('Z');
+				if (all || has_code('X'))
+					home_axis(X_AXIS,pa.x_home_dir,pa.x_max_length);
+				if (all || has_code('Y'))
+					home_axis(Y_AXIS,pa.y_home_dir,pa.y_max_length);
+				if (all || has_code('Z'))
+					home_axis(Z_AXIS,pa.z_home_dir,pa.z_max_length);
+				plan_set_position(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS]);
+				break;
+			default:
+				// G4 and everything unknown waits for the moves
+				flush_planner();
+				break;
+		}
+	}
+	else if (line[0] == 'M')
+	{
+		switch(code)
+		{
+			case 82:
+				axis_relative_modes[E_AXIS] = 0;
+				break;
+			case 83:
+				axis_relative_modes[E_AXIS] = 1;
+				break;
+			// run ahead of the moves like in the parser
+			case 104:
+			case 106:
+			case 107:
+			case 117:
+			case 140:
+				break;
+			default:
+				if (!settings(code))
+					flush_planner();
+				break;
+		}
+	}
+	else if (line[0] == 'T')
+	{
+		flush_planner();
+		active_extruder = code;
+	}
+
+	if (forward)
+		emit_line(line);
+}
+
+static int process_file(const char* name, int forward)
+{
+	FILE* in = fopen(name,"r");
+
+	if (!in)
+	{
+		perror(name);
+		return 0;
+	}
+	while (fgets(lineBuffer,LINE_SIZE,in))
+		process_line(lineBuffer,forward);
+	fclose(in);
+	return 1;
+}
+
+int main(int argc, char** argv)
+{
+	int i;
+
+	init_planner_parameters();
+	plan_init();
+
+	if (argc == 5 && strcmp(argv[1],"-s") == 0)
+	{
+		if (!process_file(argv[2],0))
+			return 1;
+		argv += 2;
+		argc -= 2;
+	}
+	if (argc != 3)
+	{
+		fprintf(stderr,"usage: blockc [-s settings.g] infile outfile\n");
+		return 1;
+	}
+
+	out = fopen(argv[2],"wb");
+	if (!out)
+	{
+		perror(argv[2]);
+		return 1;
+	}
+
+	memcpy(header.magic,BLOCKFILE_MAGIC,4);
+	header.version = BLOCKFILE_VERSION;
+	for(i = 0;i < NUM_AXIS;i++)
+		header.steps_per_unit[i] = pa.axis_steps_per_unit[i];
+	fwrite(&header,1,sizeof(header),out);
+
+	if (!process_file(argv[1],1))
+		return 1;
+	flush_planner();
+
+	fseek(out,0,SEEK_SET);
+	fwrite(&header,1,sizeof(header),out);
+	fclose(out);
+
+	printf("%s: %u blocks, %u lines\n",argv[2],header.blocks,header.lines);
+	return 0;
+}
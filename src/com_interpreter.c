@@ -444,13 +444,13 @@ void process_commands()
 		}
         break;
       case 140: // M140 set bed temp
-		if (code_seen('S')) bed_heater.target_temp = code_value();
+		if (code_seen('S')) heaters[HEATER_IDX_BED].target_temp = code_value();
         break;
       case 105: // M105
 		  	if(tmp_extruder < MAX_EXTRUDER)
-				usb_printf("ok T:%u @%u B:%u",heaters[tmp_extruder].akt_temp,heaters[tmp_extruder].pwm,bed_heater.akt_temp);
+				usb_printf("ok T:%u @%u B:%u",heaters[tmp_extruder].akt_temp,heaters[tmp_extruder].pwm,heaters[HEATER_IDX_BED].akt_temp);
 			else
-				usb_printf("ok T:%u @%u B:%u",heaters[0].akt_temp,heaters[0].pwm,bed_heater.akt_temp);
+				usb_printf("ok T:%u @%u B:%u",heaters[0].akt_temp,heaters[0].pwm,heaters[HEATER_IDX_BED].akt_temp);
         //return;
         break;
       case 109: // M109 - Wait for extruder heater to reach target.
@@ -497,16 +497,16 @@ void process_commands()
 		
       case 190: // M190 - Wait for bed heater to reach target temperature.
 		
-		if (code_seen('S')) bed_heater.target_temp = code_value();
+		if (code_seen('S')) heaters[HEATER_IDX_BED].target_temp = code_value();
 		codenum = timestamp; 
-		while(bed_heater.akt_temp < bed_heater.target_temp) 
+		while(heaters[HEATER_IDX_BED].akt_temp < heaters[HEATER_IDX_BED].target_temp) 
 		{
 			if( (timestamp - codenum) > 1000 ) //Print Temp Reading every 1 second while heating up.
 			{
 				if(tmp_extruder < MAX_EXTRUDER)
-					usb_printf("T:%u B:%u",heaters[tmp_extruder].akt_temp,bed_heater.akt_temp);
+					usb_printf("T:%u B:%u",heaters[tmp_extruder].akt_temp,heaters[HEATER_IDX_BED].akt_temp);
 				else
-					usb_printf("T:%u B:%u",heaters[0].akt_temp,bed_heater.akt_temp);
+					usb_printf("T:%u B:%u",heaters[0].akt_temp,heaters[HEATER_IDX_BED].akt_temp);
 				
 				codenum = timestamp; 
 			}
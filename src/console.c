@@ -0,0 +1,195 @@
+/*
+ Buffered DBGU console
+ printf() output goes into a ring buffer which the DBGU PDC sends in the
+ background, a printf costs a copy instead of waiting for 115200 baud.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <board.h>
+#include <irq/irq.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "init_configuration.h"
+#include "console.h"
+
+// Size of the output buffer (power of two)
+#define CONSOLE_BUFFER_SIZE 2048
+
+static char consoleBuffer[CONSOLE_BUFFER_SIZE];
+// Free running positions, consoleHead is moved by the writers, consoleTail by the PDC interrupt
+static volatile unsigned int consoleHead = 0;
+static volatile unsigned int consoleTail = 0;
+// Bytes handed to the PDC, 0 = transmitter idle
+static volatile unsigned int consoleSending = 0;
+static unsigned char consoleReady = 0;
+
+// Texts dropped because the buffer was full
+unsigned int console_dropped = 0;
+
+
+//--------------------------------------------------
+// Hand the next contiguous part of the buffer to the PDC
+// must be called with interrupts disabled
+//--------------------------------------------------
+static void console_start(void)
+{
+	unsigned int pos = consoleTail & (CONSOLE_BUFFER_SIZE-1);
+	unsigned int len = consoleHead - consoleTail;
+
+	if (len > CONSOLE_BUFFER_SIZE - pos)
+		len = CONSOLE_BUFFER_SIZE - pos;
+
+	consoleSending = len;
+	if (len == 0)
+	{
+		AT91C_BASE_DBGU->DBGU_IDR = AT91C_US_ENDTX;
+		return;
+	}
+
+	AT91C_BASE_DBGU->DBGU_TPR = (unsigned int)&consoleBuffer[pos];
+	AT91C_BASE_DBGU->DBGU_TCR = len;
+	AT91C_BASE_DBGU->DBGU_IER = AT91C_US_ENDTX;
+}
+
+void DBGU_IrqHandler(void)
+{
+	if ((AT91C_BASE_DBGU->DBGU_CSR & AT91C_US_ENDTX) && consoleSending)
+	{
+		consoleTail += consoleSending;
+		console_start();
+	}
+}
+
+//--------------------------------------------------
+// Waiting for space only works in thread mode with
+// interrupts on, otherwise the PDC interrupt can't run
+//--------------------------------------------------
+static int console_can_wait(unsigned int primask)
+{
+#if CONSOLE_OVERFLOW_WAIT
+	return consoleReady && !primask && !(SCB->ICSR & 0x1FF);
+#else
+	return 0;
+#endif
+}
+
+//--------------------------------------------------
+// Copy text into the buffer, whole or not at all
+// callable from interrupts
+//--------------------------------------------------
+static int console_write(const char* data, unsigned int len)
+{
+	unsigned int primask, pos, first;
+
+	if (len > CONSOLE_BUFFER_SIZE)
+		len = CONSOLE_BUFFER_SIZE;
+
+	for(;;)
+	{
+		primask = __get_PRIMASK();
+		__disable_irq();
+		if (CONSOLE_BUFFER_SIZE - (consoleHead - consoleTail) >= len)
+			break;
+		if (!primask)
+			__enable_irq();
+
+		if (!console_can_wait(primask))
+		{
+			console_dropped++;
+			return 0;
+		}
+	}
+
+	pos = consoleHead & (CONSOLE_BUFFER_SIZE-1);
+	first = CONSOLE_BUFFER_SIZE - pos;
+	if (first > len)
+		first = len;
+	memcpy(&consoleBuffer[pos],data,first);
+	memcpy(consoleBuffer,data+first,len-first);
+	consoleHead += len;
+
+	if (consoleReady && !consoleSending)
+		console_start();
+
+	if (!primask)
+		__enable_irq();
+	return 1;
+}
+
+//--------------------------------------------------
+// Replacements for the polling versions in at91lib
+// trace.c (built with NOFPUT), used by printf()
+//--------------------------------------------------
+signed int fputc(signed int c, FILE *pStream)
+{
+	char chr = c;
+
+	if ((pStream != stdout) && (pStream != stderr))
+		return EOF;
+
+	console_write(&chr,1);
+	return c;
+}
+
+signed int fputs(const char *pStr, FILE *pStream)
+{
+	unsigned int len = strlen(pStr);
+
+	if ((pStream != stdout) && (pStream != stderr))
+		return -1;
+
+	console_write(pStr,len);
+	return len;
+}
+
+#undef putchar
+signed int putchar(signed int c)
+{
+	return fputc(c, stdout);
+}
+
+//--------------------------------------------------
+// Start the background output, the DBGU must be
+// configured (TRACE_CONFIGURE) before. Text printed
+// earlier is sent now.
+//--------------------------------------------------
+void console_init(void)
+{
+	AT91C_BASE_DBGU->DBGU_IDR = AT91C_US_ENDTX;
+	AT91C_BASE_DBGU->DBGU_TCR = 0;
+	AT91C_BASE_DBGU->DBGU_PTCR = AT91C_PDC_TXTEN;
+
+	IRQ_ConfigureIT(AT91C_ID_DBGU, 3, DBGU_IrqHandler);
+	IRQ_EnableIT(AT91C_ID_DBGU);
+
+	__disable_irq();
+	consoleReady = 1;
+	if (!consoleSending)
+		console_start();
+	__enable_irq();
+}
+
+//--------------------------------------------------
+// Wait until everything is sent (before a reset or
+// a fault halt), works with interrupts disabled
+//--------------------------------------------------
+void console_flush(void)
+{
+	while (consoleReady && consoleHead != consoleTail)
+	{
+		if (AT91C_BASE_DBGU->DBGU_CSR & AT91C_US_ENDTX)
+			DBGU_IrqHandler();
+	}
+}
@@ -0,0 +1,25 @@
+/*
+ Buffered DBGU console
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef CONSOLE_H_4XW8RT2N
+#define CONSOLE_H_4XW8RT2N
+
+extern unsigned int console_dropped;
+
+void console_init(void);
+void console_flush(void);
+
+#endif /* end of include guard: CONSOLE_H_4XW8RT2N */
@@ -25,6 +25,7 @@ Implemented Codes
  G1	 - Coordinated Movement X Y Z E
  G2	 - CW ARC
  G3	 - CCW ARC
+		G0 - G3 are modal: lines with only coordinates (X10.2 Y5.1 E0.03) repeat the last motion command
  G4	 - Dwell S<seconds> or P<milliseconds>
  G28 - Home all Axis
  G90 - Use Absolute Coordinates
@@ -43,10 +44,11 @@ Custom M Codes
  M20  - List SD card
  M21  - Init SD card
  M22  - Release SD card
- M23  - Select SD file (M23 filename.g)
+ M23  - Select SD file (M23 filename.g), files compressed with lz_compress.py are detected by their header,
+        block files from blockc go to the planner buffer without parsing
  M24  - Start/resume SD print
  M25  - Pause SD print
- M26  - Set SD position in bytes (M26 S12345)
+ M26  - Set SD position in bytes (M26 S12345), at line (M26 L1200) or layer (M26 P42), see sdcard_index.h
  M27  - Report SD print status
  M28  - Start SD write (M28 filename.g)
  M29  - Stop SD write
@@ -65,7 +67,8 @@ Custom M Codes
  M115	- Capabilities string
  M119 - Show Endstop State 
  M140 - Set bed target temp
- M176 - Fan 2 on
+ M141 - Set chamber target temp (with CHAMBER_HEATER)
+ M176 - Fan 2 on (not with CHAMBER_HEATER, its output drives the chamber)
  M177 - Fan 2 off
  M190 - Wait for bed current temp to reach target temp.
  M201 - Set maximum acceleration in units/s^2 for print moves (M201 X1000 Y1000)
@@ -82,6 +85,8 @@ Custom M Codes
 Note: M301, M303, M304 applies to currently selected extruder.	Use T0 or T1 to select.
  M301 - Set Heater parameters P, I, D, S (slope), B (y-intercept), W (maximum pwm)
  M303 - PID relay autotune S<temperature> sets the target temperature. (default target temperature = 150C)
+		B<temperature> tunes the bed, in the background: the heaters tune at once (M303 T0 S200 B60, M303 T1 S200),
+		the gains are set when a test finishes, M500 stores those of the extruders. Progress with M547.
  M304 - Calculate slope and y-intercept for HEATER_DUTY_FOR_SETPOINT formula.
 		 Caution - this can take 30 minutes to complete and will heat the hotend 
 				   to 200 degrees.
@@ -97,9 +102,21 @@ Note: M301, M303, M304 applies to currently selected extruder.	Use T0 or T1 to s
  M525 - Set homing direction 1=+, -1=- (M525 X-1 Y-1 Z-1)
  M526 - Invert endstop inputs 0=false, 1=true (M526 X0 Y0 Z0)
  
-Note: M530, M531 applies to currently selected extruder.  Use T0 or T1 to select.
+Note: M530, M531, M532 applies to currently selected extruder.  Use T0 or T1 to select.
  M530 - Set heater sensor (thermocouple) type B (bed) E (extruder) (M530 E11 B11)
  M531 - Set heater PWM mode 0=false, 1=true (M531 E1)
+ M532 - Set heater control mode 0=off, 1=on/off, 2=PID B (bed, PID after M303 B) E (extruder) (M532 E2 B1)
+ 
+ M540 - Extended ok replies 0=false, 1=true (M540 S1) --> "ok P<planner blocks free> B<USB receive bytes free> N<last line>",
+        B counts whole free 512 byte receive buffers, lines are parsed from there at once (no command queue)
+ M541 - Binary motion protocol 0=ASCII, 1=binary (M541 S1) --> "ok W<window>", see binary_protocol.h
+ M542 - Binary telemetry record rate in Hz, 0=off (M542 S20), see telemetry.h
+ M543 - SD card as USB drive 0=firmware, 1=host (M543 S1), ejecting on the host also returns it,
+        S0 is refused while the host locks the medium, the card comes back after the running host transfer
+ M544 - Build the line/layer index of the selected SD file (also built on the first full replay)
+ M545 - Resume an SD print from the power loss journal: home X/Y first, then M545, heat up (M109/M190) and M24, see journal.h
+ M546 - Main loop task statistics (runs, CPU share, worst cases), M546 R resets them, see scheduler.h
+ M547 - PID autotune progress and results of all heaters, M547 S0 stops the running tests
  
  M350 - Set microstepping steps (M350 X16 Y16 Z16 E16 B16)
  M906 - Set motor current (mV) (M906 X1000 Y1000 Z1000 E1000 B1000) or set all (M906 S1000)
@@ -133,6 +150,10 @@ Note: M530, M531 applies to currently selected extruder.  Use T0 or T1 to select
 #include "motoropts.h"
 #include "sdcard.h"
 #include "globals.h"
+#include "binary_protocol.h"
+#include "telemetry.h"
+#include "journal.h"
+#include "scheduler.h"
 
 #define BUFFER_SIZE 256
 
@@ -145,56 +166,6 @@ Note: M530, M531 applies to currently selected extruder.  Use T0 or T1 to select
 #define DEBUG(...)
 #endif
 
-typedef struct 
-{
-	int readPos;
-	int writePos;
-	int numBytes;
-	uint8_t buffer[BUFFER_SIZE];
-} RingBuffer;
-
-
-void ringbuffer_init(RingBuffer* pBuffer)
-{
-	memset(pBuffer,0,sizeof(RingBuffer));
-}
-
-int ringbuffer_numFree(const RingBuffer* pBuffer)
-{
-	return BUFFER_SIZE-pBuffer->numBytes;
-}
-
-int ringbuffer_numAvailable(const RingBuffer* pBuffer)
-{
-	return pBuffer->numBytes;
-}
-
-uint8_t ringbuffer_get(RingBuffer* pBuffer)
-{
-	uint8_t b = pBuffer->buffer[pBuffer->readPos++];
-	pBuffer->readPos &= (BUFFER_SIZE-1);
-	pBuffer->numBytes--;
-	return b;
-}
-
-void ringbuffer_put(RingBuffer* pBuffer,uint8_t b)
-{
-	pBuffer->buffer[pBuffer->writePos++] = b;
-	pBuffer->writePos &= (BUFFER_SIZE-1);
-	pBuffer->numBytes++;
-}
-
-
-//----------------------------------------------------------------------------------------------
-static RingBuffer uartBuffer;
-
-static void gcode_datareceived(unsigned char chr)
-{
-	if (ringbuffer_numFree(&uartBuffer))
-		ringbuffer_put(&uartBuffer,chr);
-}
-
-
 typedef struct 
 {
 	int comment_mode : 1;
@@ -204,11 +175,30 @@ typedef struct
 	char commandBuffer[BUFFER_SIZE];
 	char* parsePos;
 	ReplyFunction replyFunc;
+	unsigned char extended_ok;
+	unsigned char motion_mode;		// active G0 - G3 for coordinate only lines
+	unsigned char binary_mode;
+	uint8_t binary_seq;				// next expected binary frame
+	unsigned char binary_acks;		// frames processed but not acknowledged yet
+	unsigned char binary_resend;	// resend request sent, wait for expected frame
+	unsigned char replay_line;		// line in commandBuffer comes from the SD card
+	unsigned char resume_lower;		// M545 parked the nozzle above resume_z, M24 lowers it
+	float resume_z;
 } ParserState;
 
 
 static ParserState parserState;
 
+// record of a block file, collected across the read-ahead buffers
+typedef struct
+{
+	uint8_t header[2];				// type, payload length
+	uint8_t fill;					// bytes collected, header included
+	uint8_t payload[BLOCKFILE_MAX_PAYLOAD] __attribute__((aligned(4)));
+} BlockReplay;
+
+static BlockReplay blockReplay;
+
 int32_t get_int(char chr)
 {
 	char* ptr = strchr(parserState.parsePos,chr);
@@ -274,6 +264,19 @@ static char* trim_line(char* line)
 	return line;
 }
 
+static char* skip_line_number(char* line)
+{
+	if (*line == 'N')
+	{
+		line++;
+		while ((*line >= '0' && *line <= '9') || *line == '-')
+			line++;
+		while (*line == ' ')
+			line++;
+	}
+	return line;
+}
+
 static uint8_t calculate_checksum(const char* pLine)
 {
 	uint8_t checksum = 0;
@@ -285,6 +288,8 @@ static uint8_t calculate_checksum(const char* pLine)
 
 #define sendReply(...) { if (parserState.replyFunc) { parserState.replyFunc(__VA_ARGS__); } }
 
+#define MOTION_MODE_NONE 0xFF
+
 enum ProcessReply {
 	NO_REPLY,
 	SEND_REPLY,
@@ -296,6 +301,36 @@ enum ProcessReply {
 #define GET(code,default_value) has_code(code) ? get_int(code) : default_value
 
 
+//linear and arc moves, called for G0 - G3 and for coordinate only lines with the active motion mode
+static int gcode_process_motion(unsigned char mode)
+{
+	switch(mode)
+	{
+		case 0:
+		case 1:
+			get_coordinates();
+			prepare_move();
+			break;
+		case 2:
+			get_arc_coordinates();
+			prepare_arc_move(1);
+			break;
+		case 3:
+			get_arc_coordinates();
+			prepare_arc_move(0);
+			break;
+		default:
+			sendReply("error: no motion mode active\n\r");
+			return NO_REPLY;
+	}
+	return SEND_REPLY;
+}
+
+static int has_motion_words()
+{
+	return has_code('X') || has_code('Y') || has_code('Z') || has_code('E') || has_code('I') || has_code('J');
+}
+
 //process the actual gcode command
 static int gcode_process_command()
 {
@@ -307,17 +342,10 @@ static int gcode_process_command()
 			{
 				case 0:
 				case 1:
-					get_coordinates();
-					prepare_move();
-					break;
 				case 2:
-					get_arc_coordinates();
-					prepare_arc_move(1);
-					break;
 				case 3:
-					get_arc_coordinates();
-					prepare_arc_move(0);
-					break;
+					parserState.motion_mode = get_int('G');
+					return gcode_process_motion(parserState.motion_mode);
 				case 4:
 				{
 					uint32_t wait_until = 0;
@@ -331,6 +359,7 @@ static int gcode_process_command()
 
 					while(timestamp	 < wait_until )
 					{
+						heater_task();
 					}
 					break;
 				}
@@ -409,6 +438,19 @@ static int gcode_process_command()
 					break;
 				case 24: //start/resume sd print
 					sdcard_replaystart();
+					if (parserState.resume_lower && sdcard_isreplaying())
+					{
+						// queued before the first line of the file, only Z
+						// moves from wherever the host left the head
+						signed short feed = feedrate;
+
+						parserState.resume_lower = 0;
+						memcpy(destination,current_position,sizeof(float) * NUM_AXIS);
+						destination[Z_AXIS] = parserState.resume_z;
+						feedrate = pa.homing_feedrate[Z_AXIS];
+						prepare_move();
+						feedrate = feed;
+					}
 					break;
 				case 25: //pause sd print
 					sdcard_replaypause();
@@ -416,6 +458,10 @@ static int gcode_process_command()
 				case 26: //set sd position
 					if (has_code('S'))
 						sdcard_setposition(get_uint('S'));
+					else if (has_code('L'))
+						sdcard_setline(get_uint('L'));
+					else if (has_code('P'))
+						sdcard_setlayer(get_uint('P'));
 					break;
 				case 27: //sd print status
 					sdcard_printstatus();
@@ -501,7 +547,7 @@ static int gcode_process_command()
 				
 					if (heater)
 					{
-						sendReply("ok T:%u @%u B:%u \r\n",heater->akt_temp,heater->pwm,bed_heater.akt_temp);
+						sendReply("ok T:%u @%u B:%u \r\n",heater->akt_temp,heater->pwm,heaters[HEATER_IDX_BED].akt_temp);
 					}
 					return NO_REPLY;
 				}
@@ -547,9 +593,10 @@ static int gcode_process_command()
 						while ( target_direction ? (heater->akt_temp < heater->target_temp) : (heater->akt_temp > heater->target_temp) ) 
 						{
 					#endif
+							heater_task();
 							if( (timestamp - codenum) > 1000 ) //Print Temp Reading every 1 second while heating up/cooling down
 							{
-								sendReply("ok T:%u \r\n",heater->akt_temp);
+								usb_printf_telemetry("ok T:%u \r\n",heater->akt_temp);
 								codenum = timestamp;
 							}
 							#ifdef TEMP_RESIDENCY_TIME
@@ -603,9 +650,20 @@ static int gcode_process_command()
 				}
 				case 140: // M140 set bed temp
 					if (has_code('S')) 
-						bed_heater.target_temp = get_uint('S');
+						heaters[HEATER_IDX_BED].target_temp = get_uint('S');
+
+					break;
+#ifdef CHAMBER_HEATER
+				case 141: // M141 set chamber temp
+					if (has_code('S')) 
+						heaters[HEATER_IDX_CHAMBER].target_temp = get_uint('S');
 
 					break;
+				case 176: //M176 Fan 2 On
+				case 177: //M177 Fan 2 Off
+					sendReply("error: fan 2 output drives the chamber heater\r\n");
+					break;
+#else
 				case 176: //M176 Fan 2 On
 					  if (has_code('S'))
 					  {
@@ -620,21 +678,23 @@ static int gcode_process_command()
 				case 177: //M177 Fan 2 Off
 					  g_pwm_value[3] = 0;
 					  break;
+#endif
 				case 190: // M190 - Wait for bed heater to reach target temperature.
 				{
 					if (has_code('S'))
-						bed_heater.target_temp = get_float('S');
+						heaters[HEATER_IDX_BED].target_temp = get_float('S');
 
 					uint32_t codenum = timestamp; 
-					while(bed_heater.akt_temp < bed_heater.target_temp) 
+					while(heaters[HEATER_IDX_BED].akt_temp < heaters[HEATER_IDX_BED].target_temp) 
 					{
+						heater_task();
 						if( (timestamp - codenum) > 1000 ) //Print Temp Reading every 1 second while heating up.
 						{
 							heater_struct* heater = get_heater(GET('T',active_extruder));
 
 							if (heater)
 							{
-								sendReply("T:%u B:%u\r\n",heater->akt_temp,bed_heater.akt_temp);
+								usb_printf_telemetry("T:%u B:%u\r\n",heater->akt_temp,heaters[HEATER_IDX_BED].akt_temp);
 							}
 							codenum = timestamp; 
 						}
@@ -745,8 +805,7 @@ static int gcode_process_command()
 						if(has_code('W'))
 							heater->max_pwm = pa.heater_max_pwm[extruder] = get_uint('W');
 
-						heater->temp_iState_max = (256L * PID_INTEGRAL_DRIVE_MAX) / (int)heater->PID_I;
-						heater->temp_iState_min = heater->temp_iState_max * (-1);
+						heater_pid_limits(heater);
 					}
 					break;
 				}
@@ -754,7 +813,13 @@ static int gcode_process_command()
 				{
 					heater_struct* heater = get_heater(GET('T',active_extruder));
 
-					if (heater)
+					if (has_code('B'))
+					{
+						if (!PID_autotune(&heaters[HEATER_IDX_BED], get_float('B')))
+							sendReply("error: bed autotune already running\r\n");
+					}
+
+					if (heater && (has_code('S') || !has_code('B')))
 					{
 
 						float help_temp = 150.0;
@@ -762,9 +827,10 @@ static int gcode_process_command()
 						if (has_code('S')) 
 							help_temp=get_float('S');
 
-						PID_autotune(heater, help_temp);
+						if (!PID_autotune(heater, help_temp))
+							sendReply("error: autotune already running\r\n");
 					}
-					return NO_REPLY;
+					break;
 				}
 				case 304: // M304 Evaluate heater performance
 				{
@@ -932,11 +998,17 @@ static int gcode_process_command()
 					if (heater)
 					{
 						if(has_code('E')) 
+						{
 							heater->thermistor_type = pa.heater_thermistor_type[extruder] = get_uint('E');
+							temptable_build(heater->temp_table,heater->thermistor_type);
+						}
 					}
 					
 					if(has_code('B')) 
-						bed_heater.thermistor_type = pa.bed_thermistor_type = get_uint('B');
+					{
+						heaters[HEATER_IDX_BED].thermistor_type = pa.bed_thermistor_type = get_uint('B');
+						temptable_build(heaters[HEATER_IDX_BED].temp_table,heaters[HEATER_IDX_BED].thermistor_type);
+					}
 					
 					break;
 				}
@@ -949,11 +1021,106 @@ static int gcode_process_command()
 					if (heater)
 					{
 						if(has_code('E')) 
-							heater->pwm = pa.heater_pwm_en[extruder] = get_bool('E');
+							heater->soft_pwm_aktiv = pa.heater_pwm_en[extruder] = get_bool('E');
 					}
 					
 					break;
 				}
+	
+				case 532: // M532 Heater control mode
+				{
+					heater_struct* heater = get_heater(GET('T',active_extruder));
+
+					if (heater && has_code('E'))
+						heater->control = constrain(get_uint('E'),HEATER_MODE_OFF,HEATER_MODE_PID);
+
+					// the bed has PID terms only after an autotune
+					if(has_code('B'))
+					{
+						heater = &heaters[HEATER_IDX_BED];
+						heater->control = constrain(get_uint('B'),HEATER_MODE_OFF,heater->PID_Kp ? HEATER_MODE_PID : HEATER_MODE_ONOFF);
+					}
+
+					break;
+				}
+				case 540: // M540 Extended ok replies for host flow control
+					if(has_code('S'))
+						parserState.extended_ok = get_bool('S');
+					break;
+				case 541: // M541 Binary motion protocol
+					if(has_code('S'))
+					{
+						if(get_bool('S'))
+						{
+							binproto_reset();
+							parserState.binary_seq = 0;
+							parserState.binary_acks = 0;
+							parserState.binary_resend = 0;
+							parserState.binary_mode = 1;
+							sendReply("ok W%d\r\n",BINPROTO_WINDOW);
+							return NO_REPLY;
+						}
+						parserState.binary_mode = 0;
+					}
+					break;
+				case 542: // M542 Binary telemetry stream
+					if(has_code('S'))
+						telemetry_set_rate(get_uint('S'));
+					break;
+				case 543: // M543 SD card as USB mass storage
+					if(has_code('S') && !sdcard_usb_export(get_uint('S') ? 1 : 0))
+						return NO_REPLY;
+					break;
+				case 544: // M544 SD file line/layer index
+					sdcard_buildindex();
+					break;
+				case 545: // M545 Resume from the power loss journal
+				{
+					JournalRecord rec;
+
+					if (!journal_read(&rec))
+						return NO_REPLY;
+
+					sdcard_selectfile(rec.file);
+					heaters[0].target_temp = rec.hotend_target[0];
+					heaters[1].target_temp = rec.hotend_target[1];
+					heaters[HEATER_IDX_BED].target_temp = rec.bed_target;
+					feedmultiply = rec.feedmultiply;
+					extrudemultiply = rec.extrudemultiply;
+					relative_mode = rec.relative_mode;
+					axis_relative_modes[E_AXIS] = rec.relative_e;
+
+					// Z didn't move without power, X/Y are homed by the host
+					st_synchronize();
+					current_position[Z_AXIS] = rec.position[Z_AXIS];
+					current_position[E_AXIS] = rec.position[E_AXIS];
+					plan_set_position(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS]);
+
+					// park above the start of the interrupted line
+					memcpy(destination,current_position,sizeof(float) * NUM_AXIS);
+					destination[Z_AXIS] += JOURNAL_Z_LIFT;
+					feedrate = pa.homing_feedrate[Z_AXIS];
+					prepare_move();
+					destination[X_AXIS] = rec.position[X_AXIS];
+					destination[Y_AXIS] = rec.position[Y_AXIS];
+					feedrate = pa.homing_feedrate[X_AXIS];
+					prepare_move();
+
+					parserState.resume_z = rec.position[Z_AXIS];
+					parserState.resume_lower = 1;
+					feedrate = rec.feedrate;
+					sdcard_setposition(rec.file_pos);
+					sendReply("ok resume %s at %u\r\n",rec.file,rec.file_pos);
+					return NO_REPLY;
+				}
+				case 546: // M546 Task statistics
+					sched_print_stats(has_code('R'));
+					break;
+				case 547: // M547 PID autotune progress
+					if(has_code('S') && !get_bool('S'))
+						PID_autotune_abort();
+					PID_autotune_report();
+					break;
 				case 906: // set motor current value in mA using axis codes
 				// M906 X[mA] Y[mA] Z[mA] E[mA] B[mA] 
 				// M906 S[mA] set all motors current 
@@ -1045,9 +1212,40 @@ static int gcode_process_command()
 }
 
 
+//execute the command in commandBuffer, line number and checksum are already handled
+static int gcode_execute_line()
+{
+	char* command = trim_line(parserState.commandBuffer);
+
+	//no G, M or T on this line --> coordinates for the active motion mode
+	if (*command == 0)
+	{
+		parserState.parsePos = parserState.commandBuffer;
+		if (has_motion_words())
+			return gcode_process_motion(parserState.motion_mode);
+		// F alone only sets the feedrate of the next moves
+		if (has_code('F'))
+		{
+			if (get_int('F') > 0)
+				feedrate = get_int('F');
+			return SEND_REPLY;
+		}
+	}
+	parserState.parsePos = command;
+	return gcode_process_command();
+}
+
 //full line has been received, process it for line number, checksum, etc. before processing the actual command
 static void gcode_line_received()
 {
+	//SD card lines have no line numbers and the host doesn't wait for an ok
+	if (parserState.replay_line)
+	{
+		if (parserState.commandLen)
+			gcode_execute_line();
+		return;
+	}
+
 	if (parserState.commandLen)
 	{
 		if (parserState.commandBuffer[0] == 'N')
@@ -1084,63 +1282,324 @@ static void gcode_line_received()
 			return;
 		}
 
-		parserState.parsePos = trim_line(parserState.commandBuffer);
+		//M28 upload: store the line instead of executing it, until M29
+		if (sdcard_iscapturing() && !(has_code('M') && get_uint('M') == 29))
+		{
+			if (!sdcard_writeline(skip_line_number(parserState.commandBuffer)))
+			{
+				sendReply("error: write to SD card failed\r\n");
+				return;
+			}
+			sendReply("ok\r\n");
+			return;
+		}
 
 //		DEBUG("gcode line: '%s'\n\r",parserState.parsePos);
-		if (gcode_process_command() == SEND_REPLY)
+		if (gcode_execute_line() == SEND_REPLY)
 		{
-			sendReply("ok\r\n");
+			if (parserState.extended_ok)
+			{
+				// B in bytes, a multiple of the USB receive buffer size
+				sendReply("ok P%d B%d N%u\r\n",calc_plannerpuffer_free(),samserial_rxfree(),parserState.last_N);
+			}
+			else
+			{
+				sendReply("ok\r\n");
+			}
 			previous_millis_cmd = timestamp;
 		}
 	}
 	
 }
 
+//----------------------------------------------------------------------------------------------
+// Binary motion protocol, selected with M541 S1
+//----------------------------------------------------------------------------------------------
+static void gcode_binary_ack()
+{
+	sendReply("ack %u\r\n",(uint8_t)(parserState.binary_seq-1));
+	parserState.binary_acks = 0;
+}
+
+static void gcode_binary_move(const binproto_move* move)
+{
+	unsigned char i;
+
+	for(i = 0; i < NUM_AXIS; i++)
+	{
+		if (move->flags & (1<<i))
+			destination[i] = move->axis[i]/BINPROTO_AXIS_SCALE + (axis_relative_modes[i] || relative_mode)*current_position[i];
+		else 
+			destination[i] = current_position[i];
+	}
+
+	if ((move->flags & BINPROTO_MOVE_F) && move->feedrate > 0)
+		feedrate = min(move->feedrate,32767);
+
+	prepare_move();
+}
+
+static void gcode_binary_frame(const binproto_frame* frame)
+{
+	binproto_move move;
+
+	if (frame->seq != parserState.binary_seq)
+	{
+		//frame already processed (host resent it after a lost ack) --> just ack again,
+		//otherwise a frame was lost --> ask once for the missing one
+		if ((uint8_t)(parserState.binary_seq - frame->seq) <= BINPROTO_WINDOW)
+			parserState.binary_acks++;
+		else if (!parserState.binary_resend)
+		{
+			sendReply("rs %u\r\n",parserState.binary_seq);
+			parserState.binary_resend = 1;
+		}
+		return;
+	}
+	parserState.binary_resend = 0;
+
+	switch(frame->type)
+	{
+		case BINPROTO_TYPE_MOVE:
+			if (binproto_decode_move(frame,&move))
+				gcode_binary_move(&move);
+			else
+				sendReply("error: bad move record %u\r\n",frame->seq);
+			break;
+		case BINPROTO_TYPE_LINE:
+			memcpy(parserState.commandBuffer,frame->payload,frame->len);
+			parserState.commandBuffer[frame->len] = 0;
+			gcode_execute_line();
+			break;
+		case BINPROTO_TYPE_EXIT:
+			parserState.binary_mode = 0;
+			break;
+		default:
+			sendReply("error: unknown frame type %u\r\n",frame->type);
+			break;
+	}
+
+	parserState.binary_seq++;
+	parserState.binary_acks++;
+	previous_millis_cmd = timestamp;
+}
+
+static void gcode_binary_received(uint8_t chr)
+{
+	switch(binproto_receive(chr))
+	{
+		case BINPROTO_FRAME_OK:
+			gcode_binary_frame(binproto_get_frame());
+			break;
+		case BINPROTO_FRAME_BAD:
+			if (!parserState.binary_resend)
+			{
+				sendReply("rs %u\r\n",parserState.binary_seq);
+				parserState.binary_resend = 1;
+			}
+			break;
+		default:
+			break;
+	}
+
+	//don't let the host run into the end of its window while we are busy
+	if (parserState.binary_acks >= BINPROTO_WINDOW/2)
+		gcode_binary_ack();
+}
+
+//----------------------------------------------------------------------------------------------
 void gcode_init(ReplyFunction replyFunc)
 {
-	ringbuffer_init(&uartBuffer);
 	memset(&parserState,0,sizeof(ParserState));
 	parserState.replyFunc = replyFunc;
+	parserState.motion_mode = MOTION_MODE_NONE;
+}
+
+static void gcode_received(uint8_t chr)
+{
+	if (parserState.binary_mode)
+	{
+		gcode_binary_received(chr);
+		return;
+	}
 	
-	samserial_setcallback(gcode_datareceived);
+	switch(chr)
+	{
+		case ';':
+		case '(':
+			parserState.comment_mode = true;
+			break;
+		case '\n':
+		case '\r':
+			parserState.commandBuffer[parserState.commandLen] = 0;
+			parserState.parsePos = parserState.commandBuffer;
+			gcode_line_received();
+			parserState.comment_mode = false;
+			parserState.commandLen = 0;
+			
+			break;
+		default:
+			if (parserState.commandLen >= BUFFER_SIZE)
+			{
+				printf("error: command buffer full!\n\r");
+			}
+			else
+			{
+				if (!parserState.comment_mode)
+					parserState.commandBuffer[parserState.commandLen++] = chr;
+			}
+			break;
+	}
 }
 
-void gcode_update()
+//----------------------------------------------------------------------------------------------
+// SD card replay, lines go through the same path as USB lines
+//----------------------------------------------------------------------------------------------
+//--------------------------------------------------
+// Block files: blocks go straight into the planner buffer,
+// lines through the parser. Returns 0 while a record waits.
+//--------------------------------------------------
+static unsigned char gcode_replay_record()
 {
-	while (ringbuffer_numAvailable(&uartBuffer) > 0)
+	unsigned int i;
+
+	if (blockReplay.header[0] == BLOCKFILE_BLOCK)
 	{
-		uint8_t chr = ringbuffer_get(&uartBuffer);
-		
-		switch(chr)
+		if (blockReplay.header[1] == sizeof(BlockRecord)
+			&& !plan_push_block((const BlockRecord*)blockReplay.payload))
+			return 0;
+	}
+	else if (blockReplay.header[0] == BLOCKFILE_LINE)
+	{
+		if (calc_plannerpuffer_free() <= 1)
+			return 0;
+		// no file positions to resume from in block files
+		plan_file_pos = PLAN_NO_FILE_POS;
+		parserState.replay_line = 1;
+		for(i = 0;i < blockReplay.header[1];i++)
+			gcode_received(blockReplay.payload[i]);
+		gcode_received('\n');
+		parserState.replay_line = 0;
+	}
+	return 1;
+}
+
+//--------------------------------------------------
+// sdcard_replaystart()/sdcard_replaystop(): drops a half read
+// or waiting record, the next replay starts at a record boundary
+//--------------------------------------------------
+void gcode_replay_reset()
+{
+	blockReplay.fill = 0;
+}
+
+static void gcode_replay_blocks()
+{
+	const unsigned char* data;
+	unsigned int len, need;
+
+	for(;;)
+	{
+		if (blockReplay.fill >= 2 && blockReplay.fill == 2 + blockReplay.header[1])
 		{
-			case ';':
-			case '(':
-				parserState.comment_mode = true;
-				break;
-			case '\n':
-			case '\r':
-				parserState.commandBuffer[parserState.commandLen] = 0;
-				parserState.parsePos = parserState.commandBuffer;
-				gcode_line_received();
-				parserState.comment_mode = false;
-				parserState.commandLen = 0;
-				
-				break;
-			default:
-				if (parserState.commandLen >= BUFFER_SIZE)
-				{
-					printf("error: command buffer full!\n\r");
-				}
-				else
-				{
-					if (!parserState.comment_mode)
-						parserState.commandBuffer[parserState.commandLen++] = chr;
-				}
+			if (!gcode_replay_record())
+				return;
+			blockReplay.fill = 0;
+		}
+		if ((len = sdcard_replay_available(&data)) == 0)
+			return;
+
+		if (blockReplay.fill < 2)
+		{
+			blockReplay.header[blockReplay.fill++] = *data;
+			sdcard_replay_consume(1);
+			if (blockReplay.fill == 2 && blockReplay.header[1] > BLOCKFILE_MAX_PAYLOAD)
+			{
+				usb_printf("error: bad block file record\r\n");
+				sdcard_replaystop();
+				return;
+			}
+			continue;
+		}
+		need = 2 + blockReplay.header[1] - blockReplay.fill;
+		if (len > need)
+			len = need;
+		memcpy(&blockReplay.payload[blockReplay.fill - 2],data,len);
+		blockReplay.fill += len;
+		sdcard_replay_consume(len);
+	}
+}
+
+static void gcode_replay()
+{
+	const unsigned char* data;
+	unsigned int len, i;
+	uint8_t chr;
+
+	//last line of the file without line end
+	if (parserState.replay_line && !sdcard_isreplaying())
+	{
+		gcode_received('\n');
+		parserState.replay_line = 0;
+	}
+
+	//don't mix into a half received USB line
+	if (parserState.binary_mode || (parserState.commandLen && !parserState.replay_line))
+		return;
+
+	//the last record can still wait for the planner after the end of the file,
+	//a truncated one is dropped
+	if (!sdcard_isreplaying() && blockReplay.fill && blockReplay.fill != 2 + blockReplay.header[1])
+		blockReplay.fill = 0;
+	if (sdcard_replay_isblockfile() || (!sdcard_isreplaying() && blockReplay.fill))
+	{
+		gcode_replay_blocks();
+		return;
+	}
+
+	//only as many lines as the planner takes without blocking, USB stays responsive
+	while (calc_plannerpuffer_free() > 1 && (len = sdcard_replay_available(&data)) > 0)
+	{
+		// blocks of this line resume from its start (journal.c)
+		if (!parserState.replay_line)
+		{
+			plan_file_pos = sdcard_getposition();
+			memcpy(plan_line_start,current_position,sizeof(plan_line_start));
+		}
+		parserState.replay_line = 1;
+		for(i = 0;i < len;)
+		{
+			chr = data[i++];
+			gcode_received(chr);
+			if (chr == '\n' || chr == '\r')
+			{
+				parserState.replay_line = 0;
 				break;
+			}
 		}
-		
+		sdcard_replay_consume(i);
 	}
+}
+
+void gcode_update()
+{
+	const unsigned char* data;
+	unsigned int len, i;
+
+	//parse straight out of the USB receive buffers (unless an SD line is half read)
+	while (!parserState.replay_line && (len = samserial_available(&data)) > 0)
+	{
+		plan_file_pos = PLAN_NO_FILE_POS;
+		for(i = 0;i < len;i++)
+			gcode_received(data[i]);
+		samserial_consume(len);
+	}
+
+	gcode_replay();
 	
+	//acknowledge everything processed as soon as the receive buffer is drained
+	if (parserState.binary_acks)
+		gcode_binary_ack();
 }
 
 
@@ -23,6 +23,7 @@ typedef void (*ReplyFunction)(const char* format,...);
 
 void gcode_init(ReplyFunction replyFunc);
 void gcode_update();
+void gcode_replay_reset();
 
 int32_t get_int(char chr);
 uint32_t get_uint(char chr);
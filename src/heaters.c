@@ -23,6 +23,7 @@
 #include <irq/irq.h>
 #include <tc/tc.h>
 #include <math.h>
+#include <string.h>
 
 #include "init_configuration.h"
 #include "parameters.h"
@@ -30,10 +31,14 @@
 #include "heaters.h"
 #include "thermistortables.h"
 #include "serial.h"
+#include "scheduler.h"
+#include "planner.h"
 
 #define HEATER_BED			0
 #define HEATER_HOTEND_1		1
 #define HEATER_HOTEND_2		2
+#define HEATER_AUX_1		3
+#define HEATER_AUX_2		4
 
 const Pin BEDHEAT={1 <<  20, AT91C_BASE_PIOA, AT91C_ID_PIOA, PIO_OUTPUT_0, PIO_PULLUP};
 const Pin HOTEND1={1 <<  21, AT91C_BASE_PIOA, AT91C_ID_PIOA, PIO_OUTPUT_0, PIO_PULLUP};
@@ -56,11 +61,42 @@ const Pin PIN_LED9 = {1 << 0 , AT91C_BASE_PIOC, AT91C_ID_PIOC, PIO_OUTPUT_0, PIO
 extern const Pin time_check2;
 extern volatile unsigned long timestamp;
 
-unsigned char autotune_active = false;
+// heater driven by Heater_Eval(), no control while it runs
+static heater_struct* eval_heater = NULL;
+
+static void autotune_step(heater_struct *heater);
 
 //Global struct for Heatercontrol
-heater_struct heaters[2];	//MAX_EXTRUDERS ?
-heater_bed_struct bed_heater;
+heater_struct heaters[NUM_HEATERS];
+
+//-----------------------------------------------------
+/// Wiring and control mode of each heater, in the order of heaters[]
+//-----------------------------------------------------
+typedef struct {
+	unsigned char ad_channel;
+	unsigned char fet;				// heater_switch() index
+	unsigned char pwm_channel;		// g_pwm_* channel or HEATER_NO_PWM
+	unsigned char led;
+	unsigned char control;
+	unsigned short period;			// ms
+} heater_config;
+
+static const heater_config heater_table[NUM_HEATERS] = {
+	//ADC	FET					PWM				LED	control				period
+	{3,		HEATER_HOTEND_1,	0,				4,	HEATER_MODE_PID,	HOTEND_CHECK_INTERVAL},
+	{1,		HEATER_HOTEND_2,	1,				5,	HEATER_MODE_PID,	HOTEND_CHECK_INTERVAL},
+	{5,		HEATER_BED,			HEATER_NO_PWM,	3,	HEATER_MODE_ONOFF,	BED_CHECK_INTERVAL},
+#ifdef CHAMBER_HEATER
+	{2,		HEATER_AUX_2,		HEATER_NO_PWM,	6,	HEATER_MODE_ONOFF,	BED_CHECK_INTERVAL},
+#endif
+};
+
+#ifdef HOTEND_MODEL
+static const heater_model hotend_models[MAX_EXTRUDER] = {HEATER_0_MODEL, HEATER_1_MODEL};
+
+// J/K per mm of filament
+#define FILAMENT_HEAT_PER_MM	(3.14159f / 4 * FILAMENT_DIAMETER * FILAMENT_DIAMETER * FILAMENT_HEAT_CAPACITY)
+#endif
 
 //-----------------------------------------------------
 /// SOFT Pwm for Heater 1 & 2 and Ext Pwm 1 & 2 like Fan
@@ -97,33 +133,33 @@ void heaters_setup()
 //-------------------------
 // IO Function for FET's
 //-------------------------
+static const Pin* const fetPins[] = {&BEDHEAT,&HOTEND1,&HOTEND2,&AUX1,&AUX2};
+
 void heater_switch(unsigned char heater, unsigned char en)
 {
-	Pin FETPINS[]={BEDHEAT,HOTEND1,HOTEND2,AUX1,AUX2};
-
-	if(heater<0||heater>5)
+	if(heater >= 5)
 		return;
 	
 	if(en)
-		PIO_Set(&(FETPINS[heater]));
+		PIO_Set(fetPins[heater]);
 	else
-		PIO_Clear(&(FETPINS[heater]));
+		PIO_Clear(fetPins[heater]);
 }
 
 //-------------------------
 // IO Function for LED's
 //-------------------------
+static const Pin* const ledPins[] = {&PIN_LED1,&PIN_LED2,&PIN_LED3,&PIN_LED4,&PIN_LED5,&PIN_LED6,&PIN_LED7,&PIN_LED8,&PIN_LED9};
+
 void LED_switch(unsigned char led, unsigned char en)
 {
-	Pin LEDPINS[]={PIN_LED1,PIN_LED2,PIN_LED3,PIN_LED4,PIN_LED5,PIN_LED6,PIN_LED7,PIN_LED8,PIN_LED9};
-
-	if(led<0||led>9)
+	if(led >= 9)
 		return;
 	
 	if(en)
-		PIO_Set(&(LEDPINS[led]));
+		PIO_Set(ledPins[led]);
 	else
-		PIO_Clear(&(LEDPINS[led]));
+		PIO_Clear(ledPins[led]);
 }
 
 
@@ -217,257 +253,306 @@ signed short analog2temp_thermistor_table(signed short raw,const short table[][2
 
 
 //--------------------------------------------------
-// Convert fron Analog to Temperatur , Sensortype can select online
+// Exact conversion from mV to C for the table build
 //--------------------------------------------------
-signed short analog2temp_convert(signed short raw, unsigned char sensortype)
+static float analog2temp_compute_exact(float mv, const float beta, const float rs, const float r_inf)
+{
+	if ((mv <= 0) || (mv >= ADC_VREF)) 
+		return 0;
+
+	float r = rs/((ADC_VREF/mv)-1); 
+	float celsius = ABS_ZERO + beta/log( r/r_inf ); 
+
+	return celsius < 0 ? 0 : celsius;
+}
+
+static float analog2temp_table_exact(float mv, const short table[][2], signed short numtemps)
 {
-	signed short temperature = 0;
+	unsigned char i;
 
+	for (i=1; i<numtemps; i++)
+	{
+		if (table[i][0] > mv)
+			return table[i-1][1] + 
+				(mv - table[i-1][0]) * 
+				(table[i][1] - table[i-1][1]) /
+				(table[i][0] - table[i-1][0]);
+	}
+
+	// Overflow: Set to last value in the table
+	return table[numtemps-1][1];
+}
+
+static float analog2temp_exact(float mv, unsigned char sensortype)
+{
 	switch(sensortype)
 	{
 		case THERMISTORTYP_TABLE_1:
-			temperature = analog2temp_thermistor_table(raw,temptable_1,NUMTEMPS_1);
-		break;
-		
+			return analog2temp_table_exact(mv,temptable_1,NUMTEMPS_1);
 		case THERMISTORTYP_TABLE_2:
-			temperature = analog2temp_thermistor_table(raw,temptable_2,NUMTEMPS_2);
-		break;
-		
+			return analog2temp_table_exact(mv,temptable_2,NUMTEMPS_2);
 		case THERMISTORTYP_TABLE_3:
-			temperature = analog2temp_thermistor_table(raw,temptable_3,NUMTEMPS_3);
-		break;
-		
+			return analog2temp_table_exact(mv,temptable_3,NUMTEMPS_3);
 		case THERMISTORTYP_TABLE_4:
-			temperature = analog2temp_thermistor_table(raw,temptable_4,NUMTEMPS_4);
-		break;
-		
+			return analog2temp_table_exact(mv,temptable_4,NUMTEMPS_4);
 		case THERMISTORTYP_TABLE_5:
-			temperature = analog2temp_thermistor_table(raw,temptable_5,NUMTEMPS_5);
-		break;
-		
+			return analog2temp_table_exact(mv,temptable_5,NUMTEMPS_5);
 		case THERMISTORTYP_TABLE_6:
-			temperature = analog2temp_thermistor_table(raw,temptable_6,NUMTEMPS_6);
-		break;
-		
+			return analog2temp_table_exact(mv,temptable_6,NUMTEMPS_6);
 		case THERMISTORTYP_TABLE_7:
-			temperature = analog2temp_thermistor_table(raw,temptable_7,NUMTEMPS_7);
-		break;
-		
+			return analog2temp_table_exact(mv,temptable_7,NUMTEMPS_7);
+
 		//Calclate Temperatur with formular
 		case THERMISTORTYP_COMPUTE_11:
-			temperature = analog2temp_thermistor_compute(raw, E_BETA_11, E_RS, E_R_INF_11);
-		break;
-
-		case THERMISTORTYP_COMPUTE_12:
-			temperature = 0;
-		break;
-
+			return analog2temp_compute_exact(mv, E_BETA_11, E_RS, E_R_INF_11);
 		case THERMISTORTYP_COMPUTE_13:
-			temperature = analog2temp_thermistor_compute(raw, E_BETA_13, E_RS, E_R_INF_13);
-		break;
-
+			return analog2temp_compute_exact(mv, E_BETA_13, E_RS, E_R_INF_13);
 		case THERMISTORTYP_COMPUTE_14:
-			temperature = analog2temp_thermistor_compute(raw, E_BETA_14, E_RS, E_R_INF_14);
-		break;
-
+			return analog2temp_compute_exact(mv, E_BETA_14, E_RS, E_R_INF_14);
 		case THERMISTORTYP_COMPUTE_15:
-			temperature = analog2temp_thermistor_compute(raw, E_BETA_15, E_RS, E_R_INF_15);
-		break;
-
+			return analog2temp_compute_exact(mv, E_BETA_15, E_RS, E_R_INF_15);
 		case THERMISTORTYP_COMPUTE_16:
-			temperature = analog2temp_thermistor_compute(raw, E_BETA_16, E_RS, E_R_INF_16);
-		break;
-
+			return analog2temp_compute_exact(mv, E_BETA_16, E_RS, E_R_INF_16);
 		case THERMISTORTYP_COMPUTE_17:
-			temperature = analog2temp_thermistor_compute(raw, E_BETA_17, E_RS, E_R_INF_17);
-		break;
+			return analog2temp_compute_exact(mv, E_BETA_17, E_RS, E_R_INF_17);
 
-	
 		case AD595_TYP_50:
-			temperature = (signed short)((int)raw * 500 / ADC_VREF);
-		break;
-	
+			return mv * 500 / ADC_VREF;
+
 		default:
-			temperature = 0;
-		break;
+			return 0;
 	}
-	
-	return(temperature);
+}
+
+//--------------------------------------------------
+// Build the conversion table of a sensor, called when the
+// sensor type is set. Entry i holds the temperature in 0.1 C at
+// adc_read_raw() = i << TEMPTABLE_SHIFT, the float math above
+// only runs here and never in manage_heaters().
+//--------------------------------------------------
+void temptable_build(signed short* table, unsigned char sensortype)
+{
+	float dc;
+	int i;
 
+	for (i = 0; i <= TEMPTABLE_SIZE; i++)
+	{
+		dc = 10 * analog2temp_exact((float)(i << TEMPTABLE_SHIFT) * ADC_VREF / ADC_RAW_MAX, sensortype);
+		table[i] = (signed short)(constrain(dc, -32000, 32000) + (dc < 0 ? -0.5f : 0.5f));
+	}
+}
+
+//--------------------------------------------------
+// Temperature of an ADC channel in 0.1 C: table lookup
+// with linear interpolation, no division
+//--------------------------------------------------
+signed short temptable_read(const signed short* table, unsigned char ad_channel)
+{
+	unsigned int raw = adc_read_raw(ad_channel);
+	unsigned int i = raw >> TEMPTABLE_SHIFT;
+	int frac = raw & ((1 << TEMPTABLE_SHIFT) - 1);
+
+	if (i >= TEMPTABLE_SIZE)
+		return table[TEMPTABLE_SIZE];
+	return table[i] + (((table[i+1] - table[i]) * frac) >> TEMPTABLE_SHIFT);
 }
 
+// C from 0.1 C, rounded
+#define DC_TO_C(dc)	(((dc) + ((dc) < 0 ? -5 : 5)) / 10)
+
 
 //-------------------------
 // Init heater Values
 //-------------------------
 void init_heaters_values(void)
 {
-	
-	heaters[0].io_adr = HEATER_HOTEND_1;
-	g_pwm_io_adr[0] = HEATER_HOTEND_1;
-	heaters[0].ad_cannel = 3;
-	heaters[0].pwm = 0;
-	heaters[0].soft_pwm_aktiv = pa.heater_pwm_en[0];
-	heaters[0].PID_Kp = pa.heater_pTerm[0];
-	heaters[0].PID_I = pa.heater_iTerm[0];
-	heaters[0].PID_Kd = pa.heater_dTerm[0];
-	heaters[0].temp_iState = 0;
-	heaters[0].prev_temp = 0;
-	heaters[0].temp_iState_max = (256L * PID_INTEGRAL_DRIVE_MAX) / (signed short)heaters[0].PID_I;
-	heaters[0].temp_iState_min = heaters[0].temp_iState_max * (-1);
-	heaters[0].thermistor_type = pa.heater_thermistor_type[0];
-	heaters[0].slope = pa.heater_slope[0];
-	heaters[0].intercept = pa.heater_intercept[0];
-	heaters[0].max_pwm = pa.heater_max_pwm[0];
-
-	heaters[1].io_adr = HEATER_HOTEND_2;
-	g_pwm_io_adr[1] = HEATER_HOTEND_2;
-	heaters[1].ad_cannel = 1;
-	heaters[1].pwm = 0;
-	heaters[1].soft_pwm_aktiv = pa.heater_pwm_en[1];
-	heaters[1].PID_Kp = pa.heater_pTerm[1];
-	heaters[1].PID_I = pa.heater_iTerm[1];
-	heaters[1].PID_Kd = pa.heater_dTerm[1];
-	heaters[1].temp_iState = 0;
-	heaters[1].prev_temp = 0;
-	heaters[1].temp_iState_max = (256L * PID_INTEGRAL_DRIVE_MAX) / (signed short)heaters[1].PID_I;
-	heaters[1].temp_iState_min = heaters[1].temp_iState_max * (-1);
-	heaters[1].thermistor_type = pa.heater_thermistor_type[1];
-	heaters[1].slope = pa.heater_slope[1];
-	heaters[1].intercept = pa.heater_intercept[1];
-	heaters[1].max_pwm = pa.heater_max_pwm[1];
-	
-	bed_heater.target_temp = 0;
-	bed_heater.akt_temp = 0;
-	bed_heater.thermistor_type = pa.bed_thermistor_type;
-	
-	
+	const heater_config* cfg;
+	heater_struct* heater;
+	unsigned char i;
+
+	for(i = 0; i < NUM_HEATERS; i++)
+	{
+		cfg = &heater_table[i];
+		heater = &heaters[i];
+
+		heater->io_adr = cfg->fet;
+		heater->ad_cannel = cfg->ad_channel;
+		heater->pwm_channel = cfg->pwm_channel;
+		heater->led = cfg->led;
+		heater->control = cfg->control;
+		heater->period = cfg->period;
+		heater->countdown = 1;
+		heater->target_temp = 0;
+		heater->akt_temp = 0;
+		heater->pwm = 0;
+		heater->temp_iState = 0;
+		heater->prev_temp = 0;
+
+		if(i < MAX_EXTRUDER)
+		{
+			heater->soft_pwm_aktiv = pa.heater_pwm_en[i];
+			heater->PID_Kp = pa.heater_pTerm[i];
+			heater->PID_I = pa.heater_iTerm[i];
+			heater->PID_Kd = pa.heater_dTerm[i];
+			heater->thermistor_type = pa.heater_thermistor_type[i];
+			heater->slope = pa.heater_slope[i];
+			heater->intercept = pa.heater_intercept[i];
+			heater->max_pwm = pa.heater_max_pwm[i];
+#ifdef HOTEND_MODEL
+			heater->model = &hotend_models[i];
+#else
+			heater->model = NULL;
+#endif
+		}
+		else
+		{
+			// no PID terms in the parameters, on/off only
+			heater->soft_pwm_aktiv = 0;
+			heater->PID_Kp = heater->PID_I = heater->PID_Kd = 0;
+			heater->thermistor_type = pa.bed_thermistor_type;
+			heater->slope = heater->intercept = 0;
+			heater->max_pwm = 255;
+			heater->model = NULL;
+		}
+#ifdef CHAMBER_HEATER
+		if(i == HEATER_IDX_CHAMBER)
+			heater->thermistor_type = CHAMBER_THERMISTOR;
+#endif
+		heater_pid_limits(heater);
+		temptable_build(heater->temp_table,heater->thermistor_type);
+
+		if(heater->pwm_channel != HEATER_NO_PWM)
+			g_pwm_io_adr[heater->pwm_channel] = heater->io_adr;
+	}
+}
+
+//--------------------------------------------------
+// Integral windup limits from PID_I (M301 changes it)
+//--------------------------------------------------
+void heater_pid_limits(heater_struct *heater)
+{
+	if(heater->PID_I > 0)
+		heater->temp_iState_max = (256L * PID_INTEGRAL_DRIVE_MAX) / (signed short)heater->PID_I;
+	else
+		heater->temp_iState_max = 0;
+	heater->temp_iState_min = heater->temp_iState_max * (-1);
 }
 
 
 
 //--------------------------------------------------
-// Soft PWM, runs every 100 us
-// need 2,12 us  + 0,3 us per PWM channel
+// Soft PWM, first order sigma-delta: a channel is on for a tick
+// when its summed up duty passes 255, so the duty is exact on
+// average over a few ticks. The timer runs at FAN_PWM_RATE for
+// the fan channels, the heater channels only step every
+// FAN_PWM_RATE/HEATER_PWM_RATE ticks. The FETs are all on PIOA,
+// one clear and one set write per tick for all channels.
+// (no hardware PWM, the PWMC outputs are on the LED pins)
 //--------------------------------------------------
-volatile unsigned char g_TC1_pwm_cnt = 0;
-volatile unsigned char pwm_io_is_off[4] = {0,0,0,0};
+#define PWM_FIRST_FAN	2	// g_pwm_*: 0,1 hotends, 2,3 fans
+static unsigned short pwm_accu[4] = {0,0,0,0};
+static unsigned char pwm_heater_div = 0;
 void TC1_IrqHandler(void)
 {
 
-	volatile unsigned int dummy;
 	unsigned char cnt_pwm_ch = 0;
+	unsigned int on = 0, off = 0, mask;
 	
     // Clear status bit to acknowledge interrupt !!
 	// Dont forget --> other interupts are blocked until the bit is cleared
-    dummy = AT91C_BASE_TC1->TC_SR;
-	
-	if(dummy & AT91C_TC_CPCS)
-	{
-	}
+    (void)AT91C_BASE_TC1->TC_SR;
 	
 	PIO_Set(&time_check2);
 	
-	g_TC1_pwm_cnt+=2;
+	if(++pwm_heater_div >= FAN_PWM_RATE / HEATER_PWM_RATE)
+		pwm_heater_div = 0;
 	
-	//Check the 4 PWM channels
-	for(cnt_pwm_ch = 0;cnt_pwm_ch < 4;cnt_pwm_ch++)
+	//Check the 4 PWM channels, the heaters only at HEATER_PWM_RATE
+	for(cnt_pwm_ch = pwm_heater_div ? PWM_FIRST_FAN : 0;cnt_pwm_ch < 4;cnt_pwm_ch++)
 	{
 		if(g_pwm_aktiv[cnt_pwm_ch] == 1)
 		{
-			if(g_TC1_pwm_cnt == 0)
+			mask = fetPins[g_pwm_io_adr[cnt_pwm_ch]]->mask;
+			pwm_accu[cnt_pwm_ch] += g_pwm_value[cnt_pwm_ch];
+			if(pwm_accu[cnt_pwm_ch] >= 255)
 			{
-				if(g_pwm_value[cnt_pwm_ch] == 0)
-				{
-					heater_switch(g_pwm_io_adr[cnt_pwm_ch], 0);
-					pwm_io_is_off[cnt_pwm_ch] = 1;
-				}
-				else
-				{
-					heater_switch(g_pwm_io_adr[cnt_pwm_ch], 1);
-					pwm_io_is_off[cnt_pwm_ch] = 0;
-				}
+				pwm_accu[cnt_pwm_ch] -= 255;
+				on |= mask;
 			}
 			else
-			{
-				if((g_TC1_pwm_cnt >= g_pwm_value[cnt_pwm_ch]) && (pwm_io_is_off[cnt_pwm_ch] == 0))
-				{
-					heater_switch(g_pwm_io_adr[cnt_pwm_ch], 0);
-					pwm_io_is_off[cnt_pwm_ch] = 1;
-				}
-			}
+				off |= mask;
 		}
 	}
+	AT91C_BASE_PIOA->PIO_CODR = off;
+	AT91C_BASE_PIOA->PIO_SODR = on;
 	
 	PIO_Clear(&time_check2);
 }
 
 //--------------------------------------------------
-// Simple Hotend Tempcontrol with ON/OFF switching
+// Simple Tempcontrol with ON/OFF switching
 //--------------------------------------------------
 void heater_on_off_control(heater_struct *hotend)
 {
-	hotend->akt_temp = analog2temp_convert(adc_read(hotend->ad_cannel),hotend->thermistor_type);
-	
-	#ifdef MINTEMP
-	if(hotend->akt_temp < MINTEMP)
-	{
-		hotend->target_temp = 0;
-		heater_switch(hotend->io_adr, 0);
-		hotend->pwm = 0;
-	}
-	#endif
-		
 	if(hotend->akt_temp  > (hotend->target_temp+1))
 	{
-		heater_switch(hotend->io_adr, 0);
 		hotend->pwm = 0;
 	}
 	else if((hotend->akt_temp  < (hotend->target_temp-1)) && (hotend->target_temp > 0))
 	{
-		heater_switch(hotend->io_adr, 1);
 		hotend->pwm = 255;
-	
 	}
 	
 }
 
 
+#ifdef HOTEND_MODEL
+//--------------------------------------------------
+// Thermal model of a hotend: the duty that holds the target
+// against the ambient, the part fan and the filament of the
+// queued moves, and the temperature the block heads for with
+// the present duty (the sensor lags behind)
+//--------------------------------------------------
+static signed short heater_model_duty(heater_struct *hotend, signed short *predicted)
+{
+	const heater_model* model = hotend->model;
+	float fan = g_pwm_aktiv[2] ? g_pwm_value[2] / 255.0f : 0;
+	float flow = plan_extrusion_rate(hotend - heaters, HOTEND_MODEL_HORIZON);
+	float loss = model->loss + model->fan_loss * fan + flow * FILAMENT_HEAT_PER_MM;	// W/K
+	float power = hotend->pwm * model->power / 255;
+
+	*predicted = hotend->akt_temp + (signed short)((power - loss * (hotend->akt_temp - HOTEND_MODEL_AMBIENT)) * HOTEND_MODEL_HORIZON / model->capacity);
+
+	return (signed short)(loss * (hotend->target_temp - HOTEND_MODEL_AMBIENT) * 255 / model->power + 0.5f);
+}
+#endif
+
 //--------------------------------------------------
-// Tempcontrol with PID for Hotend
+// Tempcontrol with PID
 //--------------------------------------------------
 void heater_PID_control(heater_struct *hotend)
 {
 	signed short error;
 	signed short delta_temp;
 	signed short heater_duty;
-  
-	hotend->akt_temp = analog2temp_convert(adc_read(hotend->ad_cannel),hotend->thermistor_type);
-  
-	#ifdef MINTEMP
-	if(hotend->akt_temp < MINTEMP)
-	{
-		hotend->target_temp = 0;
-		heater_switch(hotend->io_adr, 0);
-	}
-	#endif
-	
-	#ifdef MAXTEMP
-	if(hotend->akt_temp > MAXTEMP)
-	{
-		hotend->target_temp = 0;
-		heater_switch(hotend->io_adr, 0);
-	}
-	#endif
+	signed short H0;
+	signed short temp = hotend->akt_temp;
+
+#ifdef HOTEND_MODEL
+	if(hotend->model)
+		H0 = heater_model_duty(hotend, &temp);
+	else
+#endif
+		H0 = (((long)hotend->slope*(long)hotend->target_temp)>>8)+hotend->intercept;
+	H0 = min(H0, hotend->max_pwm);
 
-	error = hotend->target_temp - hotend->akt_temp;
+	error = hotend->target_temp - temp;
 	//printf("ERR: %d ", error);
 	delta_temp = hotend->akt_temp - hotend->prev_temp;
 
 	hotend->prev_temp = hotend->akt_temp;
 	hotend->pTerm = (signed short)(((long)hotend->PID_Kp * error) / 256);
 	
-  const signed short H0 = min(((((long)hotend->slope*(long)hotend->target_temp)>>8)+hotend->intercept),hotend->max_pwm);
 	heater_duty = H0 + hotend->pTerm;
 
 	//printf("P: %d ", hotend->pTerm);
@@ -511,32 +596,28 @@ void heater_PID_control(heater_struct *hotend)
 }
 
 //--------------------------------------------------
-// Simple Heatbed Tempcontrol with ON/OFF switching
+// Drive a heater from its pwm value: through its soft PWM
+// channel, or switched directly for the upper half of the
+// duty range when it has none
 //--------------------------------------------------
-void onoff_control_bed(void)
+static void heater_output(heater_struct *heater)
 {
-	
-	bed_heater.akt_temp = analog2temp_convert(adc_read(5),bed_heater.thermistor_type);
-	
-	#ifdef MINTEMP
-	if(bed_heater.akt_temp < MINTEMP)
-	{
-		bed_heater.target_temp = 0;
-		heater_switch(HEATER_BED, 0);
-		LED_switch(3,0);
-	}
-	#endif
-			
-	if(bed_heater.akt_temp  > bed_heater.target_temp)
+	unsigned char ch = heater->pwm_channel;
+
+	if(ch != HEATER_NO_PWM && heater->soft_pwm_aktiv)
 	{
-		heater_switch(HEATER_BED, 0);
-		LED_switch(3,0);
+		g_pwm_io_adr[ch] = heater->io_adr;
+		g_pwm_value[ch] = heater->pwm;
+		g_pwm_aktiv[ch] = 1;
 	}
-	else if((bed_heater.akt_temp  < bed_heater.target_temp) && (bed_heater.target_temp > 0))
+	else
 	{
-		heater_switch(HEATER_BED, 1);
-		LED_switch(3,1);
+		if(ch != HEATER_NO_PWM)
+			g_pwm_aktiv[ch] = 0;
+		heater_switch(heater->io_adr, heater->pwm > heater->max_pwm / 2);
 	}
+
+	LED_switch(heater->led, heater->pwm > 0);
 }
 
 //--------------------------------------------------
@@ -548,8 +629,8 @@ void ConfigureTc_1(void)
 	// Enable peripheral clock
 	AT91C_BASE_PMC->PMC_PCER = 1 << AT91C_ID_TC1;
 	
-	// Configure TC for a 10 kHz frequency and trigger on RC compare
-	unsigned int freq=10000; 
+	// Configure TC for the PWM tick rate and trigger on RC compare
+	unsigned int freq=FAN_PWM_RATE; 
 
 	TC_Configure(AT91C_BASE_TC1, 3 | AT91C_TC_CPCTRG);
 	//AT91C_BASE_TC1->TC_RB = 3;
@@ -567,55 +648,114 @@ void ConfigureTc_1(void)
 
 
 //--------------------------------------------------
-// Cycle Function for Tempcontrol
+// Cycle Function for Tempcontrol, every HEATER_CHECK_INTERVAL:
+// all temperatures are read, each heater is controlled
+// at its own period
 //--------------------------------------------------
 void manage_heaters(void)
 {
-	static unsigned char bed_timer = 0;
-	static unsigned char hotend_timer = 0;
-	
-	bed_timer++;
-	
-	if(bed_timer >= 20)
+	heater_struct* heater;
+	unsigned char i;
+
+	for(i = 0; i < NUM_HEATERS; i++)
 	{
-		//Call every 2 sec
-		onoff_control_bed();
-		
-		bed_timer = 0;
+		heater = &heaters[i];
+
+		heater->temp_dc = temptable_read(heater->temp_table,heater->ad_cannel);
+		heater->akt_temp = DC_TO_C(heater->temp_dc);
+
+		if(heater != eval_heater)
+		{
+			#ifdef MINTEMP
+			if(heater->akt_temp < MINTEMP)
+				heater->target_temp = 0;
+			#endif
+
+			#ifdef MAXTEMP
+			if(heater->akt_temp > MAXTEMP)
+				heater->target_temp = 0;
+			#endif
+
+			// the relay test averages every reading
+			if(heater->control == HEATER_MODE_AUTOTUNE)
+				autotune_step(heater);
+			else if(--heater->countdown == 0)
+			{
+				heater->countdown = max(heater->period / HEATER_CHECK_INTERVAL, 1);
+
+				switch(heater->control)
+				{
+					case HEATER_MODE_PID:
+						heater_PID_control(heater);
+						break;
+					case HEATER_MODE_ONOFF:
+						heater_on_off_control(heater);
+						break;
+					default:
+						heater->pwm = 0;
+						break;
+				}
+			}
+
+			// switched off right away, not at the next control period
+			if(heater->target_temp == 0)
+				heater->pwm = 0;
+		}
+
+		heater_output(heater);
 	}
-	
-	if(hotend_timer == 0)
+}
+
+//--------------------------------------------------
+// Deferred heater control: SysTick only flags the cycle, heater_task()
+// runs it from the main loop and from the loops that wait for
+// something (M109, M190, G4, full planner buffer, autotune)
+//--------------------------------------------------
+static volatile unsigned char heater_due = 0;
+static volatile unsigned char heater_missed = 0;
+static unsigned short heater_countdown = HEATER_CHECK_INTERVAL;
+static unsigned long heater_task_max_us = 0;
+
+// SysTick, every ms
+void heater_tick(void)
+{
+	if (--heater_countdown)
+		return;
+	heater_countdown = HEATER_CHECK_INTERVAL;
+
+	// the main loop is stuck, don't leave the heaters on
+	if (heater_due && ++heater_missed >= HEATER_TASK_MAX_MISSED)
 	{
-		//Call every 500 ms
-		//heater_on_off_control(&heaters[0]);
-    if(!autotune_active)
-		  heater_PID_control(&heaters[0]);
-		g_pwm_value[0] = heaters[0].pwm;
-		g_pwm_io_adr[0] = heaters[0].io_adr;
-		g_pwm_aktiv[0] = heaters[0].soft_pwm_aktiv;
-		
-		if(g_pwm_value[0] > 0)
-			LED_switch(4,1);
-		else
-			LED_switch(4,0);
-			
-		hotend_timer = 1;
+		unsigned char i;
+
+		for (i = 0; i < NUM_HEATERS; i++)
+		{
+			if (heaters[i].pwm_channel != HEATER_NO_PWM)
+				g_pwm_value[heaters[i].pwm_channel] = 0;
+			heater_switch(heaters[i].io_adr, 0);
+		}
 	}
-	else if(hotend_timer == 1)
+	heater_due = 1;
+}
+
+void heater_task(void)
+{
+	unsigned long start, elapsed;
+
+	if (!heater_due)
+		return;
+	heater_due = 0;
+	heater_missed = 0;
+
+	start = sched_time_us();
+	manage_heaters();
+	elapsed = sched_time_us() - start;
+
+	if (elapsed > heater_task_max_us)
 	{
-		heater_on_off_control(&heaters[1]);
-    //if(!autotune_active)
-		//  heater_PID_control(&heaters[1]);
-		g_pwm_value[1] = heaters[1].pwm;
-		g_pwm_io_adr[1] = heaters[1].io_adr;
-		g_pwm_aktiv[1] = heaters[1].soft_pwm_aktiv;
-		
-		if(g_pwm_value[1] > 0)
-			LED_switch(5,1);
-		else
-			LED_switch(5,0);
-		
-		hotend_timer = 0;
+		heater_task_max_us = elapsed;
+		if (elapsed > HEATER_TASK_BUDGET_US)
+			printf("heaters: manage_heaters() took %lu us\n\r",elapsed);
 	}
 }
 
@@ -624,181 +764,262 @@ void manage_heaters(void)
 // Thanks to Erik van der Zalm for this idea to use it for Marlin
 // Some information see:
 // http://brettbeauregard.com/blog/2012/01/arduino-pid-autotune-library/
+//
+// Runs in manage_heaters() for each heater in HEATER_MODE_AUTOTUNE,
+// any number of heaters at once. PID_autotune() only starts it.
 //------------------------------------------------------------------
 
-void PID_autotune(heater_struct *hotend, float PIDAT_test_temp)
+#define AUTOTUNE_SAMPLES	(1000 / HEATER_CHECK_INTERVAL)	// readings averaged, 1 s
+#define AUTOTUNE_CYCLES		6
+#define AUTOTUNE_TIMEOUT	(10L*60L*1000L*2L)
+
+// gains per HOTEND_CHECK_INTERVAL, scaled to the period of the heater
+#define PIDAT_TIME_FACTOR ((HEATER_CHECK_INTERVAL * 256) / 1000)
+
+// autotune_struct.result
+#define AUTOTUNE_NONE		0
+#define AUTOTUNE_FINISHED	1
+#define AUTOTUNE_FAILED		2
+
+typedef struct {
+	unsigned char result;			// of the last test
+	const char* reason;				// why it failed
+	unsigned char prev_control;
+	unsigned char cycles;
+	unsigned char heating;
+	unsigned char count_input;
+	float test_temp;
+	float input;
+	float input_ave;
+	float max;
+	float min;
+	long bias;
+	long d;
+	long t_high;
+	long t_low;
+	unsigned long t1;
+	unsigned long t2;
+	float Ku;
+	float Tu;
+} autotune_struct;
+
+static autotune_struct autotune[NUM_HEATERS];
+
+// T0, T1, ... B (bed), C (chamber)
+static void heater_label(unsigned char i, char* label)
 {
-  float PIDAT_input = 0;
-  float PIDAT_input_ave = 0;
-  unsigned char PIDAT_count_input = 0;
+	if(i < MAX_EXTRUDER)
+		sprintf(label,"T%u",i);
+	else
+		strcpy(label,i == HEATER_IDX_BED ? "B" : "C");
+}
 
-  float PIDAT_max = 0.0;
-  float PIDAT_min = 250.0;
- 
-  unsigned char PIDAT_PWM_val = hotend->max_pwm;
-  
-  unsigned char PIDAT_cycles = 0;
-  unsigned char PIDAT_heating = true;
+//--------------------------------------------------
+// Start a relay test at PIDAT_test_temp, 0 if the heater
+// is already busy with a test
+//--------------------------------------------------
+unsigned char PID_autotune(heater_struct *hotend, float PIDAT_test_temp)
+{
+	autotune_struct* at = &autotune[hotend - heaters];
+
+	if(hotend->control == HEATER_MODE_AUTOTUNE || hotend == eval_heater)
+		return 0;
+
+	at->result = AUTOTUNE_NONE;
+	at->reason = NULL;
+	at->prev_control = hotend->control;
+	at->cycles = 0;
+	at->heating = true;
+	at->count_input = 0;
+	at->test_temp = PIDAT_test_temp;
+	at->input = 0;
+	at->input_ave = 0;
+	at->max = 0;
+	at->min = PIDAT_test_temp;
+	at->bias = hotend->max_pwm/2;
+	at->d = hotend->max_pwm/2;
+	at->t_high = 0;
+	at->t_low = 0;
+	at->t1 = timestamp;
+	at->t2 = timestamp;
+	at->Ku = 0;
+	at->Tu = 0;
+
+	printf("PID Autotune channel %u\r\n",hotend->ad_cannel);
+
+	hotend->target_temp = (signed short)PIDAT_test_temp;
+	hotend->pwm = hotend->max_pwm;
+	hotend->control = HEATER_MODE_AUTOTUNE;
+	return 1;
+}
 
-  unsigned long PIDAT_temp_millis = timestamp;
-  unsigned long PIDAT_t1 = PIDAT_temp_millis;
-  unsigned long PIDAT_t2 = PIDAT_temp_millis;
-  unsigned long PIDAT_T_check_AI_val = PIDAT_temp_millis;
+//--------------------------------------------------
+// Back to the control mode before the test, with the
+// "some overshoot" gains when it finished
+//--------------------------------------------------
+static void autotune_end(heater_struct *hotend, unsigned char result, const char* reason)
+{
+	unsigned char i = hotend - heaters;
+	autotune_struct* at = &autotune[i];
+	float Kp, Ki, Kd;
+	char label[4];
+
+	hotend->control = at->prev_control;
+	hotend->target_temp = 0;
+	hotend->pwm = 0;
+	at->result = result;
+	at->reason = reason;
+	heater_label(i,label);
+
+	if(result == AUTOTUNE_FAILED)
+	{
+		usb_printf("PID Autotune %s failed! %s \r\n",label,reason);
+		return;
+	}
 
-  
-  long PIDAT_t_high = 0;
-  long PIDAT_t_low = 0;
+	// reference http://en.wikipedia.org/wiki/Ziegler%E2%80%93Nichols_method
+	Kp = 0.33*at->Ku;
+	Ki = 2*Kp/at->Tu;
+	Kd = Kp*at->Tu/3;
 
-  long PIDAT_bias = hotend->max_pwm/2;  
-  long PIDAT_d  =  hotend->max_pwm/2;
-  
-  float PIDAT_Ku = 0, PIDAT_Tu = 0;
-  float PIDAT_Kp = 0, PIDAT_Ki = 0, PIDAT_Kd = 0;
-  
-  #define PIDAT_TIME_FACTOR ((HEATER_CHECK_INTERVAL * 256) / 1000)
-  
-  usb_printf("PID Autotune start\r\n");
-  printf("PID Autotune channel %u\r\n",hotend->ad_cannel);
+	hotend->PID_Kp = (unsigned short)(Kp*256);
+	hotend->PID_I = (unsigned short)(Ki*PIDAT_TIME_FACTOR*hotend->period/HOTEND_CHECK_INTERVAL);
+	hotend->PID_Kd = (unsigned short)(Kd*PIDAT_TIME_FACTOR*HOTEND_CHECK_INTERVAL/hotend->period);
+	hotend->temp_iState = 0;
+	heater_pid_limits(hotend);
 
-  autotune_active = true;  // disable PID while tuning
+	if(i < MAX_EXTRUDER)
+	{
+		pa.heater_pTerm[i] = hotend->PID_Kp;
+		pa.heater_iTerm[i] = hotend->PID_I;
+		pa.heater_dTerm[i] = hotend->PID_Kd;
+	}
 
-  PIDAT_min = PIDAT_test_temp;
+	printf(" Ku: %u/1000  Tu: %u ms\r\n",(unsigned)(at->Ku*1000),(unsigned)(at->Tu*1000));
+	usb_printf("PID Autotune %s finished! P%u I%u D%u%s\r\n",label,hotend->PID_Kp,hotend->PID_I,hotend->PID_Kd,
+		i < MAX_EXTRUDER ? ", M500 stores them" : "");
+}
 
-  hotend->target_temp = (signed short)PIDAT_test_temp;
-  hotend->pwm = (unsigned char)PIDAT_PWM_val;
-  
-  #ifdef BED_USES_THERMISTOR
-    bed_heater.target_temp = 0;
-    heater_switch(HEATER_BED, 0);
-    LED_switch(3,0);
-  #endif
-  
-  for(;;) 
-  {
-     // Average 10 readings
-    if((timestamp - PIDAT_T_check_AI_val) > 100 )
-    {
-      PIDAT_T_check_AI_val = timestamp;
-      
-      PIDAT_input_ave += analog2temp_convert(adc_read(hotend->ad_cannel),hotend->thermistor_type);
+//--------------------------------------------------
+// One relay test cycle, every HEATER_CHECK_INTERVAL
+//--------------------------------------------------
+static void autotune_step(heater_struct *hotend)
+{
+	autotune_struct* at = &autotune[hotend - heaters];
+	long PIDAT_PWM_val = hotend->pwm;
 
-      PIDAT_count_input++;
-    }
-    
-    if(PIDAT_count_input >= 10 )
-    {
-      PIDAT_input = (float)PIDAT_input_ave / (float)PIDAT_count_input;
-      PIDAT_input_ave = 0;
-      PIDAT_count_input = 0;
-      
-      PIDAT_max=max(PIDAT_max,PIDAT_input);
-      PIDAT_min=min(PIDAT_min,PIDAT_input);
-
-      if(PIDAT_heating == true && PIDAT_input > PIDAT_test_temp) 
-      {
-        if(timestamp - PIDAT_t2 > 5000) 
-        { 
-          PIDAT_heating = false;
-          PIDAT_PWM_val = (PIDAT_bias - PIDAT_d);
-          PIDAT_t1 = timestamp;
-          PIDAT_t_high = PIDAT_t1 - PIDAT_t2;
-          PIDAT_max = PIDAT_test_temp;
-        }
-      }
-      
-      if((PIDAT_heating == false) && (PIDAT_input < PIDAT_test_temp)) 
-      {
-        if(timestamp - PIDAT_t1 > 5000) 
-        {
-          PIDAT_heating = true;
-          PIDAT_t2 = timestamp;
-          PIDAT_t_low = PIDAT_t2 - PIDAT_t1;
-          
-          if(PIDAT_cycles > 0) 
-          {
-            PIDAT_bias += (PIDAT_d*(PIDAT_t_high - PIDAT_t_low))/(PIDAT_t_low + PIDAT_t_high);
-            PIDAT_bias = constrain(PIDAT_bias, 20 ,hotend->max_pwm - 20);
-            if(PIDAT_bias > (hotend->max_pwm/2))
-            {
-              PIDAT_d = (hotend->max_pwm - 1) - PIDAT_bias;
-            } else {
-              PIDAT_d = PIDAT_bias;
-            }
-            usb_printf(" bias: %d  d: %d  min: %d  max: %d \r\n",(int)PIDAT_bias,(int)PIDAT_d,(int)PIDAT_min,(int)PIDAT_max);
-            
-            if(PIDAT_cycles > 2) 
-            {
-              PIDAT_Ku = (4.0*PIDAT_d)/(3.14159*(PIDAT_max-PIDAT_min));
-              PIDAT_Tu = ((float)(PIDAT_t_low + PIDAT_t_high)/1000.0);
-              
-              usb_printf(" Ku: %d  Tu: %d \r\n",(int)PIDAT_Ku,(int)PIDAT_Tu);
-
-            // reference http://en.wikipedia.org/wiki/Ziegler%E2%80%93Nichols_method
-
-              PIDAT_Kp = 0.60*PIDAT_Ku;
-              PIDAT_Ki = 2*PIDAT_Kp/PIDAT_Tu;
-              PIDAT_Kd = PIDAT_Kp*PIDAT_Tu/8;
-
-              printf(" P:%u, I:%u, D:%u\r\n",(unsigned)(PIDAT_Kp*1000),(unsigned)(PIDAT_Ki*1000),(unsigned)(PIDAT_Kd*1000));
-              usb_printf(" Clasic PID \r\n  CFG Kp: %u \r\n  CFG Ki: %u \r\n  CFG Kd: %u \r\n", (unsigned int)(PIDAT_Kp*256),(unsigned int)(PIDAT_Ki*PIDAT_TIME_FACTOR),(unsigned int)(PIDAT_Kd*PIDAT_TIME_FACTOR));
-
-              PIDAT_Kp = 0.33*PIDAT_Ku;
-              PIDAT_Ki = 2*PIDAT_Kp/PIDAT_Tu;
-              PIDAT_Kd = PIDAT_Kp*PIDAT_Tu/3;
-
-              usb_printf(" Some overshoot \r\n  CFG Kp: %u \r\n  CFG Ki: %u \r\n  CFG Kd: %u \r\n",(unsigned int)(PIDAT_Kp*256),(unsigned int)(PIDAT_Ki*PIDAT_TIME_FACTOR),(unsigned int)(PIDAT_Kd*PIDAT_TIME_FACTOR));
-
-              PIDAT_Kp = 0.20*PIDAT_Ku;
-              PIDAT_Ki = 2*PIDAT_Kp/PIDAT_Tu;
-              PIDAT_Kd = PIDAT_Kp*PIDAT_Tu/3;
-
-              usb_printf(" No overshoot \r\n  CFG Kp: %u \r\n  CFG Ki: %u \r\n  CFG Kd: %u \r\n",(unsigned int)(PIDAT_Kp*256),(unsigned int)(PIDAT_Ki*PIDAT_TIME_FACTOR),(unsigned int)(PIDAT_Kd*PIDAT_TIME_FACTOR));
-
-            }
-          }
-          PIDAT_PWM_val = (PIDAT_bias + PIDAT_d);
-          PIDAT_cycles++;
-          PIDAT_min = PIDAT_test_temp;
-        }
-      } 
-      
-    PIDAT_PWM_val = constrain(PIDAT_PWM_val, 0, hotend->max_pwm);
-    hotend->pwm = (unsigned char)PIDAT_PWM_val;
-    }
+	// M104 S0, MINTEMP, MAXTEMP, kill()
+	if(hotend->target_temp == 0)
+	{
+		autotune_end(hotend,AUTOTUNE_FAILED,"stopped");
+		return;
+	}
 
-    if((PIDAT_input > (PIDAT_test_temp + 55)) || (PIDAT_input > 255))
-    {
-      usb_printf("PID Autotune failed! Temperature to high \r\n");
-      hotend->target_temp = 0;
-      hotend->pwm = 0;
-      autotune_active = false;
-      return;
-    }
-    
-    if(timestamp - PIDAT_temp_millis > 2000) 
-    {
-      PIDAT_temp_millis = timestamp;
-      usb_printf("ok T: %u  @:%u \r\n",(unsigned char)PIDAT_input,(unsigned char)PIDAT_PWM_val);       
-    }
-    
-    if(((timestamp - PIDAT_t1) + (timestamp - PIDAT_t2)) > (10L*60L*1000L*2L)) 
-    {
-      usb_printf("PID Autotune failed! timeout \r\n");
-      hotend->target_temp = 0;
-      hotend->pwm = 0;
-      autotune_active = false;
-      return;
-    }
-    
-    if(PIDAT_cycles > 5) 
-    {
-      usb_printf("PID Autotune finished! Set new values with M301 \r\n");
-      hotend->target_temp = 0;
-      hotend->pwm = 0;
-	    autotune_active = false;
-      return;
-    }
-  }
+	// Average 1 s of readings
+	at->input_ave += hotend->temp_dc / 10.0f;
+	if(++at->count_input < AUTOTUNE_SAMPLES)
+		return;
+
+	at->input = at->input_ave / at->count_input;
+	at->input_ave = 0;
+	at->count_input = 0;
+
+	at->max = max(at->max,at->input);
+	at->min = min(at->min,at->input);
+
+	if(at->heating == true && at->input > at->test_temp) 
+	{
+		if(timestamp - at->t2 > 5000) 
+		{ 
+			at->heating = false;
+			PIDAT_PWM_val = (at->bias - at->d);
+			at->t1 = timestamp;
+			at->t_high = at->t1 - at->t2;
+			at->max = at->test_temp;
+		}
+	}
+
+	if((at->heating == false) && (at->input < at->test_temp)) 
+	{
+		if(timestamp - at->t1 > 5000) 
+		{
+			at->heating = true;
+			at->t2 = timestamp;
+			at->t_low = at->t2 - at->t1;
+
+			if(at->cycles > 0) 
+			{
+				// a heater without soft PWM is only on or off, the bias stays in the middle
+				if(hotend->pwm_channel != HEATER_NO_PWM && hotend->soft_pwm_aktiv)
+				{
+					at->bias += (at->d*(at->t_high - at->t_low))/(at->t_low + at->t_high);
+					at->bias = constrain(at->bias, 20 ,hotend->max_pwm - 20);
+					if(at->bias > (hotend->max_pwm/2))
+						at->d = (hotend->max_pwm - 1) - at->bias;
+					else
+						at->d = at->bias;
+				}
+				printf(" bias: %d  d: %d  min: %d  max: %d \r\n",(int)at->bias,(int)at->d,(int)at->min,(int)at->max);
+
+				if(at->cycles > 2) 
+				{
+					at->Ku = (4.0*at->d)/(3.14159*(at->max-at->min));
+					at->Tu = ((float)(at->t_low + at->t_high)/1000.0);
+				}
+			}
+			PIDAT_PWM_val = (at->bias + at->d);
+			at->cycles++;
+			at->min = at->test_temp;
+		}
+	}
+
+	hotend->pwm = (unsigned char)constrain(PIDAT_PWM_val, 0, hotend->max_pwm);
+
+	if((at->input > (at->test_temp + 55)) || (at->input > 255))
+		autotune_end(hotend,AUTOTUNE_FAILED,"Temperature to high");
+	else if(((timestamp - at->t1) + (timestamp - at->t2)) > AUTOTUNE_TIMEOUT) 
+		autotune_end(hotend,AUTOTUNE_FAILED,"timeout");
+	else if(at->cycles >= AUTOTUNE_CYCLES) 
+		autotune_end(hotend,AUTOTUNE_FINISHED,NULL);
+}
+
+//--------------------------------------------------
+// Stop all running tests
+//--------------------------------------------------
+void PID_autotune_abort(void)
+{
+	unsigned char i;
+
+	for(i = 0; i < NUM_HEATERS; i++)
+	{
+		if(heaters[i].control == HEATER_MODE_AUTOTUNE)
+			heaters[i].target_temp = 0;
+	}
+}
+
+//--------------------------------------------------
+// Progress of the running tests and results of the last ones
+//--------------------------------------------------
+void PID_autotune_report(void)
+{
+	autotune_struct* at;
+	heater_struct* heater;
+	unsigned char i;
+	char label[4];
+
+	for(i = 0; i < NUM_HEATERS; i++)
+	{
+		at = &autotune[i];
+		heater = &heaters[i];
+		heater_label(i,label);
+
+		if(heater->control == HEATER_MODE_AUTOTUNE)
+			usb_printf("%s: autotune %d C, cycle %u/%u, T:%d @%u\r\n",label,(int)at->test_temp,at->cycles,AUTOTUNE_CYCLES,heater->akt_temp,heater->pwm);
+		else if(at->result == AUTOTUNE_FINISHED)
+			usb_printf("%s: autotune finished, P%u I%u D%u\r\n",label,heater->PID_Kp,heater->PID_I,heater->PID_Kd);
+		else if(at->result == AUTOTUNE_FAILED)
+			usb_printf("%s: autotune failed, %s\r\n",label,at->reason);
+	}
 }
 //---------------- END AUTOTUNE PID ------------------------------
 
@@ -825,12 +1046,16 @@ void Heater_Eval(heater_struct *hotend, unsigned int step)
 
   usb_printf("Find equation of temperature to heater pwm \r\n\n");
 
-  autotune_active = true;  // disable PID while running
+  if(hotend->control == HEATER_MODE_AUTOTUNE)
+  {
+    usb_printf("PID Autotune running on this heater \r\n");
+    return;
+  }
+
+  eval_heater = hotend;  // disable its control while running
 
   #ifdef BED_USES_THERMISTOR
-    bed_heater.target_temp = 0;
-    heater_switch(HEATER_BED, 0);
-    LED_switch(3,0);
+    heaters[HEATER_IDX_BED].target_temp = 0;
   #endif
 
   for(pwm = step; pwm < hotend->max_pwm; pwm+=step) 
@@ -840,10 +1065,11 @@ void Heater_Eval(heater_struct *hotend, unsigned int step)
     T_check = timestamp;
     while((unsigned int)input != (unsigned int)input_ave)
     {
+      heater_task();
       if((timestamp - T_check) > 500 )
       {
         T_check = timestamp;
-        input = analog2temp_convert(adc_read(hotend->ad_cannel),hotend->thermistor_type);
+        input = temptable_read(hotend->temp_table,hotend->ad_cannel) / 10.0f;
         input_ave += (input - input_ave)/25;
       }
       if( input > 195 ) break;
@@ -862,7 +1088,7 @@ void Heater_Eval(heater_struct *hotend, unsigned int step)
   printf("\r\n\n");
   hotend->target_temp = 0;
   hotend->pwm = 0;
-  autotune_active = false;
+  eval_heater = NULL;
   
   unsigned int x_sum = 0;
   unsigned int y_sum = 0;
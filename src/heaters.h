@@ -83,19 +83,55 @@ signed short analog2temp_thermistor_compute(signed short raw, const float beta,
 signed short temp2analog_thermistor_table(signed short celsius, const short table[][2], signed short numtemps);
 signed short analog2temp_thermistor_table(signed short raw,const short table[][2], signed short numtemps);
 
+// dense conversion tables over adc_read_raw(), 0.1 C per step
+#define TEMPTABLE_BITS	8
+#define TEMPTABLE_SIZE	(1 << TEMPTABLE_BITS)
+#define TEMPTABLE_SHIFT	(16 - TEMPTABLE_BITS)
+
+void temptable_build(signed short* table, unsigned char sensortype);
+signed short temptable_read(const signed short* table, unsigned char ad_channel);
+
 
 #define constrain(amt,low,high) ((amt)<(low)?(low):((amt)>(high)?(high):(amt)))
 #define min(a,b) ((a)<(b)?(a):(b))
 #define max(a,b) ((a)>(b)?(a):(b))
 
 
+// heaters[]: the hotends first, then the bed and the chamber
+#define HEATER_IDX_BED		MAX_EXTRUDER
+#ifdef CHAMBER_HEATER
+#define HEATER_IDX_CHAMBER	(MAX_EXTRUDER + 1)
+#define NUM_HEATERS			(MAX_EXTRUDER + 2)
+#else
+#define NUM_HEATERS			(MAX_EXTRUDER + 1)
+#endif
+
+// heater_struct.control
+#define HEATER_MODE_OFF		0
+#define HEATER_MODE_ONOFF	1
+#define HEATER_MODE_PID		2
+#define HEATER_MODE_AUTOTUNE	3	// PID_autotune() running, the mode before is restored
+
+// heater_struct.pwm_channel of a heater that is switched directly
+#define HEATER_NO_PWM		0xFF
+
 void manage_heaters(void);
+void heater_tick(void);
+void heater_task(void);
 void init_heaters_values(void);
 void heater_switch(unsigned char heater, unsigned char en);
 void LED_switch(unsigned char led, unsigned char en);
 //void heater_soft_pwm(void);
 
 
+// thermal model of a hotend (HOTEND_MODEL)
+typedef struct {
+	float power;			// W at pwm 255
+	float capacity;			// J/K
+	float loss;				// W/K to the ambient
+	float fan_loss;			// W/K more with the part fan at full speed
+} heater_model;
+
 typedef struct {
 	signed short target_temp;
 	signed short akt_temp;
@@ -107,6 +143,11 @@ typedef struct {
 	
 	unsigned char io_adr;
 	unsigned char ad_cannel;
+	unsigned char pwm_channel;		// g_pwm_* channel or HEATER_NO_PWM
+	unsigned char led;
+	unsigned char control;			// HEATER_MODE_*
+	unsigned short period;			// control interval in ms
+	unsigned char countdown;		// manage_heaters() cycles to the next control
 	
 	signed short temp_iState;
 	signed short prev_temp;
@@ -117,20 +158,16 @@ typedef struct {
 	signed short temp_iState_max;
 	
 	signed short thermistor_type;
+	signed short temp_dc;			// akt_temp in 0.1 C
+	signed short temp_table[TEMPTABLE_SIZE + 1];
 	
 	signed short slope;
 	signed short intercept;
 	signed short max_pwm;
+	const heater_model* model;		// feed-forward instead of slope/intercept, NULL if none
 
 } heater_struct;
 
-typedef struct {
-	signed short target_temp;
-	signed short akt_temp;
-	signed short thermistor_type;
-
-} heater_bed_struct;
-
 
 
 extern signed short bed_temp_celsius;
@@ -139,11 +176,13 @@ extern signed short hotend2_temp_celsius;
 extern signed short target_hotend1;
 
 extern heater_struct heaters[];
-extern heater_bed_struct bed_heater;
 
 extern volatile unsigned char g_pwm_value[];
 extern volatile unsigned char g_pwm_aktiv[];
 
-void PID_autotune(heater_struct *hotend, float PIDAT_test_temp);
+void heater_pid_limits(heater_struct *heater);
+unsigned char PID_autotune(heater_struct *hotend, float PIDAT_test_temp);
+void PID_autotune_abort(void);
+void PID_autotune_report(void);
 void Heater_Eval(heater_struct *hotend, unsigned int step);
 
@@ -183,6 +183,19 @@ Clasic PID
   #define HEATER_1_SLOPE 24  // slope * 256
   #define HEATER_1_INTERCEPT -2
 //	#define HEATER_DUTY_FOR_SETPOINT(setpoint) ((int)((HEATER_SLOPE*(long)setpoint)>>8)+HEATER_INTERCEPT)  
+	// Thermal model of the hotends instead of magic formula 1: the feed-forward holds the target
+	// against the losses to the ambient, the part fan (M106) and the filament of the queued moves,
+	// so a higher flow or the fan is compensated before the temperature drops.
+	// {heater W at pwm 255, heat block J/K, loss to the ambient W/K, more loss with the fan at full speed W/K}
+	// loss / heater power is about HEATER_x_SLOPE / 65536 (Heater_Eval, M303 S0)
+	//#define HOTEND_MODEL
+	#define HEATER_0_MODEL {40.0, 16.0, 0.07, 0.05}
+	#define HEATER_1_MODEL {40.0, 16.0, 0.07, 0.05}
+	#define HOTEND_MODEL_AMBIENT 25
+	#define HOTEND_MODEL_HORIZON 2.0		// s, queued moves for the flow and prediction of the temperature
+	#define FILAMENT_DIAMETER 1.75			// mm
+	#define FILAMENT_HEAT_CAPACITY 0.002	// J/K per mm^3 (PLA 0.0022, ABS 0.0015)
+
 	// magic formula 2, to make led brightness approximately linear
 	#define LED_PWM_FOR_BRIGHTNESS(brightness) ((64*brightness-1384)/(300-brightness))
 	
@@ -196,14 +209,34 @@ Clasic PID
 
 #endif
 
+// Soft PWM ticks per second (sigma-delta, the duty is exact over a few ticks)
+#define HEATER_PWM_RATE 100
+// the fans (M106, M176) need short pulses, a multiple of HEATER_PWM_RATE
+#define FAN_PWM_RATE 2000
+
 // Change this value (range 1-255) to limit the current to the nozzle
+// (also the PID output limit, both hotends run PID; hotend 2 is limited
+// to 20% by default, M301 T1 W255 and M500 for full power)
 #define HEATER_0_MAX_PWM 255
 #define HEATER_1_MAX_PWM 50
 
 // How often should the heater check for new temp readings, in milliseconds
 #define HEATER_CHECK_INTERVAL 250
+// Control period of the hotends (the PID gains above are for half a second)
+#define HOTEND_CHECK_INTERVAL 500
+
+// The heater control runs from the main loop (heater_task()), SysTick only flags it.
+// A run longer than the budget is reported on the debug console (microseconds).
+#define HEATER_TASK_BUDGET_US 1000
+// Heaters are switched off from SysTick when the main loop misses this many cycles in a row
+#define HEATER_TASK_MAX_MISSED 8
 #define BED_CHECK_INTERVAL 5000
 
+// Chamber heater, on/off at BED_CHECK_INTERVAL: sensor on the free ADC input (TEMP3),
+// heater on the AUX2 output, which is then no longer available as fan 2 (M176)
+//#define CHAMBER_HEATER
+#define CHAMBER_THERMISTOR 11
+
 
 //// Experimental watchdog and minimal temp
 // The watchdog waits for the watchperiod in milliseconds whenever an M104 or M109 increases the target temperature
@@ -224,5 +257,24 @@ Clasic PID
 #define MAXTEMP 275
 
 
+//-----------------------------------------------------------------------
+//// DEBUG CONSOLE (DBGU)
+//-----------------------------------------------------------------------
+// printf() output is buffered and sent by the PDC in the background.
+// When the buffer is full: 0 = drop the new text, 1 = wait for space
+// (only outside of interrupts, inside interrupts the text is always dropped)
+#define CONSOLE_OVERFLOW_WAIT 0
+
+
+//-----------------------------------------------------------------------
+//// POWER LOSS JOURNAL (SD prints, M545)
+//-----------------------------------------------------------------------
+// Minimum time between two checkpoints in milliseconds, each one is a
+// single sector write to the SD card
+#define JOURNAL_INTERVAL_MS 2000
+// M545 lifts Z by this many mm before moving over the part, M24 lowers it again
+#define JOURNAL_Z_LIFT 2
+
+
 
 #endif
\ No newline at end of file
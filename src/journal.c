@@ -0,0 +1,244 @@
+/*
+ Power loss journal
+ Written from the main loop while an SD file is replayed, read by M545.
+ See journal.h for the layout.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <board.h>
+#include <irq/irq.h>
+#include <fatfs/src/ff.h>
+#include <fatfs/src/diskio.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "init_configuration.h"
+#include "journal.h"
+#include "sdcard.h"
+#include "serial.h"
+#include "parameters.h"
+#include "heaters.h"
+#include "planner.h"
+#include "stepper_control.h"
+#include "binary_protocol.h"
+#include "globals.h"
+
+#define JOURNAL_MAGIC		0x4C4E524A		// "JRNL"
+#define JOURNAL_SECTOR		512
+
+static unsigned char journalBuffer[JOURNAL_SECTOR] __attribute__((aligned(4)));
+static unsigned char journalActive = 0;		// replay seen, journal set up
+static unsigned char journalSlots = 0;		// 0 = no journal file
+static uint32_t journalSector;				// first slot
+static uint32_t journalSeq;
+static uint32_t journalLastPos;
+static unsigned long journalTimer;
+
+
+static uint16_t journal_crc(const JournalRecord* rec)
+{
+	const uint8_t* data = (const uint8_t*)rec;
+	uint16_t crc = 0xFFFF;
+	unsigned int i;
+
+	for(i = 0;i < offsetof(JournalRecord,crc);i++)
+		crc = binproto_crc16(crc,data[i]);
+	return crc;
+}
+
+//--------------------------------------------------
+// Find (and with create = 1 preallocate) the journal file,
+// the slots are the first sectors of its first cluster
+//--------------------------------------------------
+static unsigned char journal_open(unsigned char create)
+{
+	FIL file;
+	FRESULT res;
+	uint32_t size = JOURNAL_SLOTS * JOURNAL_SECTOR;
+
+	journalSlots = 0;
+	res = f_open(&file,JOURNAL_FILE,create ? FA_OPEN_ALWAYS|FA_WRITE : FA_OPEN_EXISTING|FA_READ);
+	if (res != FR_OK)
+		return 0;
+
+	// seeking past the end allocates the clusters
+	if (create && f_size(&file) < size && (f_lseek(&file,size) != FR_OK || f_tell(&file) != size))
+	{
+		f_close(&file);
+		return 0;
+	}
+	if (f_size(&file) < size)
+		size = f_size(&file);
+
+	if (file.sclust >= 2)
+	{
+		journalSector = file.fs->database + (file.sclust - 2) * file.fs->csize;
+		journalSlots = size / JOURNAL_SECTOR;
+		if (journalSlots > file.fs->csize)
+			journalSlots = file.fs->csize;
+	}
+	f_close(&file);
+	return journalSlots != 0;
+}
+
+//--------------------------------------------------
+// Newest good record of the open journal into rec,
+// leaves the highest sequence number in journalSeq
+//--------------------------------------------------
+static unsigned char journal_scan(JournalRecord* rec)
+{
+	const JournalRecord* slot = (const JournalRecord*)journalBuffer;
+	unsigned char found = 0;
+	unsigned char i;
+
+	journalSeq = 0;
+	for(i = 0;i < journalSlots;i++)
+	{
+		if (disk_read(0,journalBuffer,journalSector + i,1) != RES_OK)
+			continue;
+		if (slot->magic != JOURNAL_MAGIC || slot->crc != journal_crc(slot))
+			continue;
+		if (!found || slot->seq > journalSeq)
+		{
+			journalSeq = slot->seq;
+			if (rec)
+				memcpy(rec,slot,sizeof(JournalRecord));
+			found = 1;
+		}
+	}
+	return found;
+}
+
+static void journal_write(uint32_t state, uint32_t filePos, const float* start, signed short feed)
+{
+	JournalRecord* rec = (JournalRecord*)journalBuffer;
+	unsigned char i;
+
+	memset(journalBuffer,0,JOURNAL_SECTOR);
+	rec->magic = JOURNAL_MAGIC;
+	rec->seq = ++journalSeq;
+	rec->state = state;
+	rec->file_pos = filePos;
+	strcpy(rec->file,sdcard_selectedfile());
+	for(i = 0;i < NUM_AXIS;i++)
+		rec->position[i] = start[i];
+	rec->feedrate = feed;
+	rec->feedmultiply = feedmultiply;
+	rec->extrudemultiply = extrudemultiply;
+	rec->hotend_target[0] = heaters[0].target_temp;
+	rec->hotend_target[1] = heaters[1].target_temp;
+	rec->bed_target = heaters[HEATER_IDX_BED].target_temp;
+	rec->relative_mode = relative_mode;
+	rec->relative_e = axis_relative_modes[E_AXIS];
+	rec->crc = journal_crc(rec);
+
+	if (disk_write(0,journalBuffer,journalSector + rec->seq % journalSlots,1) != RES_OK
+		|| disk_ioctl(0,CTRL_SYNC,0) != RES_OK)
+	{
+		printf("journal: write failed\n\r");
+		journalSlots = 0;
+	}
+}
+
+//--------------------------------------------------
+// Main loop: a checkpoint every JOURNAL_INTERVAL_MS while
+// an SD file is replayed and the executed line changed
+//--------------------------------------------------
+void journal_update()
+{
+	float start[NUM_AXIS];
+	uint32_t filePos;
+	signed short feed;
+	unsigned char i;
+
+	if (!sdcard_isreplaying())
+	{
+		// finished or stopped, nothing to resume
+		if (journalActive && journalSlots && sdcard_ismounted())
+		{
+			start[X_AXIS] = start[Y_AXIS] = start[Z_AXIS] = start[E_AXIS] = 0;
+			journal_write(JOURNAL_DONE,0,start,0);
+		}
+		journalActive = 0;
+		return;
+	}
+
+	if (!journalActive)
+	{
+		journalActive = 1;
+		journalLastPos = PLAN_NO_FILE_POS;
+		journalTimer = timestamp;
+		// no checkpoint until a line of this replay is executed
+		st_line_pos = PLAN_NO_FILE_POS;
+		if (strlen(sdcard_selectedfile()) >= JOURNAL_NAME_SIZE || !journal_open(1))
+		{
+			printf("journal: no power loss journal for this print\n\r");
+			journalSlots = 0;
+			return;
+		}
+		journal_scan(NULL);
+		return;
+	}
+
+	if (!journalSlots || timestamp - journalTimer < JOURNAL_INTERVAL_MS)
+		return;
+	journalTimer = timestamp;
+
+	IRQ_DisableIT(AT91C_ID_TC0);
+	filePos = st_line_pos;
+	for(i = 0;i < NUM_AXIS;i++)
+		start[i] = st_line_start[i];
+	feed = st_line_feedrate;
+	IRQ_EnableIT(AT91C_ID_TC0);
+
+	if (filePos == PLAN_NO_FILE_POS || filePos == journalLastPos)
+		return;
+	journalLastPos = filePos;
+	journal_write(JOURNAL_PRINTING,filePos,start,feed);
+}
+
+//--------------------------------------------------
+// M545: the checkpoint of an interrupted print
+//--------------------------------------------------
+unsigned char journal_read(JournalRecord* rec)
+{
+	unsigned char found;
+	FILINFO fno;
+
+	if (sdcard_isreplaying())
+	{
+		usb_printf("error: sd print running\r\n");
+		return 0;
+	}
+	if (!sdcard_ismounted() || !journal_open(0))
+	{
+		usb_printf("error: no journal\r\n");
+		return 0;
+	}
+	found = journal_scan(rec);
+	journalSlots = 0;
+	if (!found || rec->state != JOURNAL_PRINTING)
+	{
+		usb_printf("error: no interrupted print in the journal\r\n");
+		return 0;
+	}
+	// removed or replaced by a shorter file since
+	if (f_stat(rec->file,&fno) != FR_OK || fno.fsize < rec->file_pos)
+	{
+		usb_printf("error: %s not on the card\r\n",rec->file);
+		return 0;
+	}
+	return 1;
+}
@@ -0,0 +1,61 @@
+/*
+ Power loss journal
+ Checkpoints of an SD print (file offset of the line being executed, its
+ start position, temperatures and overrides) so M545 can resume it after
+ a power loss.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef JOURNAL_H_P3QD7MZC
+#define JOURNAL_H_P3QD7MZC
+
+#include <inttypes.h>
+
+// The journal is a preallocated file on the SD card. Its first sectors
+// (at most JOURNAL_SLOTS, all in the first cluster) are written round
+// robin with raw sector writes, so a checkpoint never touches the FAT or
+// the directory and a power loss can only damage the record being written.
+// The record with the highest sequence number and a good CRC is the valid
+// one. Flash is not used: the page endurance is too low for a checkpoint
+// every few seconds and a flash write stalls the CPU, stepper interrupt
+// included.
+#define JOURNAL_FILE		"JOURNAL.BIN"
+#define JOURNAL_SLOTS		8
+#define JOURNAL_NAME_SIZE	64
+
+#define JOURNAL_PRINTING	1
+#define JOURNAL_DONE		2
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t seq;
+	uint32_t state;
+	uint32_t file_pos;					// start of the line being executed
+	char file[JOURNAL_NAME_SIZE];
+	float position[4];					// X Y Z E where that line started
+	signed short feedrate;				// mm/min
+	signed short feedmultiply;
+	signed short extrudemultiply;
+	signed short hotend_target[2];
+	signed short bed_target;
+	unsigned char relative_mode;
+	unsigned char relative_e;
+	uint16_t crc;
+} JournalRecord;
+
+void journal_update(void);
+unsigned char journal_read(JournalRecord* rec);
+
+#endif /* end of include guard: JOURNAL_H_P3QD7MZC */
@@ -0,0 +1,185 @@
+/*
+ LZ decoder round trip check (host tool)
+ Decodes a file made with lz_compress.py through the firmware's own
+ lz_decode.c and compares it with the original G-code, with the input
+ and output chunk sizes of the SD replay and with odd ones, so that
+ back references straddle every chunk boundary:
+
+   make lzcheck
+   bin/lzcheck part.gcode PART.GCZ
+   bin/lzcheck -g test.gcode      (writes the test G-code "make lzcheck" uses)
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz_decode.h"
+
+// sdcard.c: REPLAY_BUFFER_SIZE, REPLAY_LZ_INPUT_SIZE
+#define REPLAY_OUTPUT_SIZE	4096
+#define REPLAY_INPUT_SIZE	512
+
+// end G-code written twice at the end of the test file: with the default
+// lz_compress.py options the second one is the last back reference of the
+// stream, from 2 bytes before the end of the first REPLAY_OUTPUT_SIZE bytes
+#define TEST_SIZE			(REPLAY_OUTPUT_SIZE + 14)
+#define TEST_END			"M84\nM104 S0 T0\n"
+
+static uint8_t* original;
+static long originalSize;
+static uint8_t* compressed;
+static long compressedSize;
+
+static long inputPos;
+static unsigned int inputChunk;
+
+static uint8_t* read_file(const char* name, long* size)
+{
+	FILE* f = fopen(name,"rb");
+	uint8_t* data;
+
+	if (!f)
+	{
+		perror(name);
+		exit(1);
+	}
+	fseek(f,0,SEEK_END);
+	*size = ftell(f);
+	fseek(f,0,SEEK_SET);
+	data = malloc(*size + 1);
+	if (!data || fread(data,1,*size,f) != (size_t)*size)
+	{
+		fprintf(stderr,"%s: read error\n",name);
+		exit(1);
+	}
+	fclose(f);
+	return data;
+}
+
+// the card, at most inputChunk bytes per read
+static int input_read(uint8_t* buffer, unsigned int len)
+{
+	if (len > inputChunk)
+		len = inputChunk;
+	if (len > compressedSize - inputPos)
+		len = compressedSize - inputPos;
+	memcpy(buffer,compressed + inputPos,len);
+	inputPos += len;
+	return len;
+}
+
+//--------------------------------------------------
+// Decode the whole file like replay_read() does, 0 if the
+// result differs from the original
+//--------------------------------------------------
+static unsigned char check(unsigned int inSize, unsigned int outSize)
+{
+	static LzDecoder lz;
+	static uint8_t inBuffer[REPLAY_INPUT_SIZE];
+	LzInput input = {inBuffer,inSize,inBuffer,0,input_read};
+	uint8_t windowBits, lengthBits;
+	uint32_t size, decoded = 0;
+	uint8_t* out = malloc(outSize);
+	unsigned char ok = 1;
+	unsigned int want;
+	int chunk;
+
+	if (!lz_header(compressed,&windowBits,&lengthBits,&size))
+	{
+		fprintf(stderr,"not a compressed file\n");
+		exit(1);
+	}
+	lz_init(&lz,windowBits,lengthBits);
+	inputPos = LZ_HEADER_SIZE;
+	inputChunk = inSize;
+
+	while (decoded < size)
+	{
+		want = outSize;
+		if (want > size - decoded)
+			want = size - decoded;
+		chunk = lz_read(&lz,&input,out,want);
+		if (chunk <= 0 || memcmp(out,original + decoded,chunk) != 0)
+			break;
+		decoded += chunk;
+	}
+	if (decoded != size || size != originalSize)
+	{
+		printf("input %u, output %u: %u of %ld bytes\n",inSize,outSize,(unsigned int)decoded,originalSize);
+		ok = 0;
+	}
+	free(out);
+	return ok;
+}
+
+static void write_test_file(const char* name)
+{
+	FILE* f = fopen(name,"wb");
+	char line[64] = "";
+	long size = 0;
+	int i = 0;
+
+	if (!f)
+	{
+		perror(name);
+		exit(1);
+	}
+	// moves that don't repeat, then the end G-code twice
+	while (size + strlen(line) + 2 * strlen(TEST_END) < TEST_SIZE)
+	{
+		size += fwrite(line,1,strlen(line),f);
+		sprintf(line,"G1 X%d.%d Y%d E%d\n",(i * 37) % 200,i % 10,(i * 91) % 200,i);
+		i++;
+	}
+	// a comment line pads to the exact size
+	if (size + 2 * strlen(TEST_END) < TEST_SIZE)
+	{
+		while (size + 2 * strlen(TEST_END) < TEST_SIZE - 1)
+			size += fwrite(";",1,1,f);
+		size += fwrite("\n",1,1,f);
+	}
+	size += fwrite(TEST_END,1,strlen(TEST_END),f);
+	size += fwrite(TEST_END,1,strlen(TEST_END),f);
+	fclose(f);
+}
+
+int main(int argc, char** argv)
+{
+	static const unsigned int inSizes[] = {1, 2, 3, 7, 64, REPLAY_INPUT_SIZE};
+	unsigned int i, outSize, failed = 0;
+
+	if (argc == 3 && strcmp(argv[1],"-g") == 0)
+	{
+		write_test_file(argv[2]);
+		return 0;
+	}
+	if (argc != 3)
+	{
+		fprintf(stderr,"usage: %s part.gcode PART.GCZ\n       %s -g test.gcode\n",argv[0],argv[0]);
+		return 1;
+	}
+	original = read_file(argv[1],&originalSize);
+	compressed = read_file(argv[2],&compressedSize);
+
+	for(i = 0;i < sizeof(inSizes) / sizeof(inSizes[0]);i++)
+	{
+		failed += !check(inSizes[i],REPLAY_OUTPUT_SIZE);
+		for(outSize = 1;outSize <= 64;outSize++)
+			failed += !check(inSizes[i],outSize);
+	}
+	printf("%s: %s\n",argv[2],failed ? "FAILED" : "ok");
+	return failed != 0;
+}
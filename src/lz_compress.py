@@ -0,0 +1,174 @@
+#!/usr/bin/python
+
+# Compress G-code files for SD replay (see lz_decode.h for the format).
+# The firmware detects compressed files by their header, any name works,
+# .GCZ is a good choice for 8.3 names:
+#
+#   lz_compress.py part.gcode PART.GCZ
+#   lz_compress.py -d PART.GCZ part.gcode     (check a file)
+#
+# "make lzcheck" runs a round trip through the firmware's decoder (lz_check.c).
+
+import struct
+import optparse
+
+MAGIC = b"4PLZ"
+VERSION = 1
+MIN_WINDOW_BITS = 8
+MAX_WINDOW_BITS = 10
+MIN_LENGTH_BITS = 3
+MAX_CHAIN = 64
+
+parser = optparse.OptionParser(usage="%prog [options] infile outfile")
+
+parser.add_option("-w", "--window",
+        action="store",
+        type="int",
+        dest="window",
+        default=MAX_WINDOW_BITS,
+        help="Window size in bits (%d-%d), the firmware keeps 2^window bytes." % (MIN_WINDOW_BITS, MAX_WINDOW_BITS))
+parser.add_option("-l", "--length",
+        action="store",
+        type="int",
+        dest="length",
+        default=4,
+        help="Match length in bits (%d-window-1)." % MIN_LENGTH_BITS)
+parser.add_option("-d", "--decompress",
+        action="store_true",
+        dest="decompress",
+        default=False,
+        help="Decompress instead.")
+
+
+class BitWriter:
+    def __init__(self):
+        self.out = bytearray()
+        self.bits = 0
+        self.count = 0
+
+    def put(self, value, count):
+        self.bits = (self.bits << count) | value
+        self.count += count
+        while self.count >= 8:
+            self.count -= 8
+            self.out.append((self.bits >> self.count) & 0xff)
+        self.bits &= (1 << self.count) - 1
+
+    def finish(self):
+        if self.count:
+            self.out.append((self.bits << (8 - self.count)) & 0xff)
+            self.count = 0
+        return self.out
+
+
+def compress(data, window_bits, length_bits):
+    window = 1 << window_bits
+    max_length = 1 << length_bits
+    # a match has to be cheaper than the literals it replaces
+    min_length = (1 + window_bits + length_bits) // 9 + 1
+    if min_length < 3:
+        min_length = 3
+
+    out = BitWriter()
+    chains = {}
+    pos = 0
+    size = len(data)
+
+    def insert(at):
+        if at + 3 <= size:
+            key = bytes(data[at:at + 3])
+            chains.setdefault(key, []).append(at)
+
+    while pos < size:
+        best_length = 0
+        best_distance = 0
+        if pos + 3 <= size:
+            candidates = chains.get(bytes(data[pos:pos + 3]), [])
+            limit = min(max_length, size - pos)
+            for start in reversed(candidates[-MAX_CHAIN:]):
+                distance = pos - start
+                if distance > window:
+                    break
+                length = 3
+                while length < limit and data[start + length] == data[pos + length]:
+                    length += 1
+                if length > best_length:
+                    best_length = length
+                    best_distance = distance
+                    if length == limit:
+                        break
+
+        if best_length >= min_length:
+            out.put(0, 1)
+            out.put(best_distance - 1, window_bits)
+            out.put(best_length - 1, length_bits)
+            for i in range(best_length):
+                insert(pos + i)
+            pos += best_length
+        else:
+            out.put(1, 1)
+            out.put(data[pos], 8)
+            insert(pos)
+            pos += 1
+
+    header = MAGIC + struct.pack("<BBBBI", VERSION, window_bits, length_bits, 0, size)
+    return header + out.finish()
+
+
+def decompress(data):
+    if data[0:4] != MAGIC:
+        raise ValueError("not a compressed file")
+    version, window_bits, length_bits, reserved, size = struct.unpack("<BBBBI", data[4:12])
+    if version != VERSION:
+        raise ValueError("unknown version %d" % version)
+
+    stream = bytearray(data[12:])
+    out = bytearray()
+
+    def read(n):
+        value = 0
+        for i in range(n):
+            byte = stream[read.pos >> 3]
+            value = (value << 1) | ((byte >> (7 - (read.pos & 7))) & 1)
+            read.pos += 1
+        return value
+    read.pos = 0
+
+    while len(out) < size:
+        if read(1):
+            out.append(read(8))
+        else:
+            distance = read(window_bits) + 1
+            length = read(length_bits) + 1
+            for i in range(length):
+                if len(out) >= size:
+                    break
+                out.append(out[-distance] if distance <= len(out) else 0)
+    return out
+
+
+def main():
+    (options, args) = parser.parse_args()
+    if len(args) != 2:
+        parser.error("infile and outfile expected")
+    if not MIN_WINDOW_BITS <= options.window <= MAX_WINDOW_BITS:
+        parser.error("window bits out of range")
+    if not MIN_LENGTH_BITS <= options.length < options.window:
+        parser.error("length bits out of range")
+
+    with open(args[0], "rb") as f:
+        data = bytearray(f.read())
+
+    if options.decompress:
+        result = decompress(data)
+    else:
+        result = compress(data, options.window, options.length)
+        print("%s: %d -> %d bytes (%.1f%%)" % (args[0], len(data), len(result),
+            100.0 * len(result) / max(len(data), 1)))
+
+    with open(args[1], "wb") as f:
+        f.write(result)
+
+
+if __name__ == "__main__":
+    main()
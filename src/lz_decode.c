@@ -0,0 +1,167 @@
+/*
+ LZ decoder for compressed G-code files
+ See lz_decode.h for the file format.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <string.h>
+
+#include "lz_decode.h"
+
+typedef enum
+{
+	LZ_TAG,
+	LZ_LITERAL,
+	LZ_DISTANCE,
+	LZ_LENGTH,
+	LZ_COPY
+} LzState;
+
+#define LZ_NO_BITS	0xFFFF
+
+
+//--------------------------------------------------
+// Check the file header, 1 if it's a compressed file
+// the decoder can handle
+//--------------------------------------------------
+unsigned char lz_header(const uint8_t* header, uint8_t* windowBits, uint8_t* lengthBits, uint32_t* size)
+{
+	if (memcmp(header,LZ_MAGIC,4) != 0 || header[4] != LZ_VERSION)
+		return 0;
+	if (header[5] < LZ_MIN_WINDOW_BITS || header[5] > LZ_MAX_WINDOW_BITS
+		|| header[6] < LZ_MIN_LENGTH_BITS || header[6] >= header[5])
+		return 0;
+
+	*windowBits = header[5];
+	*lengthBits = header[6];
+	*size = header[8] | (header[9] << 8) | (header[10] << 16) | ((uint32_t)header[11] << 24);
+	return 1;
+}
+
+void lz_init(LzDecoder* lz, uint8_t windowBits, uint8_t lengthBits)
+{
+	lz->bits = 0;
+	lz->bit_count = 0;
+	lz->state = LZ_TAG;
+	lz->window_bits = windowBits;
+	lz->length_bits = lengthBits;
+	lz->head = 0;
+	memset(lz->window,0,sizeof(lz->window));
+}
+
+// next count bits (count <= 16) or LZ_NO_BITS when the input chunk is used up,
+// the bits read so far stay for the next chunk
+static uint16_t get_bits(LzDecoder* lz, uint8_t count, const uint8_t** in, unsigned int* inLen)
+{
+	uint16_t value;
+
+	while (lz->bit_count < count)
+	{
+		if (!*inLen)
+			return LZ_NO_BITS;
+		lz->bits = (lz->bits << 8) | *(*in)++;
+		lz->bit_count += 8;
+		(*inLen)--;
+	}
+	lz->bit_count -= count;
+	value = (lz->bits >> lz->bit_count) & ((1 << count) - 1);
+	return value;
+}
+
+//--------------------------------------------------
+// Decode up to outLen bytes, consumes the input chunk as far as
+// needed. Returns the bytes written, less than outLen only when
+// the chunk is used up.
+//--------------------------------------------------
+unsigned int lz_decode(LzDecoder* lz, const uint8_t** in, unsigned int* inLen, uint8_t* out, unsigned int outLen)
+{
+	uint16_t mask = (1 << lz->window_bits) - 1;
+	unsigned int written = 0;
+	uint16_t value;
+	uint8_t chr;
+
+	while (written < outLen)
+	{
+		switch(lz->state)
+		{
+			case LZ_TAG:
+				if ((value = get_bits(lz,1,in,inLen)) == LZ_NO_BITS)
+					return written;
+				lz->state = value ? LZ_LITERAL : LZ_DISTANCE;
+				break;
+			case LZ_LITERAL:
+				if ((value = get_bits(lz,8,in,inLen)) == LZ_NO_BITS)
+					return written;
+				out[written++] = value;
+				lz->window[lz->head++ & mask] = value;
+				lz->state = LZ_TAG;
+				break;
+			case LZ_DISTANCE:
+				if ((value = get_bits(lz,lz->window_bits,in,inLen)) == LZ_NO_BITS)
+					return written;
+				lz->distance = value + 1;
+				lz->state = LZ_LENGTH;
+				break;
+			case LZ_LENGTH:
+				if ((value = get_bits(lz,lz->length_bits,in,inLen)) == LZ_NO_BITS)
+					return written;
+				lz->count = value + 1;
+				lz->state = LZ_COPY;
+				break;
+			case LZ_COPY:
+				while (lz->count && written < outLen)
+				{
+					chr = lz->window[(lz->head - lz->distance) & mask];
+					out[written++] = chr;
+					lz->window[lz->head++ & mask] = chr;
+					lz->count--;
+				}
+				if (!lz->count)
+					lz->state = LZ_TAG;
+				break;
+		}
+	}
+	return written;
+}
+
+//--------------------------------------------------
+// Decode up to outLen bytes and refill the input through
+// input->read() as needed. Returns the bytes written, less
+// than outLen only at the end of the file, -1 on errors.
+//--------------------------------------------------
+int lz_read(LzDecoder* lz, LzInput* input, uint8_t* out, unsigned int outLen)
+{
+	unsigned int written = 0, decoded;
+	int chunk;
+
+	while (written < outLen)
+	{
+		// a back reference goes on without input, decode first
+		decoded = lz_decode(lz,&input->next,&input->left,out + written,outLen - written);
+		written += decoded;
+		if (written == outLen)
+			break;
+
+		// the input chunk is used up, the end of the file
+		// only when nothing more came out of the decoder
+		chunk = input->read(input->buffer,input->size);
+		if (chunk < 0)
+			return -1;
+		if (!chunk && !decoded)
+			break;
+		input->next = input->buffer;
+		input->left = chunk;
+	}
+	return written;
+}
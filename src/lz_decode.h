@@ -0,0 +1,76 @@
+/*
+ LZ decoder for compressed G-code files
+ Streaming LZSS (heatshrink style bit stream), decodes into any buffer size
+ from any input chunk size. Files are made with lz_compress.py.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef LZ_DECODE_H_9WFN2K5T
+#define LZ_DECODE_H_9WFN2K5T
+
+#include <inttypes.h>
+
+// File layout, all values little endian:
+//
+//   0   "4PLZ"
+//   4   uint8  version (1)
+//   5   uint8  window bits W (LZ_MIN_WINDOW_BITS .. LZ_MAX_WINDOW_BITS)
+//   6   uint8  length bits L (LZ_MIN_LENGTH_BITS .. W - 1)
+//   7   uint8  reserved (0)
+//   8   uint32 size of the uncompressed data
+//   12  bit stream, MSB first:
+//         1 <8 bit literal>
+//         0 <W bits distance - 1> <L bits length - 1>   copy from the window
+//
+// The stream ends after the uncompressed size is reached, the last byte is
+// padded with zero bits. The decoder needs 2^W bytes of RAM for the window.
+#define LZ_MAGIC				"4PLZ"
+#define LZ_VERSION				1
+#define LZ_HEADER_SIZE			12
+#define LZ_MIN_WINDOW_BITS		8
+#define LZ_MAX_WINDOW_BITS		10
+#define LZ_MIN_LENGTH_BITS		3
+
+typedef struct
+{
+	uint32_t bits;				// input bits not decoded yet
+	uint8_t bit_count;
+	uint8_t state;
+	uint8_t window_bits;
+	uint8_t length_bits;
+	uint16_t distance;			// back reference being copied
+	uint16_t count;
+	uint16_t head;				// next window position
+	uint8_t window[1 << LZ_MAX_WINDOW_BITS];
+} LzDecoder;
+
+// bytes read into buffer, 0 at the end of the file, < 0 on errors
+typedef int (*LzReadFunction)(uint8_t* buffer, unsigned int len);
+
+// compressed input of lz_read(), set left to 0 to restart it
+typedef struct
+{
+	uint8_t* buffer;
+	unsigned int size;
+	const uint8_t* next;
+	unsigned int left;			// input bytes not decoded yet
+	LzReadFunction read;
+} LzInput;
+
+unsigned char lz_header(const uint8_t* header, uint8_t* windowBits, uint8_t* lengthBits, uint32_t* size);
+void lz_init(LzDecoder* lz, uint8_t windowBits, uint8_t lengthBits);
+unsigned int lz_decode(LzDecoder* lz, const uint8_t** in, unsigned int* inLen, uint8_t* out, unsigned int outLen);
+int lz_read(LzDecoder* lz, LzInput* input, uint8_t* out, unsigned int outLen);
+
+#endif /* end of include guard: LZ_DECODE_H_9WFN2K5T */
@@ -18,13 +18,17 @@
 #include "gcode_parser.h"
 #include "sdcard.h"
 #include "LCD_4x20.h"
+#include "console.h"
+#include "telemetry.h"
+#include "usb_msd.h"
+#include "journal.h"
+#include "scheduler.h"
 //#include "heaters.h"
 
 
 //--------------------------
 // EXTERN FUNCTIONS
 //--------------------------
-extern void adc_sample();
 extern void samserial_init();
 
 extern void motor_setup();
@@ -35,14 +39,13 @@ extern void motor_step(unsigned char axis);
 extern void motor_unstep();
 
 extern void heaters_setup();
-extern void manage_heaters(void);
+extern void heater_tick(void);
+extern void heater_task(void);
 //extern void heater_soft_pwm(void);
 extern void ConfigureTc_1(void);
 
 
 //extern void sprinter_mainloop();
-extern void initadc(int);
-extern void samserial_setcallback(void (*c)(unsigned char));
 
 
 #ifndef AT91C_ID_TC0
@@ -64,9 +67,6 @@ void SysTick_Handler(void)
 	
 	timestamp++;
 	
-    if(timestamp%10==0)
-        adc_sample();
-    
     
     //temp control goes in here
     //temp0 = chan 5 = adc_read(5) etc (returns unsigned absolute millivolt value).
@@ -80,30 +80,32 @@ void SysTick_Handler(void)
     //  	printf("Channel %u : %u mV\n", i,adc_read(i));
     //	
 	
-	if(timestamp%250==0) //every 100 ms
-    {
-		manage_heaters();
-    }
+	// only flags the heater cycle, heater_task() runs it from the main loop
+	heater_tick();
 	    
 }
-unsigned long oldtimestamp=1;
-void do_periodic()
+
+//----------------------------------------------------------
+// Main loop tasks, see scheduler.h (M546 shows the statistics)
+//----------------------------------------------------------
+static SchedTask tasks[] =
 {
-	if (timestamp==oldtimestamp)
-		return;
-	oldtimestamp=timestamp;
-	if (timestamp % 500 == 0)
-	{
-		sdcard_handle_state();
-	}
-	
-}
+	// name			function				period ms	priority
+	{"heaters",		heater_task,			0,			0},		// flagged by SysTick every HEATER_CHECK_INTERVAL
+	{"gcode",		gcode_update,			0,			1},
+	{"replay",		sdcard_replay_update,	0,			2},		// SD read-ahead
+	{"journal",		journal_update,			0,			3},
+	{"msd",			msd_update,				0,			4},
+	{"sdcard",		sdcard_handle_state,	1,			5},		// card detect and mounting
+	{"telemetry",	telemetry_update,		1,			6},
+};
 
 
 int main()
 {
 	
     TRACE_CONFIGURE(DBGU_STANDARD, 115200, BOARD_MCK);
+    console_init();
     printf("-- %s\n\r", BOARD_NAME);
     printf("-- Compiled: %s %s --\n\r", __DATE__, __TIME__);
 
@@ -122,9 +124,9 @@ int main()
 	printf("USB Seriel INIT\n\r");
 	samserial_init();
 	
-	//-------- Init ADC without Autostart --------------
+	//-------- Init ADC, samples continuously from TC2 --------------
 	printf("Init ADC\n\r");
-    initadc(0);
+    initadc();
 	
 	//-------- Init Motor driver --------------
 	printf("Init Motors\n\r");
@@ -163,19 +165,18 @@ int main()
 	printf("LCD init\n\r");
 	lcd_init();
 	
-	//-------- Check for SD card presence -------
-//	sdcard_handle_state();
+	//-------- SD card detect, mounting runs from the main loop -------
+	sdcard_init();
 	
 	//motor_enaxis(0,1);
     //motor_enaxis(1,1);
+	sched_init(tasks,sizeof(tasks) / sizeof(tasks[0]));
 	while (1)
 	{
   		//uncomment to use//sprinter_mainloop();
     	//main loop events go here
 
-		do_periodic();
-
-		gcode_update();
+		sched_run();
 /*    	
 		if(buflen < (BUFSIZE-1))
 			get_command();
@@ -26,6 +26,7 @@
 #include "serial.h"
 #include "motoropts.h"
 #include "sdcard.h"
+#include "heaters.h"
 
 unsigned short calc_crc16(void);
 
@@ -261,8 +262,10 @@ void FLASH_PrintSettings(void)
 	usb_printf("Heater 1 PWM: \r\n  M531 E%d\r\n",pa.heater_pwm_en[0]);
 	usb_printf("Heater 2 PWM: \r\n  M531 E%d\r\n",pa.heater_pwm_en[1]);
 	
-	usb_printf("Heater 1 Max pwm (range 0-255): \r\n  M301 W%d\r\n",pa.heater_max_pwm[0]);
-	usb_printf("Heater 2 Max pwm (range 0-255): \r\n  M301 W%d\r\n",pa.heater_max_pwm[1]);
+	usb_printf("Heater 1 Max pwm (range 0-255), also the PID limit: \r\n  M301 W%d\r\n",pa.heater_max_pwm[0]);
+	usb_printf("Heater 2 Max pwm (range 0-255), also the PID limit: \r\n  M301 W%d\r\n",pa.heater_max_pwm[1]);
+	
+	usb_printf("Heater control (0=off,1=on/off,2=PID), not saved:\r\n  M532 T0 E%d\r\n  M532 T1 E%d\r\n  M532 B%d\r\n",heaters[0].control,heaters[1].control,heaters[HEATER_IDX_BED].control);
 	
 	usb_printf("Heater 1 (S)lope, (I)ntercept:\r\n  M301 S%d I%d\r\n",pa.heater_slope[0],pa.heater_intercept[0]);
 	usb_printf("Heater 2 (S)lope, (I)ntercept:\r\n  M301 S%d I%d\r\n",pa.heater_slope[1],pa.heater_intercept[1]);
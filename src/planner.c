@@ -59,14 +59,17 @@ extern volatile unsigned long timestamp;
 //===========================================================================
 //=================semi-private variables								 =====
 //===========================================================================
-#define BLOCK_BUFFER_SIZE 16
-#define BLOCK_BUFFER_MASK 0x0f
 block_t block_buffer[BLOCK_BUFFER_SIZE];            // A ring buffer for motion instructions
 volatile unsigned char block_buffer_head;           // Index of the next block to be pushed
 volatile unsigned char block_buffer_tail;           // Index of the block to process now
 
 // The current position of the tool in absolute steps
 long position[4];   
+
+// SD offset of the line that is parsed and the position before it,
+// stored in the blocks it creates
+unsigned long plan_file_pos = PLAN_NO_FILE_POS;
+float plan_line_start[NUM_AXIS];
 static float previous_speed[4]; // Speed of previous path line segment
 static float previous_nominal_speed; // Nominal speed of previous path line segment
 static unsigned char G92_reset_previous_speed = 0;
@@ -192,13 +195,13 @@ void prepare_arc_move(char isclockwise)
 
 void kill(char debug)
 {
-	heaters[0].target_temp = 0;
-	heaters[1].target_temp = 0;
-	heater_switch(1, 0);	//Heater 0
-	heater_switch(2, 0);	//Heater 1
+	unsigned char i;
 
-	bed_heater.target_temp = 0;
-	heater_switch(0, 0);	//BED
+	for(i = 0; i < NUM_HEATERS; i++)
+	{
+		heaters[i].target_temp = 0;
+		heater_switch(heaters[i].io_adr, 0);
+	}
 
 	disable_x();
 	disable_y();
@@ -224,6 +227,7 @@ void manage_inactivity(char debug)
 		disable_e1();
 	}
 	check_axes_activity();
+	heater_task();
 }
 
 //-----------------------------------------------------
@@ -714,6 +718,36 @@ void check_axes_activity()
 }
 
 
+//--------------------------------------------------
+// Filament feed of an extruder in mm/s, averaged over the
+// queued moves of the next horizon seconds (heater model)
+//--------------------------------------------------
+float plan_extrusion_rate(unsigned char extruder, float horizon)
+{
+	unsigned char block_index = block_buffer_tail;
+	unsigned char head = block_buffer_head;
+	float seconds = 0;
+	float e_mm = 0;
+	block_t *block;
+
+	while(block_index != head && seconds < horizon)
+	{
+		block = &block_buffer[block_index];
+		seconds += block->millimeters / block->nominal_speed;
+
+		// retracts don't take filament into the melt zone
+		if(block->active_extruder == extruder && !(block->direction_bits & (1<<E_AXIS)))
+			e_mm += block->steps_e / pa.axis_steps_per_unit[E_AXIS];
+
+		block_index = (block_index+1) & (BLOCK_BUFFER_SIZE - 1);
+	}
+
+	if(seconds > 0)
+		return e_mm / seconds;
+	return 0;
+}
+
+
 float junction_deviation = 0.1;
 float max_E_feedrate_calc = MAX_RETRACT_FEEDRATE;
 unsigned char retract_feedrate_aktiv = 0;
@@ -752,6 +786,9 @@ void plan_buffer_line(float x, float y, float z, float e, float feed_rate, unsig
 	block->busy = 0;
 
 	block->active_extruder = extruder;
+	block->file_pos = plan_file_pos;
+	memcpy(block->line_start,plan_line_start,sizeof(block->line_start));
+	block->feedrate = feedrate;
 
 	// Number of steps for each axis
 	block->steps_x = labs(target[X_AXIS]-position[X_AXIS]);
@@ -1090,12 +1127,92 @@ short calc_plannerpuffer_fill(void)
 	return(moves_queued);
 }
 
+// Number of blocks that can still be queued before plan_buffer_line() has to wait
+// (one slot always stays empty to tell a full ring from an empty one)
+short calc_plannerpuffer_free(void)
+{
+	return((BLOCK_BUFFER_SIZE - 1) - calc_plannerpuffer_fill());
+}
+
+//--------------------------------------------------
+// Pre-planned block from a block file (block_file.h), goes into
+// the buffer as it is. Returns 0 if the buffer is full.
+//--------------------------------------------------
+unsigned char plan_push_block(const BlockRecord* rec)
+{
+	unsigned char next_buffer_head = next_block_index(block_buffer_head);
+	block_t *block = &block_buffer[block_buffer_head];
+	unsigned char i;
+
+	if (block_buffer_tail == next_buffer_head)
+		return 0;
+
+	block->busy = 0;
+	block->steps_x = labs(rec->delta[X_AXIS]);
+	block->steps_y = labs(rec->delta[Y_AXIS]);
+	block->steps_z = labs(rec->delta[Z_AXIS]);
+	block->steps_e = rec->steps_e;
+	block->step_event_count = rec->step_event_count;
+	block->accelerate_until = rec->accelerate_until;
+	block->decelerate_after = rec->decelerate_after;
+	block->acceleration_rate = rec->acceleration_rate;
+	block->direction_bits = rec->direction_bits;
+	block->active_extruder = rec->active_extruder;
+	block->nominal_speed = rec->nominal_speed;
+	block->millimeters = rec->millimeters;
+	block->acceleration = rec->acceleration;
+
+	// Planned like a new block of plan_buffer_line(): the stepper may get
+	// it as the last one, so it has to end at MINIMUM_PLANNER_SPEED.
+	// planner_recalculate() raises the junction speeds again when the
+	// next blocks come. After the stepper ran dry it starts from rest.
+	if (block_buffer_head == block_buffer_tail)
+		block->max_entry_speed = MINIMUM_PLANNER_SPEED;
+	else
+		block->max_entry_speed = rec->max_entry_speed;
+	block->entry_speed = min(block->max_entry_speed,
+		max_allowable_speed(-block->acceleration,MINIMUM_PLANNER_SPEED,block->millimeters));
+	block->recalculate_flag = 1;
+	block->nominal_length_flag = rec->nominal_length_flag;
+	block->nominal_rate = rec->nominal_rate;
+	block->initial_rate = rec->initial_rate;
+	block->final_rate = rec->final_rate;
+	block->acceleration_st = rec->acceleration_st;
+	block->file_pos = PLAN_NO_FILE_POS;
+	memcpy(block->line_start,plan_line_start,sizeof(block->line_start));
+	block->feedrate = feedrate;
+
+	if(block->steps_x != 0) enable_x();
+	if(block->steps_y != 0) enable_y();
+	if(block->steps_z != 0) enable_z();
+	if(block->steps_e != 0) { enable_e(); enable_e1(); }
+
+	block_buffer_head = next_buffer_head;
+
+	// the parser continues from the end of the block
+	for(i = 0; i < NUM_AXIS; i++)
+	{
+		position[i] += rec->delta[i];
+		current_position[i] = position[i] / pa.axis_steps_per_unit[i];
+	}
+	previous_nominal_speed = 0.0;
+	previous_speed[0] = 0.0;
+	previous_speed[1] = 0.0;
+	previous_speed[2] = 0.0;
+	previous_speed[3] = 0.0;
+
+	planner_recalculate();
+	st_wake_up();
+	return 1;
+}
+
 void plan_set_position(float x, float y, float z, float e)
 {
 	position[X_AXIS] = lround(x*pa.axis_steps_per_unit[X_AXIS]);
 	position[Y_AXIS] = lround(y*pa.axis_steps_per_unit[Y_AXIS]);
 	position[Z_AXIS] = lround(z*pa.axis_steps_per_unit[Z_AXIS]);     
 	position[E_AXIS] = lround(e*pa.axis_steps_per_unit[E_AXIS]);  
+	st_set_position(position[X_AXIS], position[Y_AXIS], position[Z_AXIS], position[E_AXIS]);
 
 	virtual_steps_x = 0;
 	virtual_steps_y = 0;
@@ -16,6 +16,7 @@
  along with this program.  If not, see <http://www.gnu.org/licenses/>. 
  */
 
+#include "block_file.h"
 
 #define X_AXIS  0
 #define Y_AXIS  1
@@ -77,8 +78,18 @@ typedef struct {
   long final_rate;                          // The minimal rate at exit
   long acceleration_st;                              // acceleration steps/sec^2
   volatile char busy;
+
+  // Source of the block for the power loss journal
+  unsigned long file_pos;                            // SD offset of the G-code line, PLAN_NO_FILE_POS if not from the SD card
+  float line_start[4];                               // logical X Y Z E in mm before that line (E without extrudemultiply)
+  signed short feedrate;                             // feedrate of that line in mm/min (without feedmultiply)
 } block_t;
 
+#define PLAN_NO_FILE_POS 0xFFFFFFFF
+
+#define BLOCK_BUFFER_SIZE 16
+#define BLOCK_BUFFER_MASK 0x0f
+
 
 
 void manage_inactivity(char debug);
@@ -101,12 +112,16 @@ void st_init();
 void tp_init();
 void plan_buffer_line(float x, float y, float z, float e, float feed_rate, unsigned char extruder);
 void plan_set_position(float x, float y, float z, float e);
+unsigned char plan_push_block(const BlockRecord* rec);
 void st_wake_up();
 void st_synchronize();
 void st_set_position(long x, long y, long z, long e);
 void st_synchronize();
 void plan_discard_current_block();
 block_t *plan_get_current_block();
+float plan_extrusion_rate(unsigned char extruder, float horizon);
+short calc_plannerpuffer_fill(void);
+short calc_plannerpuffer_free(void);
 
 
 extern char axis_relative_modes[];
@@ -127,6 +142,8 @@ extern unsigned short virtual_steps_z;
 
 extern signed short feedrate;
 extern signed short next_feedrate;
+extern unsigned long plan_file_pos;
+extern float plan_line_start[4];
 extern signed short saved_feedrate;
 
 extern unsigned char is_homing;
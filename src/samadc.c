@@ -43,8 +43,11 @@
 #include <pio/pio.h>
 #include <irq/irq.h>
 #include <adc/adc12.h>
+#include <tc/tc.h>
 #include <stdio.h>
 
+#include "samadc.h"
+
 //------------------------------------------------------------------------------
 //         Local definitions
 //------------------------------------------------------------------------------
@@ -52,6 +55,19 @@
 #define BOARD_ADC_FREQ 6000000
 #define ADC_VREF       3300  // 3.3 * 1000
 
+// a sequence over all enabled channels every 1/ADC_SAMPLE_RATE s,
+// started by TIOA2 and written to RAM by the PDC
+#define ADC_SAMPLE_RATE	1000
+#define ADC_CHANNELS	4
+#define ADC_DMA_SIZE	(ADC_CHANNELS * ADC_OVERSAMPLING)
+
+// mV = sum * ADC_VREF / ADC_RAW_MAX as multiply and shift (sum * scale fits 32 bit)
+#define ADC_MV_SHIFT	20
+#define ADC_MV_SCALE	((((unsigned long long)ADC_VREF << ADC_MV_SHIFT) + ADC_RAW_MAX/2) / ADC_RAW_MAX)
+
+// the ADC12B PDC isn't in AT91SAM3U4.h, it's at the usual offset 0x100
+#define ADC_PDC			((AT91PS_PDC)((unsigned int)AT91C_BASE_ADC12B + 0x100))
+
 
 //------------------------------------------------------------------------------
 //         Local variables
@@ -85,14 +101,26 @@ static const Pin pinsADC[] = {PINS_ADC};
 #endif
 // 5, 3, 1, 2
 volatile unsigned int advalue[7];
-static unsigned int chns[] = {ADC_NUM_1, ADC_NUM_2, ADC_NUM_3, ADC_NUM_4, ADC_NUM_5, ADC_NUM_6, ADC_NUM_7};
-static volatile int enchan=(1<<ADC_NUM_3)|(1<<ADC_NUM_5)|(1<<ADC_NUM_1)|(1<<ADC_NUM_2);//|(1<<ADC_NUM_4);//|(1<<ADC_NUM_6)|(1<<ADC_NUM_7);
+volatile unsigned int adraw[7];
+// enabled channels in conversion order (ascending), ADC_CHANNELS of them
+static const unsigned char chns[ADC_CHANNELS] = {ADC_NUM_1, ADC_NUM_2, ADC_NUM_3, ADC_NUM_5};
+
+// two sample buffers, the PDC fills one while the other is summed up
+static unsigned short adcDma[2][ADC_DMA_SIZE] __attribute__((aligned(4)));
+static unsigned char adcDmaDone = 0;	// buffer the PDC finishes next
+
 unsigned int adc_read(unsigned char channel){
 	if(channel>7) return 0;	
 	if(channel==0) return 0;
 	return advalue[channel-1];
 }
 
+unsigned int adc_read_raw(unsigned char channel){
+	if(channel>7) return 0;	
+	if(channel==0) return 0;
+	return adraw[channel-1];
+}
+
 void adc_en(unsigned char channel){
 	if(channel>7) return;	
 	if(channel==0) return;	
@@ -103,53 +131,79 @@ void adc_en(unsigned char channel){
 //         Local functions
 //------------------------------------------------------------------------------
 
-
-
-//-----------------------------------------------------------------------------
-/// Convert a digital value in milivolt
-/// \param valueToconvert Value to convert in milivolt
-//-----------------------------------------------------------------------------
-static unsigned int ConvHex2mV( unsigned int valueToConvert )
+static void adc_pdc_start()
 {
-    unsigned int mask;
-
-    mask = 0xFFF;
-    
-    return( (ADC_VREF * valueToConvert)/mask);
+	ADC_PDC->PDC_PTCR = AT91C_PDC_RXTDIS;
+	ADC_PDC->PDC_RPR = (unsigned int)adcDma[0];
+	ADC_PDC->PDC_RCR = ADC_DMA_SIZE;
+	ADC_PDC->PDC_RNPR = (unsigned int)adcDma[1];
+	ADC_PDC->PDC_RNCR = ADC_DMA_SIZE;
+	adcDmaDone = 0;
+	ADC_PDC->PDC_PTCR = AT91C_PDC_RXTEN;
 }
 
 
 //------------------------------------------------------------------------------
-/// Interrupt handler for the ADC. Signals that the conversion is finished by
-/// setting a flag variable.
+/// Interrupt handler for the ADC, once per ADC_OVERSAMPLING sequences when
+/// the PDC has filled a buffer: sums up the samples of each channel and hands
+/// the buffer back to the PDC as the next one.
 //------------------------------------------------------------------------------
-volatile int conversionDone=0;
-unsigned volatile int status, i;
-volatile int autosample=0;
-
-void adc_sample(){
-    if(conversionDone == enchan){
-	    conversionDone=0;
-	    ADC12_StartConversion(AT91C_BASE_ADC);
+void ADCC0_IrqHandler(void)
+{
+	unsigned int status = ADC12_GetStatus(AT91C_BASE_ADC);
+	unsigned int sum[ADC_CHANNELS];
+	const unsigned short* sample;
+	unsigned int i, j;
+
+	// a lost sample shifts the channels in the buffer: stop the PDC for the
+	// rest of this sequence, TC2_IrqHandler() re-arms it between sequences
+	if (status & AT91C_ADC12B_SR_GOVRE)
+	{
+		ADC_PDC->PDC_PTCR = AT91C_PDC_RXTDIS;
+		AT91C_BASE_TC2->TC_IER = AT91C_TC_CPAS;
+		return;
 	}
-}
+	if (!(status & AT91C_ADC12B_SR_ENDRX))
+		return;
 
+	for(j=0;j<ADC_CHANNELS;j++)
+		sum[j] = 0;
+	sample = adcDma[adcDmaDone];
+	for(i=0;i<ADC_OVERSAMPLING;i++)
+		for(j=0;j<ADC_CHANNELS;j++)
+			sum[j] += *sample++ & AT91C_ADC12B_LCDR_LDATA;
 
+	for(j=0;j<ADC_CHANNELS;j++)
+	{
+		adraw[chns[j]-1] = sum[j];
+		advalue[chns[j]-1] = (sum[j] * ADC_MV_SCALE + (1 << (ADC_MV_SHIFT-1))) >> ADC_MV_SHIFT;
+	}
 
-void ADCC0_IrqHandler(void)
+	// writing RNCR clears ENDRX
+	ADC_PDC->PDC_RNPR = (unsigned int)adcDma[adcDmaDone];
+	ADC_PDC->PDC_RNCR = ADC_DMA_SIZE;
+	adcDmaDone ^= 1;
+}
+
+
+//------------------------------------------------------------------------------
+/// Interrupt handler for TC2, only enabled after an overrun: at RA the
+/// sequence started by the rising edge of TIOA2 is long over, drains the
+/// data registers and restarts the PDC aligned to the next sequence.
+//------------------------------------------------------------------------------
+void TC2_IrqHandler(void)
 {
-    status = ADC12_GetStatus(AT91C_BASE_ADC);
-    
-    for(i=0;i<7;i++) {
-
-      if ((enchan&(1<<chns[i]) )&&ADC12_IsChannelInterruptStatusSet(status, chns[i])) {
-            advalue[i] = ConvHex2mV(ADC12_GetConvertedData(AT91C_BASE_ADC, chns[i]));
-            conversionDone |= 1<<chns[i];
-        }
-    }
-
-	if(autosample)
-        adc_sample();
+	unsigned int j;
+
+	if (!(AT91C_BASE_TC2->TC_SR & AT91C_TC_CPAS))
+		return;
+	AT91C_BASE_TC2->TC_IDR = AT91C_TC_CPAS;
+
+	(void)ADC12_GetLastConvertedData(AT91C_BASE_ADC);
+	for(j=0;j<ADC_CHANNELS;j++)
+		(void)AT91C_BASE_ADC->ADC12B_CDR[chns[j]];
+	(void)ADC12_GetStatus(AT91C_BASE_ADC);
+	adc_pdc_start();
 }
 
 
@@ -158,63 +212,48 @@ void ADCC0_IrqHandler(void)
 //------------------------------------------------------------------------------
 
 //------------------------------------------------------------------------------
-/// Performs measurements on ADC channel 0 and displays the result on the DBGU.
+/// Sets up the ADC for continuous sampling: TC2 triggers a sequence over
+/// the temperature channels every 1/ADC_SAMPLE_RATE s, the PDC stores the
+/// samples, ADCC0_IrqHandler() decimates ADC_OVERSAMPLING of them.
 //------------------------------------------------------------------------------
-void initadc(int autos)
+void initadc()
 {
-   // printf("-- Basic ADC Project %s --\n\r", SOFTPACK_VERSION);
-  //  printf("-- %s\n\r", BOARD_NAME);
-  //  printf("-- Compiled: %s %s --\n\r", __DATE__, __TIME__);
-  if(autos)
-    autosample=1;
+	unsigned int j;
+
 #ifdef PINS_ADC
     PIO_Configure(pinsADC, PIO_LISTSIZE(pinsADC));
 #endif
 
     ADC12_Initialize( AT91C_BASE_ADC,
                     AT91C_ID_ADC,
-                    AT91C_ADC_TRGEN_DIS,
-                    0,
+                    AT91C_ADC_TRGEN_EN,
+                    AT91C_ADC_TRGSEL_TIOA2,
                     AT91C_ADC_SLEEP_NORMAL_MODE,
                     AT91C_ADC_LOWRES_12_BIT,
                     BOARD_MCK,
                     BOARD_ADC_FREQ,
                     10,
                     1200);
-	
-	//int i;
-
-/*	for(i=0;i<7;i++)
-		if ((1<<chns[i]) & enchan)
-	        	    ADC12_EnableChannel(AT91C_BASE_ADC, chns[i]);
-*/
-	ADC12_EnableChannel(AT91C_BASE_ADC, ADC_NUM_1);
-	ADC12_EnableChannel(AT91C_BASE_ADC, ADC_NUM_2);
-	ADC12_EnableChannel(AT91C_BASE_ADC, ADC_NUM_3);
-//	ADC12_EnableChannel(AT91C_BASE_ADC, ADC_NUM_4);
-    ADC12_EnableChannel(AT91C_BASE_ADC, ADC_NUM_5);
-//	ADC12_EnableChannel(AT91C_BASE_ADC, ADC_NUM_6);
-//	ADC12_EnableChannel(AT91C_BASE_ADC, ADC_NUM_7);
-	
+
+	for(j=0;j<ADC_CHANNELS;j++)
+		ADC12_EnableChannel(AT91C_BASE_ADC, chns[j]);
+
+	adc_pdc_start();
+
 	IRQ_ConfigureIT(AT91C_ID_ADC, 0, ADCC0_IrqHandler);
 	IRQ_EnableIT(AT91C_ID_ADC);
-	
-	ADC12_EnableIt(AT91C_BASE_ADC, 1<<ADC_NUM_1);
-	ADC12_EnableIt(AT91C_BASE_ADC, 1<<ADC_NUM_2);
-	ADC12_EnableIt(AT91C_BASE_ADC, 1<<ADC_NUM_3);
-//	ADC12_EnableIt(AT91C_BASE_ADC, 1<<ADC_NUM_4);
-    ADC12_EnableIt(AT91C_BASE_ADC, 1<<ADC_NUM_5);
-//	ADC12_EnableIt(AT91C_BASE_ADC, 1<<ADC_NUM_6);
-//	ADC12_EnableIt(AT91C_BASE_ADC, 1<<ADC_NUM_7);
-	
-/*
-	for(i=0;i<7;i++)
-		if ((1<<chns[i]) & enchan)
-	        	ADC12_EnableIt(AT91C_BASE_ADC, 1<<chns[i]);
-*/
-	    conversionDone=0;
-	    ADC12_StartConversion(AT91C_BASE_ADC);
-	//printf("adc init done\n");
-	    
+	ADC12_EnableIt(AT91C_BASE_ADC, AT91C_ADC12B_IER_ENDRX | AT91C_ADC12B_IER_GOVRE);
+
+	// TC2 waveform mode, TIOA2 set on RC and cleared on RA,
+	// the rising edge starts a conversion sequence
+	AT91C_BASE_PMC->PMC_PCER = 1 << AT91C_ID_TC2;
+	TC_Configure(AT91C_BASE_TC2, AT91C_TC_CLKS_TIMER_DIV4_CLOCK | AT91C_TC_WAVE
+		| AT91C_TC_WAVESEL_UP_AUTO | AT91C_TC_ACPA_CLEAR | AT91C_TC_ACPC_SET);
+	AT91C_BASE_TC2->TC_RC = (BOARD_MCK / 128) / ADC_SAMPLE_RATE;
+	AT91C_BASE_TC2->TC_RA = AT91C_BASE_TC2->TC_RC / 2;
+	AT91C_BASE_TC2->TC_IDR = 0xFFFFFFFF;
+	IRQ_ConfigureIT(AT91C_ID_TC2, 0, TC2_IrqHandler);
+	IRQ_EnableIT(AT91C_ID_TC2);
+	TC_Start(AT91C_BASE_TC2);
 }
 
@@ -1,3 +1,9 @@
+// samples summed up per reading (power of two, up to 16 for adc_read())
+#define ADC_OVERSAMPLING	16
+// full scale of adc_read_raw(): ADC_OVERSAMPLING 12 bit samples
+#define ADC_RAW_MAX			(0xFFF * ADC_OVERSAMPLING)
+
 unsigned int adc_read(unsigned char channel);
+unsigned int adc_read_raw(unsigned char channel);
 void initadc();
 void adc_en(unsigned char channel);
@@ -0,0 +1,143 @@
+/*
+ Main loop scheduler
+ See scheduler.h.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <board.h>
+#include <stdio.h>
+
+#include "scheduler.h"
+#include "serial.h"
+#include "globals.h"
+
+static SchedTask* schedTasks;
+static unsigned char schedCount = 0;
+static unsigned long schedStatsStart;		// timestamp of the last reset
+
+
+//--------------------------------------------------
+// Microseconds from timestamp and the SysTick counter
+// (counts down from the reload value every ms), wraps
+// after 71 minutes, differences stay right
+//--------------------------------------------------
+unsigned long sched_time_us(void)
+{
+	unsigned long ms, cvr;
+
+	do
+	{
+		ms = timestamp;
+		cvr = AT91C_BASE_NVIC->NVIC_STICKCVR;
+	} while (ms != timestamp);
+
+	return ms * 1000 + (AT91C_BASE_NVIC->NVIC_STICKRVR - cvr) / (BOARD_MCK / 1000000);
+}
+
+//--------------------------------------------------
+// Takes the task table (static, in main.c) and sorts
+// it by priority, the periodic tasks start now
+//--------------------------------------------------
+void sched_init(SchedTask* tasks, unsigned char count)
+{
+	SchedTask task;
+	unsigned char i, j;
+
+	for(i = 1;i < count;i++)
+	{
+		task = tasks[i];
+		for(j = i;j > 0 && tasks[j-1].priority > task.priority;j--)
+			tasks[j] = tasks[j-1];
+		tasks[j] = task;
+	}
+	for(i = 0;i < count;i++)
+		tasks[i].deadline = timestamp + tasks[i].period;
+
+	schedTasks = tasks;
+	schedCount = count;
+	sched_print_stats(1);
+}
+
+//--------------------------------------------------
+// One pass of the main loop
+//--------------------------------------------------
+void sched_run(void)
+{
+	SchedTask* task;
+	unsigned long now, start, elapsed, late;
+	unsigned char i;
+
+	for(i = 0;i < schedCount;i++)
+	{
+		task = &schedTasks[i];
+		now = timestamp;
+
+		if (task->period)
+		{
+			if ((long)(now - task->deadline) < 0)
+				continue;
+			late = now - task->deadline;
+			if (late > task->late_max)
+				task->late_max = late;
+			if (late >= task->period)
+			{
+				task->skipped += late / task->period;
+				task->deadline = now + task->period;
+			}
+			else
+				task->deadline += task->period;
+		}
+
+		start = sched_time_us();
+		task->run();
+		elapsed = sched_time_us() - start;
+
+		task->runs++;
+		task->total_us += elapsed;
+		if (elapsed > task->max_us)
+			task->max_us = elapsed;
+	}
+}
+
+//--------------------------------------------------
+// M546: runs, CPU share and worst cases per task
+//--------------------------------------------------
+void sched_print_stats(unsigned char reset)
+{
+	unsigned long long total = (unsigned long long)(timestamp - schedStatsStart) * 1000;
+	SchedTask* task;
+	unsigned char i;
+
+	if (!reset)
+	{
+		usb_printf("task       period  runs  cpu%%  avg us  max us  late ms  skipped\r\n");
+		for(i = 0;i < schedCount;i++)
+		{
+			task = &schedTasks[i];
+			usb_printf("%-10s %6u %5lu %5u %7lu %7lu %8lu %8lu\r\n",task->name,task->period,task->runs,
+				total ? (unsigned int)(task->total_us * 100 / total) : 0,
+				task->runs ? (unsigned long)(task->total_us / task->runs) : 0,
+				task->max_us,task->late_max,task->skipped);
+		}
+		return;
+	}
+
+	for(i = 0;i < schedCount;i++)
+	{
+		task = &schedTasks[i];
+		task->runs = task->skipped = task->late_max = task->max_us = 0;
+		task->total_us = 0;
+	}
+	schedStatsStart = timestamp;
+}
@@ -0,0 +1,49 @@
+/*
+ Main loop scheduler
+ Cooperative tasks with periods and priorities, driven from main(),
+ with runtime statistics per task (M546).
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef SCHEDULER_H_V2KX9C4E
+#define SCHEDULER_H_V2KX9C4E
+
+// Every pass of sched_run() runs the due tasks in priority order. A task
+// with a period is due at its deadline, the next deadline is one period
+// later (no drift from late runs). When the loop was busy for more than a
+// period, the lost runs are counted and the task starts over from now.
+// Tasks without a period run on every pass and decide themselves if
+// there is work (buffers, flags from interrupts).
+typedef struct
+{
+	const char* name;
+	void (*run)(void);
+	unsigned short period;			// ms between runs, 0 = every pass
+	unsigned char priority;			// 0 runs first
+
+	// kept by the scheduler
+	unsigned long deadline;			// timestamp of the next run
+	unsigned long runs;
+	unsigned long skipped;			// periods lost while the loop was busy
+	unsigned long late_max;			// ms behind the deadline, worst run
+	unsigned long max_us;			// longest run
+	unsigned long long total_us;
+} SchedTask;
+
+void sched_init(SchedTask* tasks, unsigned char count);
+void sched_run(void);
+void sched_print_stats(unsigned char reset);
+unsigned long sched_time_us(void);
+
+#endif /* end of include guard: SCHEDULER_H_V2KX9C4E */
@@ -1,11 +1,23 @@
 
 #include <board.h>
+#include <pio/pio.h>
+#include <pio/pio_it.h>
 #include <memories/MEDSdcard.h>
 #include <fatfs/src/ff.h>
+#include <fatfs/src/diskio.h>
 #include <stdio.h>
 #include <string.h>
 #include "sdcard.h"
 #include "serial.h"
+#include "usb_msd.h"
+#include "sdcard_index.h"
+#include "sdcard_format.h"
+#include "lz_decode.h"
+#include "block_file.h"
+#include "parameters.h"
+#include "globals.h"
+#include "gcode_parser.h"
+#include "heaters.h"
 
 #define MAX_LUNS            1
 #define DRV_DISK            0
@@ -15,7 +27,30 @@ Media medias[MAX_LUNS];
 static unsigned char is_mounted = 0;
 static FATFS fs;
 
-static unsigned char had_card = 0;
+// Mounting runs as a state machine from the main loop, one step per pass,
+// so card identification and formatting don't stall the parser in one go
+enum MountState {
+	MOUNT_NO_CARD,
+	MOUNT_SETTLE,		// card inserted, wait for the contacts to settle
+	MOUNT_INIT,			// card identification
+	MOUNT_CHECK_FS,
+	MOUNT_FORMAT,
+	MOUNT_FORMATTING,	// FAT and root directory cleared a buffer at a time
+	MOUNT_READY,
+	MOUNT_IDLE,			// card present but not mounted (failed or released)
+};
+
+#define CARD_SETTLE_MS		250
+#define FORMAT_STEP_MS		2	// time spent formatting per main loop pass
+
+static unsigned char mount_state = MOUNT_NO_CARD;
+static unsigned long mount_timer;
+static volatile unsigned char card_changed = 1;
+static unsigned char format_percent;
+
+#if defined(BOARD_SD_PIN_CD)
+static const Pin pinCardDetect = BOARD_SD_PIN_CD;
+#endif
 
 static unsigned char capture_mode = 0;
 static char selectedfileBuffer[_MAX_LFN];
@@ -25,28 +60,76 @@ static FIL replayFile;
 static int fileSeekpos = 0;
 static unsigned char replay_mode = 0;
 static unsigned char replay_pause = 0;
+static unsigned char usb_exported = 0;
+static unsigned char usb_release = 0;	// give the card back once the host is idle
+
+// captured lines are collected here and written in whole sectors
+#define CAPTURE_BUFFER_SIZE	1024
+
+static char captureBuffer[CAPTURE_BUFFER_SIZE] __attribute__((aligned(4)));
+static unsigned int captureLen = 0;
+
+#define REPLAY_BUFFER_SIZE	4096
+
+static unsigned char replayBuffer[2][REPLAY_BUFFER_SIZE] __attribute__((aligned(4)));
+static unsigned int replayLength[2];	// valid bytes, 0 = empty
+static unsigned char replayActive;		// buffer the parser reads from
+static unsigned int replayReadPos;
+static unsigned int replayPos;			// file position of the next byte for the parser
+static unsigned char replayEof;
+static unsigned int replaySkipLines;	// lines to drop after a seek by line number (M26 L)
+static unsigned char indexScan = 0;		// M544 index build, reads with replayFile
+static uint32_t replayDataSize;			// G-code bytes in the file (uncompressed)
+
+// compressed files are decoded into the read-ahead buffers, file
+// positions (M26, M27, index, journal) count uncompressed bytes
+#define REPLAY_LZ_INPUT_SIZE	512
 
+static unsigned char replayCompressed = 0;
+static LzDecoder replayLz;
+static uint8_t replayLzBuffer[REPLAY_LZ_INPUT_SIZE] __attribute__((aligned(4)));
+static int replay_lz_read(uint8_t* buffer, unsigned int len);
+static LzInput replayLzInput = {replayLzBuffer,REPLAY_LZ_INPUT_SIZE,replayLzBuffer,0,replay_lz_read};
+static FRESULT replayLzError;
+static uint32_t replayDecoded;
+static uint32_t replaySkipBytes;		// decoded bytes to drop after a seek
+static unsigned char replayBlockFile = 0;	// pre-planned blocks from blockc
+static uint32_t replayBlockSteps[4];		// steps per unit the blocks were planned for
+
+// cluster link map for fast seeks (_USE_FASTSEEK), enough for a few fragments
+#define REPLAY_LINKMAP_SIZE	32
+static DWORD replayLinkMap[REPLAY_LINKMAP_SIZE];
+
+// in the order of FRESULT in ff.h
 #define _ERR(x) #x
 static const char* errorStrings[] = {
-	_ERR(FR_OK),			/* 0 */
-	_ERR(FR_NOT_READY),		/* 1 */
-	_ERR(FR_NO_FILE),			/* 2 */
-	_ERR(FR_NO_PATH),			/* 3 */
-	_ERR(FR_INVALID_NAME),	/* 4 */
-	_ERR(FR_INVALID_DRIVE),	/* 5 */
-	_ERR(FR_DENIED),			/* 6 */
-	_ERR(FR_EXIST),			/* 7 */
-	_ERR(FR_RW_ERROR),		/* 8 */
-	_ERR(FR_WRITE_PROTECTED),	/* 9 */
-	_ERR(FR_NOT_ENABLED),		/* 10 */
-	_ERR(FR_NO_FILESYSTEM),	/* 11 */
-	_ERR(FR_INVALID_OBJECT),	/* 12 */
-	_ERR(FR_MKFS_ABORTED)		/* 13 */
+	_ERR(FR_OK),					/* 0 */
+	_ERR(FR_DISK_ERR),				/* 1 */
+	_ERR(FR_INT_ERR),				/* 2 */
+	_ERR(FR_NOT_READY),				/* 3 */
+	_ERR(FR_NO_FILE),				/* 4 */
+	_ERR(FR_NO_PATH),				/* 5 */
+	_ERR(FR_INVALID_NAME),			/* 6 */
+	_ERR(FR_DENIED),				/* 7 */
+	_ERR(FR_EXIST),					/* 8 */
+	_ERR(FR_INVALID_OBJECT),		/* 9 */
+	_ERR(FR_WRITE_PROTECTED),		/* 10 */
+	_ERR(FR_INVALID_DRIVE),			/* 11 */
+	_ERR(FR_NOT_ENABLED),			/* 12 */
+	_ERR(FR_NO_FILESYSTEM),			/* 13 */
+	_ERR(FR_MKFS_ABORTED),			/* 14 */
+	_ERR(FR_TIMEOUT),				/* 15 */
+	_ERR(FR_LOCKED),				/* 16 */
+	_ERR(FR_NOT_ENOUGH_CORE),		/* 17 */
+	_ERR(FR_TOO_MANY_OPEN_FILES),	/* 18 */
+	_ERR(FR_INVALID_PARAMETER)		/* 19 */
 };
 #undef _ERR
 
 static const char* getError(FRESULT r)
 {
+	if ((unsigned)r >= sizeof(errorStrings) / sizeof(errorStrings[0]))
+		return "FR_UNKNOWN";
 	return errorStrings[r];
 }
 
@@ -68,45 +151,312 @@ void sdcard_selectfile(const char* name)
 	usb_printf("file selected: %s\n\r",selectedFile);
 }
 
+const char* sdcard_selectedfile()
+{
+	return selectedFile ? selectedFile : "";
+}
+
 unsigned char sdcard_iscapturing()
 {
 	return capture_mode;
 }
 
-int sdcard_getchar(unsigned char* chr)
+//--------------------------------------------------
+// Replay read-ahead: two buffers, the parser consumes one while
+// sdcard_replay_update() refills the other from the main loop.
+// Every f_read covers a whole buffer, so the card latency is
+// paid once per REPLAY_BUFFER_SIZE bytes and never while a
+// line is being parsed.
+//--------------------------------------------------
+static void replay_flush()
+{
+	replayLength[0] = replayLength[1] = 0;
+	replayActive = 0;
+	replayReadPos = 0;
+	replayEof = 0;
+}
+
+static void replay_close()
 {
+	f_close(&replayFile);
+	replay_flush();
+	replaySkipLines = 0;
+	replayBlockFile = 0;
+	replay_mode = 0;
+	replay_pause = 0;
+}
+
+static void replay_restart_lz()
+{
+	f_lseek(&replayFile,LZ_HEADER_SIZE);
+	lz_init(&replayLz,replayLz.window_bits,replayLz.length_bits);
+	replayLzInput.left = 0;
+	replayDecoded = 0;
+}
+
+//--------------------------------------------------
+// Open the selected file for replay or the index scan,
+// compressed files (lz_compress.py) and block files (blockc)
+// are detected by their header
+//--------------------------------------------------
+static FRESULT replay_open()
+{
+	BlockFileHeader header;
+	uint8_t windowBits, lengthBits;
 	FRESULT res;
 	UINT read;
+	int i;
 
-	if (!replay_mode && !replay_pause)
-		return 0;
-	
-	res = f_read(&replayFile,&chr,1,&read);
-	
+	res = f_open(&replayFile,selectedFile,FA_OPEN_EXISTING|FA_READ);
+	if (res != FR_OK)
+		return res;
+
+	replayDataSize = f_size(&replayFile);
+	if (f_read(&replayFile,&header,sizeof(header),&read) != FR_OK)
+		read = 0;
+	replayCompressed = read >= LZ_HEADER_SIZE
+		&& lz_header((const uint8_t*)&header,&windowBits,&lengthBits,&replayDataSize);
+	replayBlockFile = read == sizeof(header) && memcmp(header.magic,BLOCKFILE_MAGIC,4) == 0
+		&& header.version == BLOCKFILE_VERSION;
+	replaySkipBytes = 0;
+	if (replayCompressed)
+	{
+		printf("sdcard: compressed file, %u bytes of G-code\n\r",(unsigned int)replayDataSize);
+		replayLz.window_bits = windowBits;
+		replayLz.length_bits = lengthBits;
+		replay_restart_lz();
+	}
+	else if (replayBlockFile)
+	{
+		printf("sdcard: block file, %u blocks, %u lines\n\r",(unsigned int)header.blocks,(unsigned int)header.lines);
+		// compared as integers, the blocks only fit the exact values
+		for(i = 0;i < 4;i++)
+			replayBlockSteps[i] = header.steps_per_unit[i] * 1000.0f + 0.5f;
+	}
+	else
+		f_lseek(&replayFile,0);
+	return FR_OK;
+}
+
+//--------------------------------------------------
+// Block files are planned for one set of steps per unit
+//--------------------------------------------------
+static unsigned char replay_blockfile_matches()
+{
+	int i;
+
+	for(i = 0;i < 4;i++)
+		if (replayBlockSteps[i] != (uint32_t)(pa.axis_steps_per_unit[i] * 1000.0f + 0.5f))
+			return 0;
+	return 1;
+}
+
+// compressed input for lz_read()
+static int replay_lz_read(uint8_t* buffer, unsigned int len)
+{
+	UINT read;
+
+	replayLzError = f_read(&replayFile,buffer,len,&read);
+	return replayLzError == FR_OK ? (int)read : -1;
+}
+
+//--------------------------------------------------
+// f_read() for both kinds of files, less than len
+// bytes only at the end of the file or on errors
+//--------------------------------------------------
+static FRESULT replay_read(unsigned char* data, unsigned int len, UINT* read)
+{
+	int decoded;
+
+	if (!replayCompressed)
+		return f_read(&replayFile,data,len,read);
+
+	if (len > replayDataSize - replayDecoded)
+		len = replayDataSize - replayDecoded;
+	decoded = lz_read(&replayLz,&replayLzInput,data,len);
+	if (decoded < 0)
+	{
+		*read = 0;
+		return replayLzError;
+	}
+	*read = decoded;
+	replayDecoded += decoded;
+	return FR_OK;
+}
+
+static void replay_seek(unsigned int filepos)
+{
+	if (replay_mode)
+	{
+		// no random access into a compressed stream, decode
+		// it again from the start and drop what's before filepos
+		if (replayCompressed)
+		{
+			replay_restart_lz();
+			replaySkipBytes = filepos;
+		}
+		else
+			f_lseek(&replayFile,filepos);
+		replay_flush();
+		replayPos = filepos;
+	}
+	else
+		fileSeekpos = filepos;
+}
+
+static void replay_fill(unsigned char buffer)
+{
+	FRESULT res;
+	UINT read;
+	unsigned int skip;
+
+	res = replay_read(replayBuffer[buffer],REPLAY_BUFFER_SIZE,&read);
 	if (res != FR_OK)
 	{
-		printf("sdcard_getchar: error %s\n\r",getError(res));
+		printf("sdcard_replay: error %s\n\r",getError(res));
+		read = 0;
+	}
+	if (read < REPLAY_BUFFER_SIZE)
+		replayEof = 1;
+
+	// one buffer per call while skipping, the main loop keeps running
+	if (replaySkipBytes)
+	{
+		skip = read < replaySkipBytes ? read : replaySkipBytes;
+		replaySkipBytes -= skip;
+		read -= skip;
+		memmove(replayBuffer[buffer],replayBuffer[buffer] + skip,read);
+	}
+	replayLength[buffer] = read;
+
+	// first replay of the file from the start builds its index
+	if (sdindex_active())
+	{
+		sdindex_feed(replayBuffer[buffer],read);
+		if (replayEof)
+			sdindex_finish();
+	}
+}
+
+//--------------------------------------------------
+// Contiguous replay data ready for the parser,
+// returns 0 while paused or if the read-ahead is behind
+//--------------------------------------------------
+unsigned int sdcard_replay_available(const unsigned char** data)
+{
+	if (!replay_mode || replay_pause)
+		return 0;
+
+	for(;;)
+	{
+		if (replayReadPos >= replayLength[replayActive] && replayLength[replayActive ^ 1])
+		{
+			replayLength[replayActive] = 0;
+			replayActive ^= 1;
+			replayReadPos = 0;
+		}
+		// drop the lines between the indexed line and the one asked for
+		if (!replaySkipLines || replayReadPos >= replayLength[replayActive])
+			break;
+		if (replayBuffer[replayActive][replayReadPos] == '\n')
+			replaySkipLines--;
+		sdcard_replay_consume(1);
+	}
+	if (replaySkipLines)
 		return 0;
+
+	*data = &replayBuffer[replayActive][replayReadPos];
+	return replayLength[replayActive] - replayReadPos;
+}
+
+void sdcard_replay_consume(unsigned int len)
+{
+	replayReadPos += len;
+	replayPos += len;
+}
+
+//--------------------------------------------------
+// Main loop: refill empty read-ahead buffers, end the
+// replay when everything is parsed
+//--------------------------------------------------
+void sdcard_replay_update()
+{
+	unsigned char other = replayActive ^ 1;
+	FRESULT res;
+	UINT read;
+
+	// M544: one block of the file per pass
+	if (indexScan)
+	{
+		res = replay_read(replayBuffer[0],REPLAY_BUFFER_SIZE,&read);
+		if (res != FR_OK)
+		{
+			printf("sdcard_buildindex: error %s\n\r",getError(res));
+			sdindex_abort();
+		}
+		else
+			sdindex_feed(replayBuffer[0],read);
+		if (res != FR_OK || read < REPLAY_BUFFER_SIZE || !sdindex_active())
+		{
+			sdindex_finish();
+			f_close(&replayFile);
+			indexScan = 0;
+			usb_printf(sdindex_valid(selectedFile) ? "index done\r\n" : "error: index failed\r\n");
+		}
+		return;
+	}
+
+	if (!replay_mode)
+		return;
+
+	if (replayEof)
+	{
+		if (replayReadPos >= replayLength[replayActive] && !replayLength[other])
+		{
+			printf("sdcard_replay: end of file\n\r");
+			usb_printf("Done printing file\r\n");
+			// the last block file record can still wait for the planner
+			replay_close();
+		}
+		return;
 	}
 
-	if (read != 1)
+	if (!replayLength[replayActive])
 	{
-		printf("sdcard_getchar: end of file\n\r");
+		replayReadPos = 0;
+		replay_fill(replayActive);
+	}
+	else if (!replayLength[other])
+		replay_fill(other);
+}
+
+int sdcard_getchar(unsigned char* chr)
+{
+	const unsigned char* data;
+
+	if (!sdcard_replay_available(&data))
 		return 0;
-	}	
 
+	*chr = *data;
+	sdcard_replay_consume(1);
 	return 1;
 }
 
 void sdcard_replaystart()
 {
-	if (replay_mode)
+	if (replay_mode && !replay_pause)
 		return;
 
 	if (capture_mode)
 		sdcard_capturestop();
 
-	if (!replay_pause)
+	if (indexScan)
+	{
+		usb_printf("error: index build running\r\n");
+		return;
+	}
+
+	if (!replay_mode)
 	{
 		if (!selectedFile)
 		{
@@ -115,18 +465,48 @@ void sdcard_replaystart()
 		}
 
 		printf("sdcard_replaystart: opening file %s for replay\n\r",selectedFile);
-		FRESULT res = f_open(&replayFile,selectedFile,FA_OPEN_EXISTING|FA_READ);
+		FRESULT res = replay_open();
 		if (res != FR_OK)
 		{
 			printf("sdcard_replaystart: error %s\n\r",getError(res));
 			usb_printf("error: failed to open file\n\r");
 			return;
 		}
+		replay_mode = 1;
+		gcode_replay_reset();
+
+		// cluster link map, seeks don't walk the FAT chain
+		replayFile.cltbl = replayLinkMap;
+		replayLinkMap[0] = REPLAY_LINKMAP_SIZE;
+		if (f_lseek(&replayFile,CREATE_LINKMAP) != FR_OK)
+			replayFile.cltbl = NULL;
+
+		if (replayBlockFile)
+		{
+			// the planner state at any other record is unknown
+			if (fileSeekpos || replaySkipLines || !replay_blockfile_matches())
+			{
+				usb_printf(fileSeekpos || replaySkipLines ? "error: block files only start from the beginning\r\n"
+					: "error: block file planned for other steps per unit\r\n");
+				f_close(&replayFile);
+				replay_mode = 0;
+				replayBlockFile = 0;
+				replaySkipLines = 0;
+				fileSeekpos = 0;
+				return;
+			}
+			replay_seek(BLOCKFILE_HEADER_SIZE);
+		}
+		else
+		{
+			replay_seek(fileSeekpos);
+			if (fileSeekpos == 0 && !replaySkipLines && !sdindex_valid(selectedFile)
+				&& sdindex_begin(selectedFile,replayDataSize))
+				printf("sdcard_replaystart: building index\n\r");
+		}
+		fileSeekpos = 0;
 	}
-	replay_mode = 1;
 	replay_pause = 0;
-	sdcard_setposition(fileSeekpos);
-	fileSeekpos = 0;
 }
 
 void sdcard_replaypause()
@@ -143,8 +523,11 @@ void sdcard_replaystop()
 	if (!replay_mode)
 		return;
 		
-	f_close(&replayFile);
-	replay_mode = 0;
+	// replay ended before the end of the file, the index is incomplete
+	// and a block file record the parser holds is dropped
+	sdindex_abort();
+	replay_close();
+	gcode_replay_reset();
 }
 
 int sdcard_isreplaying()
@@ -157,6 +540,22 @@ int sdcard_isreplaypaused()
 	return replay_pause;
 }
 
+unsigned char sdcard_replay_isblockfile()
+{
+	return replay_mode && replayBlockFile;
+}
+
+//--------------------------------------------------
+// File position of the next byte for the parser
+// (the file pointer itself runs ahead)
+//--------------------------------------------------
+unsigned int sdcard_getposition()
+{
+	if (!replay_mode)
+		return 0;
+	return replayPos;
+}
+
 void sdcard_capturestart()
 {
 	if (!selectedFile)
@@ -178,17 +577,139 @@ void sdcard_capturestart()
 		return;
 	}
 
+	captureLen = 0;
 	capture_mode = 1;
 }
 
 void sdcard_setposition(unsigned int filepos)
 {
+	if (replay_mode && replayBlockFile)
+	{
+		usb_printf("error: block files only start from the beginning\r\n");
+		return;
+	}
+	// the index needs the file in one piece
 	if (replay_mode)
-		f_lseek(&replayFile,filepos);
-	else
-		fileSeekpos = filepos;
+		sdindex_abort();
+	replaySkipLines = 0;
+	replay_seek(filepos);
+}
+
+//--------------------------------------------------
+// M26 L<line>, line numbers from 1, needs the index
+//--------------------------------------------------
+void sdcard_setline(unsigned int line)
+{
+	uint32_t offset, skip;
+
+	if (!selectedFile || line == 0 || !sdindex_lookup_line(selectedFile,line - 1,&offset,&skip))
+	{
+		usb_printf("error: no index entry for line %u\r\n",line);
+		return;
+	}
+	sdcard_setposition(offset);
+	replaySkipLines = skip;
+}
+
+//--------------------------------------------------
+// M26 P<layer>, layers from 0
+//--------------------------------------------------
+void sdcard_setlayer(unsigned int layer)
+{
+	uint32_t offset;
+
+	if (!selectedFile || !sdindex_lookup_layer(selectedFile,layer,&offset))
+	{
+		usb_printf("error: no index entry for layer %u\r\n",layer);
+		return;
+	}
+	sdcard_setposition(offset);
+}
+
+//--------------------------------------------------
+// M544: build the index of the selected file without
+// printing it, runs in sdcard_replay_update()
+//--------------------------------------------------
+void sdcard_buildindex()
+{
+	if (replay_mode || indexScan)
+	{
+		usb_printf("error: file in use\r\n");
+		return;
+	}
+	if (!selectedFile)
+	{
+		usb_printf("error: file not selected\r\n");
+		return;
+	}
+	if (replay_open() != FR_OK)
+	{
+		usb_printf("error: failed to open file\n\r");
+		return;
+	}
+	if (replayBlockFile)
+	{
+		f_close(&replayFile);
+		replayBlockFile = 0;
+		usb_printf("error: block files have no index\r\n");
+		return;
+	}
+	if (!sdindex_begin(selectedFile,replayDataSize))
+	{
+		f_close(&replayFile);
+		usb_printf("error: can't create index\r\n");
+		return;
+	}
+	indexScan = 1;
+}
+
+
+static unsigned char capture_flush()
+{
+	FRESULT res;
+	UINT written;
+
+	if (!captureLen)
+		return 1;
+
+	res = f_write(&captureFile,captureBuffer,captureLen,&written);
+	if (res != FR_OK)
+	{
+		printf("sdcard_writeline error %s\n\r",getError(res));
+		captureLen = 0;
+		return 0;
+	}
+
+	if (captureLen != written)
+	{
+		printf("sdcard_writeline error: disk full?\n\r");
+		captureLen = 0;
+		return 0;
+	}
+	captureLen = 0;
+	return 1;
 }
 
+static unsigned char capture_append(const char* data, unsigned int len)
+{
+	unsigned int chunk;
+
+	while (len)
+	{
+		chunk = CAPTURE_BUFFER_SIZE - captureLen;
+		if (chunk > len)
+			chunk = len;
+		memcpy(&captureBuffer[captureLen],data,chunk);
+		captureLen += chunk;
+		data += chunk;
+		len -= chunk;
+
+		// only full buffers, FatFs passes them to the disk without copying
+		if (captureLen == CAPTURE_BUFFER_SIZE && !capture_flush())
+			return 0;
+	}
+	return 1;
+}
 
 void sdcard_capturestop()
 {
@@ -200,6 +721,7 @@ void sdcard_capturestop()
 		return;
 	}
 	
+	capture_flush();
 	usb_printf("%d bytes written\n\r",f_tell(&captureFile));
 	f_sync(&captureFile);
 	f_close(&captureFile);
@@ -208,84 +730,243 @@ void sdcard_capturestop()
 
 unsigned char sdcard_writeline(const char* line)
 {
-	FRESULT res;
-	UINT written;
-	
 	if (!capture_mode)
 		return 0;
-		
-	
-	res = f_write(&captureFile,line,strlen(line),&written);
-	if (res != FR_OK)
+
+	return capture_append(line,strlen(line)) && capture_append("\n",1);
+}
+
+
+
+
+#if defined(BOARD_SD_PIN_CD)
+static void ISR_CardDetect(const Pin* pin)
+{
+	card_changed = 1;
+}
+#endif
+
+//--------------------------------------------------
+// Card detect by pin change interrupt, call after
+// PIO_InitializeInterrupts()
+//--------------------------------------------------
+void sdcard_init()
+{
+#if defined(BOARD_SD_PIN_CD)
+	PIO_Configure(&pinCardDetect,1);
+	PIO_ConfigureIt(&pinCardDetect,ISR_CardDetect);
+	PIO_EnableIt(&pinCardDetect);
+#endif
+	card_changed = 1;
+}
+
+static void sdcard_card_removed()
+{
+	printf("sdcard: card removed\n\r");
+	if (usb_exported)
 	{
-		printf("sdcard_writeline error %s\n\r",getError(res));
-		return 0;
+		msd_set_medium(NULL);
+		usb_exported = 0;
+		usb_release = 0;
 	}
-
-	if (strlen(line) != written)
+	if (replay_mode)
+		sdcard_replaystop();
+	capture_mode = 0;
+	sdindex_abort();
+	indexScan = 0;
+	if (sdformat_active())
 	{
-		printf("sdcard_writeline error: disk full?\n\r");
-		return 0;
+		sdformat_abort();
+		usb_printf("sdcard: format failed\r\n");
 	}
-	f_write(&captureFile,"\n",1,&written);
-	
-	return 1;
+
+	// nothing can be written back any more
+	disk_ioctl(0,CTRL_EJECT,0);
+	f_mount(0,NULL);
+	is_mounted = 0;
+	mount_state = MOUNT_NO_CARD;
 }
 
+//--------------------------------------------------
+// Main loop: card detect and the mount steps
+//--------------------------------------------------
+void sdcard_handle_state()
+{
+	DIR dirs;
+	FRESULT res = FR_OK;
+
+	if (card_changed)
+	{
+		card_changed = 0;
+		if (sdcard_carddetected())
+		{
+			if (mount_state == MOUNT_NO_CARD)
+				printf("sdcard: card inserted\n\r");
+			if (mount_state == MOUNT_NO_CARD || mount_state == MOUNT_SETTLE)
+			{
+				mount_state = MOUNT_SETTLE;
+				mount_timer = timestamp;
+			}
+		}
+		else if (mount_state != MOUNT_NO_CARD)
+			sdcard_card_removed();
+	}
 
+	switch(mount_state)
+	{
+		case MOUNT_SETTLE:
+			if (timestamp - mount_timer >= CARD_SETTLE_MS)
+				mount_state = MOUNT_INIT;
+			break;
+		case MOUNT_INIT:
+			// the card can take a second to power up, the heaters
+			// are serviced while it's polled
+			gSdmmcIdleHook = heater_task;
+			res = MEDSdcard_Initialize(&medias[DRV_DISK],0) ? FR_OK : FR_NOT_READY;
+			gSdmmcIdleHook = 0;
+			if (res != FR_OK)
+			{
+				printf("\r\nsdcard: SD card initialization failed, no sd card inserted?\r\n");
+				mount_state = MOUNT_IDLE;
+				break;
+			}
+			f_mount(0,&fs);
+			mount_state = MOUNT_CHECK_FS;
+			break;
+		case MOUNT_CHECK_FS:
+			if (f_opendir(&dirs,"0:") == FR_NO_FILESYSTEM)
+			{
+				printf("sdcard: No filesystem found on SD card, formatting...\r\n");
+				usb_printf("sdcard: formatting\r\n");
+				mount_state = MOUNT_FORMAT;
+				break;
+			}
+			printf("sdcard: mounted\r\n");
+			is_mounted = 1;
+			mount_state = MOUNT_READY;
+			break;
+		case MOUNT_FORMAT:
+			// the f_mkfs(0,0,0) layout, the replay buffer is free until mounted
+			format_percent = 0;
+			res = sdformat_begin(replayBuffer[0],REPLAY_BUFFER_SIZE);
+			mount_state = MOUNT_FORMATTING;
+			if (res == FR_OK)
+				break;
+			// fall through
+		case MOUNT_FORMATTING:
+			mount_timer = timestamp;
+			while (res == FR_OK && sdformat_active() && timestamp - mount_timer < FORMAT_STEP_MS)
+				res = sdformat_step();
+			if (res != FR_OK)
+			{
+				printf("sdcard: format failed: %s\r\n",getError(res));
+				usb_printf("sdcard: format failed\r\n");
+				f_mount(0,NULL);
+				mount_state = MOUNT_IDLE;
+				break;
+			}
+			if (sdformat_active())
+			{
+				if (sdformat_progress() / 10 != format_percent / 10)
+				{
+					format_percent = sdformat_progress();
+					usb_printf("sdcard: formatting %u%%\r\n",(unsigned int)format_percent);
+				}
+				break;
+			}
+			printf("sdcard: format ok\r\n");
+			usb_printf("sdcard: format done\r\n");
+			// drops what FatFs found on the card before the format
+			f_mount(0,&fs);
+			mount_state = MOUNT_CHECK_FS;
+			break;
+		default:
+			break;
+	}
 
+	// ejected on the host or M543 S0: the firmware uses the card
+	// again once no host transfer is on the way
+	if (usb_exported && msd_eject_requested())
+		usb_release = 1;
+	if (usb_release && msd_medium_idle())
+	{
+		msd_set_medium(NULL);
+		usb_exported = 0;
+		usb_release = 0;
+		printf("sdcard: back from USB\n\r");
+		usb_printf("sdcard: back from USB\r\n");
+		sdcard_mount();
+	}
+}
 
-void sdcard_handle_state()
+//--------------------------------------------------
+// Hand the card to the USB mass storage interface (enable = 1)
+// or take it back. FatFs and the host must never use the card
+// at the same time, so it's unmounted while exported. Taking it
+// back finishes in sdcard_handle_state() when the host is idle.
+//--------------------------------------------------
+unsigned char sdcard_usb_export(unsigned char enable)
 {
-	unsigned char has_card = sdcard_carddetected();
-
-	if (has_card != had_card)
+	if (enable)
 	{
-		if (has_card)
+		if (usb_exported)
 		{
-			printf("sdcard: card inserted\n\r");
-			sdcard_mount();
+			usb_release = 0;
+			return 1;
 		}
-		else
+		if (replay_mode || capture_mode || indexScan)
 		{
-			printf("sdcard: card removed\n\r");
-			sdcard_unmount();
-			is_mounted = 0;
+			usb_printf("error: card in use by replay/capture\r\n");
+			return 0;
 		}
+		if (!is_mounted)
+		{
+			usb_printf("error: no sd card\r\n");
+			return 0;
+		}
+		sdcard_unmount();
+		usb_exported = 1;
+		msd_set_medium(&medias[DRV_DISK]);
+		printf("sdcard: exported via USB\n\r");
 	}
-	had_card = has_card;
+	else
+	{
+		if (!usb_exported)
+			return 1;
+		// PREVENT ALLOW MEDIUM REMOVAL from the host
+		if (msd_removal_prevented())
+		{
+			usb_printf("error: card locked by the host, eject it there\r\n");
+			return 0;
+		}
+		usb_release = 1;
+	}
+	return 1;
+}
+
+unsigned char sdcard_isexported()
+{
+	return usb_exported;
 }
 
 
+//--------------------------------------------------
+// Start mounting (M21), the steps run in sdcard_handle_state()
+//--------------------------------------------------
 void sdcard_mount()
 {
-	DIR dirs;
-	FRESULT res;
-
-	if (is_mounted)
+	if (is_mounted || usb_exported)
 		return;
-	
-	if (!MEDSdcard_Initialize(&medias[DRV_DISK],0))
-	{
-		printf("\r\nsdcard: SD card initialization failed, no sd card inserted?\r\n");
-		return;
-	}
-	
-	f_mount(0,&fs);
-	
-	if (f_opendir(&dirs,"0:") == FR_NO_FILESYSTEM)
+
+	if (mount_state == MOUNT_NO_CARD || mount_state == MOUNT_IDLE)
 	{
-		printf("sdcard: No filesystem found on SD card, formatting...");
-		res = f_mkfs(0,0,512);
-		if (res != FR_OK)
+		if (!sdcard_carddetected())
 		{
-			printf("failed: %s\r\n",getError(res));
+			printf("\r\nsdcard: no sd card inserted\r\n");
 			return;
 		}
-		else
-			printf("ok\r\n");
+		mount_state = MOUNT_INIT;
 	}
-	is_mounted = 1;
 }
 
 void sdcard_unmount()
@@ -293,8 +974,10 @@ void sdcard_unmount()
 	if (!is_mounted)
 		return;
 		
+	disk_ioctl(0,CTRL_SYNC,0);
 	f_mount(0,NULL);
 	is_mounted = 0;
+	mount_state = MOUNT_IDLE;
 }
 
 unsigned char sdcard_ismounted()
@@ -302,6 +985,11 @@ unsigned char sdcard_ismounted()
 	return is_mounted;
 }
 
+unsigned char sdcard_ismounting()
+{
+	return mount_state >= MOUNT_SETTLE && mount_state <= MOUNT_FORMATTING;
+}
+
 unsigned char sdcard_carddetected()
 {
 	return MEDSdcard_Detect(&medias[DRV_DISK],0);
@@ -315,7 +1003,7 @@ void sdcard_printstatus()
 	}
 	else
 	{
-		usb_printf("ok %02.02f%% (%d/%d)\n\r",(double)f_tell(&replayFile)/(double)f_size(&replayFile),f_tell(&replayFile),f_size(&replayFile));
+		usb_printf("ok %02.02f%% (%d/%d)\n\r",(double)replayPos/(double)replayDataSize,replayPos,replayDataSize);
 	}
 }
 
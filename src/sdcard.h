@@ -4,22 +4,35 @@
 
 void sdcard_listfiles();
 void sdcard_selectfile(const char* name);
+const char* sdcard_selectedfile();
 void sdcard_capturestart();
 void sdcard_capturestop();
 unsigned char sdcard_iscapturing();
 unsigned char sdcard_writeline(const char* line);
 void sdcard_setposition(unsigned int filepos);
+void sdcard_setline(unsigned int line);
+void sdcard_setlayer(unsigned int layer);
+void sdcard_buildindex();
 void sdcard_printstatus();
 int sdcard_getchar(unsigned char* chr);
+unsigned int sdcard_replay_available(const unsigned char** data);
+void sdcard_replay_consume(unsigned int len);
+void sdcard_replay_update();
 void sdcard_replaystart();
 void sdcard_replaypause();
 void sdcard_replaystop();
 int sdcard_isreplaying();
 int sdcard_isreplaypaused();
+unsigned char sdcard_replay_isblockfile();
+unsigned int sdcard_getposition();
+void sdcard_init();
 void sdcard_handle_state();
 void sdcard_mount();
 void sdcard_unmount();
 unsigned char sdcard_ismounted();
+unsigned char sdcard_ismounting();
 unsigned char sdcard_carddetected();
+unsigned char sdcard_usb_export(unsigned char enable);
+unsigned char sdcard_isexported();
 
 #endif /* end of include guard: SDCARD_H_YIQ9IWI0 */
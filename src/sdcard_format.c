@@ -0,0 +1,333 @@
+/*
+ SD card format in the background
+ The f_mkfs() layout written a buffer at a time from the main loop,
+ see sdcard_format.h.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <board.h>
+#include <fatfs/src/ff.h>
+#include <fatfs/src/diskio.h>
+#include <string.h>
+
+#include "sdcard_format.h"
+
+#define SECTOR_SIZE		512
+#define N_ROOTDIR		512			// root dir entries for FAT12/16
+#define DIR_ENTRY_SIZE	32
+#define VOLUME_START	63			// partition start, after the MBR
+
+// FAT sub-type boundaries (ff.c)
+#define MIN_FAT16		4086
+#define MIN_FAT32		65526
+
+// boot record offsets (ff.c)
+#define BPB_BytsPerSec	11
+#define BPB_SecPerClus	13
+#define BPB_RsvdSecCnt	14
+#define BPB_NumFATs		16
+#define BPB_RootEntCnt	17
+#define BPB_TotSec16	19
+#define BPB_Media		21
+#define BPB_FATSz16		22
+#define BPB_SecPerTrk	24
+#define BPB_NumHeads	26
+#define BPB_HiddSec		28
+#define BPB_TotSec32	32
+#define BS_DrvNum		36
+#define BS_BootSig		38
+#define BS_VolID		39
+#define BS_VolLab		43
+#define BPB_FATSz32		36
+#define BPB_RootClus	44
+#define BPB_FSInfo		48
+#define BPB_BkBootSec	50
+#define BS_DrvNum32		64
+#define BS_BootSig32	66
+#define BS_VolID32		67
+#define BS_VolLab32		71
+#define FSI_LeadSig		0
+#define FSI_StrucSig	484
+#define FSI_Free_Count	488
+#define FSI_Nxt_Free	492
+#define MBR_Table		446
+#define BS_55AA			510
+
+typedef struct
+{
+	uint8_t* buffer;
+	unsigned int sectors;		// buffer size in sectors
+	unsigned char active;
+	unsigned char fmt;			// FS_FAT12/16/32
+	DWORD n_vol, n_rsv, n_fat, n_dir, n_clst, au;
+	DWORD b_fat;				// first sector to clear
+	DWORD next;					// next sector to clear
+	DWORD end;					// end of the FAT and root directory
+} FormatState;
+
+static FormatState fmt;
+
+//--------------------------------------------------
+// Cluster size and FAT layout, as f_mkfs() chooses them
+//--------------------------------------------------
+static FRESULT format_layout(void)
+{
+	static const WORD vst[] = { 1024,   512,  256,  128,   64,    32,   16,    8,    4,    2,   0};
+	static const WORD cst[] = {32768, 16384, 8192, 4096, 2048, 16384, 8192, 4096, 2048, 1024, 512};
+	DWORD n_vol = 0, n = 0;
+	unsigned int i;
+
+	if (disk_ioctl(0,GET_SECTOR_COUNT,&n_vol) != RES_OK || n_vol < 128)
+		return FR_DISK_ERR;
+	n_vol -= VOLUME_START;
+
+	for(i = 0;n_vol / 2000 < vst[i];i++)
+		;
+	fmt.au = cst[i] / SECTOR_SIZE;
+
+	fmt.n_clst = n_vol / fmt.au;
+	fmt.fmt = FS_FAT12;
+	if (fmt.n_clst >= MIN_FAT16)
+		fmt.fmt = FS_FAT16;
+	if (fmt.n_clst >= MIN_FAT32)
+		fmt.fmt = FS_FAT32;
+
+	if (fmt.fmt == FS_FAT32)
+	{
+		fmt.n_fat = ((fmt.n_clst * 4) + 8 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+		fmt.n_rsv = 32;
+		fmt.n_dir = 0;
+	}
+	else
+	{
+		fmt.n_fat = (fmt.fmt == FS_FAT12) ? (fmt.n_clst * 3 + 1) / 2 + 3 : (fmt.n_clst * 2) + 4;
+		fmt.n_fat = (fmt.n_fat + SECTOR_SIZE - 1) / SECTOR_SIZE;
+		fmt.n_rsv = 1;
+		fmt.n_dir = N_ROOTDIR * DIR_ENTRY_SIZE / SECTOR_SIZE;
+	}
+	if (n_vol < fmt.n_rsv + fmt.n_fat + fmt.n_dir + fmt.au)
+		return FR_MKFS_ABORTED;
+
+	// data area aligned to the erase block
+	if (disk_ioctl(0,GET_BLOCK_SIZE,&n) != RES_OK || !n || n > 32768)
+		n = 1;
+	i = VOLUME_START + fmt.n_rsv + fmt.n_fat + fmt.n_dir;
+	n = ((i + n - 1) & ~(n - 1)) - i;
+	if (fmt.fmt == FS_FAT32)
+		fmt.n_rsv += n;
+	else
+		fmt.n_fat += n;
+
+	fmt.n_clst = (n_vol - fmt.n_rsv - fmt.n_fat - fmt.n_dir) / fmt.au;
+	if ((fmt.fmt == FS_FAT16 && fmt.n_clst < MIN_FAT16)
+		|| (fmt.fmt == FS_FAT32 && fmt.n_clst < MIN_FAT32))
+		return FR_MKFS_ABORTED;
+
+	fmt.n_vol = n_vol;
+	fmt.b_fat = VOLUME_START + fmt.n_rsv;
+	fmt.end = fmt.b_fat + fmt.n_fat + (fmt.fmt == FS_FAT32 ? fmt.au : fmt.n_dir);
+	return FR_OK;
+}
+
+//--------------------------------------------------
+// The boot records and the first FAT sector, after
+// the FAT and the root directory are cleared
+//--------------------------------------------------
+static FRESULT format_records(void)
+{
+	uint8_t* tbl = fmt.buffer;
+	BYTE sys;
+	DWORD n;
+
+	// first FAT sector: clusters 0, 1 (and the FAT32 root dir) in use
+	memset(tbl,0,SECTOR_SIZE);
+	if (fmt.fmt == FS_FAT32)
+	{
+		ST_DWORD(tbl + 0,0xFFFFFFF8);
+		ST_DWORD(tbl + 4,0xFFFFFFFF);
+		ST_DWORD(tbl + 8,0x0FFFFFFF);
+	}
+	else
+	{
+		ST_DWORD(tbl + 0,(fmt.fmt == FS_FAT12) ? 0x00FFFFF8 : 0xFFFFFFF8);
+	}
+	if (disk_write(0,tbl,fmt.b_fat,1) != RES_OK)
+		return FR_DISK_ERR;
+
+	// volume boot record
+	memset(tbl,0,SECTOR_SIZE);
+	memcpy(tbl,"\xEB\xFE\x90" "MSDOS5.0",11);
+	ST_WORD(tbl + BPB_BytsPerSec,SECTOR_SIZE);
+	tbl[BPB_SecPerClus] = (BYTE)fmt.au;
+	ST_WORD(tbl + BPB_RsvdSecCnt,fmt.n_rsv);
+	tbl[BPB_NumFATs] = 1;
+	ST_WORD(tbl + BPB_RootEntCnt,fmt.fmt == FS_FAT32 ? 0 : N_ROOTDIR);
+	if (fmt.n_vol < 0x10000)
+	{
+		ST_WORD(tbl + BPB_TotSec16,fmt.n_vol);
+	}
+	else
+	{
+		ST_DWORD(tbl + BPB_TotSec32,fmt.n_vol);
+	}
+	tbl[BPB_Media] = 0xF8;
+	ST_WORD(tbl + BPB_SecPerTrk,63);
+	ST_WORD(tbl + BPB_NumHeads,255);
+	ST_DWORD(tbl + BPB_HiddSec,VOLUME_START);
+	n = get_fattime();
+	if (fmt.fmt == FS_FAT32)
+	{
+		ST_DWORD(tbl + BS_VolID32,n);
+		ST_DWORD(tbl + BPB_FATSz32,fmt.n_fat);
+		ST_DWORD(tbl + BPB_RootClus,2);
+		ST_WORD(tbl + BPB_FSInfo,1);
+		ST_WORD(tbl + BPB_BkBootSec,6);
+		tbl[BS_DrvNum32] = 0x80;
+		tbl[BS_BootSig32] = 0x29;
+		memcpy(tbl + BS_VolLab32,"NO NAME    " "FAT32   ",19);
+	}
+	else
+	{
+		ST_DWORD(tbl + BS_VolID,n);
+		ST_WORD(tbl + BPB_FATSz16,fmt.n_fat);
+		tbl[BS_DrvNum] = 0x80;
+		tbl[BS_BootSig] = 0x29;
+		memcpy(tbl + BS_VolLab,"NO NAME    " "FAT     ",19);
+	}
+	ST_WORD(tbl + BS_55AA,0xAA55);
+	if (disk_write(0,tbl,VOLUME_START,1) != RES_OK)
+		return FR_DISK_ERR;
+
+	if (fmt.fmt == FS_FAT32)
+	{
+		if (disk_write(0,tbl,VOLUME_START + 6,1) != RES_OK)
+			return FR_DISK_ERR;
+
+		memset(tbl,0,SECTOR_SIZE);
+		ST_DWORD(tbl + FSI_LeadSig,0x41615252);
+		ST_DWORD(tbl + FSI_StrucSig,0x61417272);
+		ST_DWORD(tbl + FSI_Free_Count,fmt.n_clst - 1);
+		ST_DWORD(tbl + FSI_Nxt_Free,2);
+		ST_WORD(tbl + BS_55AA,0xAA55);
+		if (disk_write(0,tbl,VOLUME_START + 1,1) != RES_OK
+			|| disk_write(0,tbl,VOLUME_START + 7,1) != RES_OK)
+			return FR_DISK_ERR;
+	}
+
+	// the partition table last, it makes the volume visible
+	switch(fmt.fmt)
+	{
+		case FS_FAT12:	sys = 0x01; break;
+		case FS_FAT16:	sys = (fmt.n_vol < 0x10000) ? 0x04 : 0x06; break;
+		default:		sys = 0x0C; break;
+	}
+	memset(tbl,0,SECTOR_SIZE);
+	tbl += MBR_Table;
+	tbl[1] = 1;
+	tbl[2] = 1;
+	tbl[3] = 0;
+	tbl[4] = sys;
+	tbl[5] = 254;
+	n = (VOLUME_START + fmt.n_vol) / 63 / 255;
+	tbl[6] = (BYTE)((n >> 2) | 63);
+	tbl[7] = (BYTE)n;
+	ST_DWORD(tbl + 8,VOLUME_START);
+	ST_DWORD(tbl + 12,fmt.n_vol);
+	ST_WORD(fmt.buffer + BS_55AA,0xAA55);
+	if (disk_write(0,fmt.buffer,0,1) != RES_OK)
+		return FR_DISK_ERR;
+
+	return disk_ioctl(0,CTRL_SYNC,0) == RES_OK ? FR_OK : FR_DISK_ERR;
+}
+
+//--------------------------------------------------
+// Start a format, buffer (whole sectors) is used
+// until the format is done or aborted
+//--------------------------------------------------
+FRESULT sdformat_begin(uint8_t* buffer, unsigned int size)
+{
+	FRESULT res;
+
+	fmt.active = 0;
+	fmt.buffer = buffer;
+	fmt.sectors = size / SECTOR_SIZE;
+	if (!fmt.sectors)
+		return FR_INVALID_PARAMETER;
+
+	res = format_layout();
+	if (res != FR_OK)
+		return res;
+
+	// no partition table until the end, a half formatted card has no file system
+	memset(fmt.buffer,0,fmt.sectors * SECTOR_SIZE);
+	if (disk_write(0,fmt.buffer,0,1) != RES_OK)
+		return FR_DISK_ERR;
+
+	fmt.next = fmt.b_fat;
+	fmt.active = 1;
+	return FR_OK;
+}
+
+//--------------------------------------------------
+// Clear the next buffer of the FAT and root directory,
+// writes the boot records after the last one
+//--------------------------------------------------
+FRESULT sdformat_step(void)
+{
+	DWORD count;
+	FRESULT res;
+
+	if (!fmt.active)
+		return FR_OK;
+
+	if (fmt.next < fmt.end)
+	{
+		count = fmt.end - fmt.next;
+		if (count > fmt.sectors)
+			count = fmt.sectors;
+		if (count > 255)
+			count = 255;
+		if (disk_write(0,fmt.buffer,fmt.next,(BYTE)count) != RES_OK)
+		{
+			fmt.active = 0;
+			return FR_DISK_ERR;
+		}
+		fmt.next += count;
+		return FR_OK;
+	}
+
+	res = format_records();
+	fmt.active = 0;
+	return res;
+}
+
+void sdformat_abort(void)
+{
+	fmt.active = 0;
+}
+
+unsigned char sdformat_active(void)
+{
+	return fmt.active;
+}
+
+//--------------------------------------------------
+// Percent of the FAT and root directory cleared
+//--------------------------------------------------
+unsigned char sdformat_progress(void)
+{
+	if (!fmt.active || fmt.end == fmt.b_fat)
+		return 100;
+	return (uint64_t)(fmt.next - fmt.b_fat) * 100 / (fmt.end - fmt.b_fat);
+}
@@ -0,0 +1,35 @@
+/*
+ SD card format in the background
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef SDCARD_FORMAT_H_R7QM3CZ8
+#define SDCARD_FORMAT_H_R7QM3CZ8
+
+#include <inttypes.h>
+#include <fatfs/src/ff.h>
+
+// Same layout as f_mkfs(0,0,0): one FAT partition from sector 63, the
+// cluster size and FAT type chosen by the volume size, one FAT copy.
+// sdformat_step() clears one buffer of the FAT and root directory per
+// call; the boot records go out last, so the card only holds a file
+// system once the format is complete.
+
+FRESULT sdformat_begin(uint8_t* buffer, unsigned int size);
+FRESULT sdformat_step(void);
+void sdformat_abort(void);
+unsigned char sdformat_active(void);
+unsigned char sdformat_progress(void);
+
+#endif /* end of include guard: SDCARD_FORMAT_H_R7QM3CZ8 */
@@ -0,0 +1,360 @@
+/*
+ SD card line / layer index
+ Built from the file data while it is replayed (or scanned with M544),
+ looked up by M26 L<line> / M26 P<layer>. See sdcard_index.h for the layout.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <board.h>
+#include <fatfs/src/ff.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdcard_index.h"
+
+#define INDEX_MAGIC			0x58444947		// "GIDX"
+#define INDEX_SECTOR		512
+#define INDEX_LINE_TABLE	INDEX_SECTOR
+#define INDEX_TEXT_SIZE		48				// start of a line kept for the layer detection
+
+#define LINE_ENTRIES		(INDEX_SECTOR / 4)
+#define LAYER_ENTRIES		(INDEX_SECTOR / 8)
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t src_size;			// G-code file the index belongs to
+	uint16_t src_date;
+	uint16_t src_time;
+	uint32_t line_step;
+	uint32_t lines;
+	uint32_t line_entries;
+	uint32_t layers;
+	uint32_t layer_table;		// file offset of the layer table
+} IndexHeader;
+
+typedef struct
+{
+	uint32_t offset;
+	uint32_t line;
+} LayerEntry;
+
+typedef struct
+{
+	unsigned char active;
+	IndexHeader header;
+	uint32_t offset;			// file offset of the next byte fed
+	uint32_t line;				// current line
+	uint32_t line_start;		// offset of the current line
+	char text[INDEX_TEXT_SIZE + 1];
+	unsigned char text_len;
+
+	float z;					// last Z seen
+	uint32_t z_offset;			// line that set it
+	uint32_t z_line;
+	float layer_z;
+
+	uint32_t line_sector;		// next sector of each table
+	uint32_t layer_sector;
+	unsigned int line_fill;		// entries in the sector buffers
+	unsigned int layer_fill;
+	uint32_t line_buffer[LINE_ENTRIES];
+	LayerEntry layer_buffer[LAYER_ENTRIES];
+} IndexBuilder;
+
+static IndexBuilder idx;
+static FIL indexFile;
+static char indexName[_MAX_LFN + 1];
+
+
+//--------------------------------------------------
+// PART.GCO --> PART.IDX
+//--------------------------------------------------
+static const char* index_name(const char* gcodeName)
+{
+	char* dot;
+	char* slash;
+
+	strncpy(indexName,gcodeName,sizeof(indexName) - 5);
+	indexName[sizeof(indexName) - 5] = 0;
+	dot = strrchr(indexName,'.');
+	slash = strrchr(indexName,'/');
+	if (dot && (!slash || dot > slash))
+		*dot = 0;
+	strcat(indexName,".IDX");
+	return indexName;
+}
+
+static unsigned char write_sector(uint32_t pos, const void* data)
+{
+	UINT written;
+
+	if (f_lseek(&indexFile,pos) != FR_OK)
+		return 0;
+	return f_write(&indexFile,data,INDEX_SECTOR,&written) == FR_OK && written == INDEX_SECTOR;
+}
+
+static void add_line_entry(uint32_t offset)
+{
+	idx.line_buffer[idx.line_fill++] = offset;
+	idx.header.line_entries++;
+	if (idx.line_fill == LINE_ENTRIES)
+	{
+		if (!write_sector(INDEX_LINE_TABLE + idx.line_sector * INDEX_SECTOR,idx.line_buffer))
+			sdindex_abort();
+		idx.line_sector++;
+		idx.line_fill = 0;
+	}
+}
+
+static void add_layer_entry(uint32_t offset, uint32_t line)
+{
+	idx.layer_buffer[idx.layer_fill].offset = offset;
+	idx.layer_buffer[idx.layer_fill].line = line;
+	idx.layer_fill++;
+	idx.header.layers++;
+	if (idx.layer_fill == LAYER_ENTRIES)
+	{
+		if (!write_sector(idx.header.layer_table + idx.layer_sector * INDEX_SECTOR,idx.layer_buffer))
+			sdindex_abort();
+		idx.layer_sector++;
+		idx.layer_fill = 0;
+	}
+}
+
+//--------------------------------------------------
+// Layer detection on the start of a complete line
+//--------------------------------------------------
+static void line_end(void)
+{
+	char* p = idx.text;
+	char* ptr;
+
+	idx.text[idx.text_len] = 0;
+	if ((ptr = strchr(p,';')) != NULL)
+		*ptr = 0;
+
+	while (*p == ' ')
+		p++;
+	if (*p == 'N')
+	{
+		p++;
+		while ((*p >= '0' && *p <= '9') || *p == ' ')
+			p++;
+	}
+
+	if (p[0] != 'G' || (p[1] != '0' && p[1] != '1') || (p[2] >= '0' && p[2] <= '9'))
+		return;
+
+	if ((ptr = strchr(p,'Z')) != NULL)
+	{
+		idx.z = strtod(ptr+1,NULL);
+		idx.z_offset = idx.line_start;
+		idx.z_line = idx.line;
+	}
+
+	if (strchr(p,'E') && (strchr(p,'X') || strchr(p,'Y'))
+		&& (idx.header.layers == 0 || idx.z > idx.layer_z + 0.001f))
+	{
+		add_layer_entry(idx.z_offset,idx.z_line);
+		idx.layer_z = idx.z;
+	}
+}
+
+static unsigned char read_header(const char* gcodeName, IndexHeader* header)
+{
+	FILINFO fno;
+	UINT read;
+	FRESULT res;
+
+	// indexFile is busy while an index is built
+	if (idx.active || f_stat(gcodeName,&fno) != FR_OK)
+		return 0;
+	if (f_open(&indexFile,index_name(gcodeName),FA_OPEN_EXISTING|FA_READ) != FR_OK)
+		return 0;
+	res = f_read(&indexFile,header,sizeof(IndexHeader),&read);
+	if (res != FR_OK || read != sizeof(IndexHeader) || header->magic != INDEX_MAGIC
+		|| header->src_size != fno.fsize || header->src_date != fno.fdate || header->src_time != fno.ftime)
+	{
+		f_close(&indexFile);
+		return 0;
+	}
+	return 1;
+}
+
+static unsigned char read_entry(uint32_t pos, void* data, unsigned int len)
+{
+	UINT read;
+	unsigned char ok;
+
+	ok = f_lseek(&indexFile,pos) == FR_OK && f_read(&indexFile,data,len,&read) == FR_OK && read == len;
+	f_close(&indexFile);
+	return ok;
+}
+
+//--------------------------------------------------
+// Start a new index for gcodeName, the file data (dataSize
+// bytes, uncompressed) follows with sdindex_feed() from offset 0
+//--------------------------------------------------
+unsigned char sdindex_begin(const char* gcodeName, uint32_t dataSize)
+{
+	FILINFO fno;
+
+	if (idx.active)
+		sdindex_abort();
+
+	if (f_stat(gcodeName,&fno) != FR_OK)
+		return 0;
+	if (f_open(&indexFile,index_name(gcodeName),FA_CREATE_ALWAYS|FA_WRITE) != FR_OK)
+	{
+		printf("sdindex: can't create %s\n\r",indexName);
+		return 0;
+	}
+
+	memset(&idx,0,sizeof(IndexBuilder));
+	idx.header.magic = INDEX_MAGIC;
+	idx.header.src_size = fno.fsize;
+	idx.header.src_date = fno.fdate;
+	idx.header.src_time = fno.ftime;
+	idx.header.line_step = SDINDEX_LINE_STEP;
+	// a line has at least one byte, that bounds the line table
+	idx.header.layer_table = INDEX_LINE_TABLE
+		+ ((dataSize / SDINDEX_LINE_STEP + 2) / LINE_ENTRIES + 1) * INDEX_SECTOR;
+	idx.active = 1;
+
+	// no stale header until the index is complete
+	if (!write_sector(0,idx.line_buffer))
+	{
+		sdindex_abort();
+		return 0;
+	}
+	add_line_entry(0);
+	return 1;
+}
+
+void sdindex_feed(const unsigned char* data, unsigned int len)
+{
+	unsigned int i;
+	char chr;
+
+	for(i = 0;i < len && idx.active;i++)
+	{
+		chr = data[i];
+		idx.offset++;
+		if (chr == '\n')
+		{
+			line_end();
+			idx.line++;
+			idx.line_start = idx.offset;
+			idx.text_len = 0;
+			if ((idx.line % SDINDEX_LINE_STEP) == 0)
+				add_line_entry(idx.line_start);
+		}
+		else if (idx.text_len < INDEX_TEXT_SIZE && chr != '\r')
+			idx.text[idx.text_len++] = chr;
+	}
+}
+
+//--------------------------------------------------
+// End of the file reached, the header makes the index valid
+//--------------------------------------------------
+void sdindex_finish()
+{
+	UINT written;
+
+	if (!idx.active)
+		return;
+
+	if (idx.text_len)
+	{
+		line_end();
+		idx.line++;
+	}
+	idx.header.lines = idx.line;
+
+	if ((idx.line_fill && !write_sector(INDEX_LINE_TABLE + idx.line_sector * INDEX_SECTOR,idx.line_buffer))
+		|| (idx.layer_fill && !write_sector(idx.header.layer_table + idx.layer_sector * INDEX_SECTOR,idx.layer_buffer))
+		|| f_lseek(&indexFile,0) != FR_OK
+		|| f_write(&indexFile,&idx.header,sizeof(IndexHeader),&written) != FR_OK)
+	{
+		sdindex_abort();
+		return;
+	}
+	f_close(&indexFile);
+	idx.active = 0;
+	printf("sdindex: %s, %u lines, %u layers\n\r",indexName,idx.header.lines,idx.header.layers);
+}
+
+void sdindex_abort()
+{
+	if (!idx.active)
+		return;
+	idx.active = 0;
+	f_close(&indexFile);
+	f_unlink(indexName);
+}
+
+unsigned char sdindex_active()
+{
+	return idx.active;
+}
+
+unsigned char sdindex_valid(const char* gcodeName)
+{
+	IndexHeader header;
+
+	if (!read_header(gcodeName,&header))
+		return 0;
+	f_close(&indexFile);
+	return 1;
+}
+
+//--------------------------------------------------
+// Offset of the indexed line at or before line (0 based),
+// skip is the number of lines to drop from there
+//--------------------------------------------------
+unsigned char sdindex_lookup_line(const char* gcodeName, uint32_t line, uint32_t* offset, uint32_t* skip)
+{
+	IndexHeader header;
+	uint32_t entry = line / SDINDEX_LINE_STEP;
+
+	if (!read_header(gcodeName,&header))
+		return 0;
+	if (line >= header.lines || entry >= header.line_entries)
+	{
+		f_close(&indexFile);
+		return 0;
+	}
+	*skip = line - entry * SDINDEX_LINE_STEP;
+	return read_entry(INDEX_LINE_TABLE + entry * 4,offset,4);
+}
+
+unsigned char sdindex_lookup_layer(const char* gcodeName, uint32_t layer, uint32_t* offset)
+{
+	IndexHeader header;
+	LayerEntry entry;
+
+	if (!read_header(gcodeName,&header))
+		return 0;
+	if (layer >= header.layers)
+	{
+		f_close(&indexFile);
+		return 0;
+	}
+	if (!read_entry(header.layer_table + layer * sizeof(LayerEntry),&entry,sizeof(LayerEntry)))
+		return 0;
+	*offset = entry.offset;
+	return 1;
+}
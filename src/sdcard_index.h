@@ -0,0 +1,48 @@
+/*
+ SD card line / layer index
+ Sparse line --> byte offset and layer --> byte offset tables for G-code
+ files, so M26 can resume at a line or layer without rescanning the file.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef SDCARD_INDEX_H_4TL8XB2N
+#define SDCARD_INDEX_H_4TL8XB2N
+
+#include <inttypes.h>
+
+// The index lives next to the G-code file with the extension .IDX
+// (PART.GCO --> PART.IDX). Layout, all values little endian:
+//
+//   0                header (see sdcard_index.c), only written when the
+//                    index is complete
+//   512              line table: uint32 offset of line k * SDINDEX_LINE_STEP
+//   header.layer_table
+//                    layer table: uint32 offset, uint32 line of each layer
+//
+// Lines are counted from 0 here. A layer starts with the move that set the
+// Z height of the first extruding X/Y move above the previous layer (Z hops
+// don't count). Absolute Z positioning is assumed.
+#define SDINDEX_LINE_STEP	256
+
+unsigned char sdindex_begin(const char* gcodeName, uint32_t dataSize);
+void sdindex_feed(const unsigned char* data, unsigned int len);
+void sdindex_finish();
+void sdindex_abort();
+unsigned char sdindex_active();
+
+unsigned char sdindex_valid(const char* gcodeName);
+unsigned char sdindex_lookup_line(const char* gcodeName, uint32_t line, uint32_t* offset, uint32_t* skip);
+unsigned char sdindex_lookup_layer(const char* gcodeName, uint32_t layer, uint32_t* offset);
+
+#endif /* end of include guard: SDCARD_INDEX_H_4TL8XB2N */
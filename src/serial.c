@@ -41,6 +41,7 @@
 #include <stdarg.h>
 #include "util.h"
 #include "serial.h"
+#include "usb_msd.h"
 
 //------------------------------------------------------------------------------
 //      Definitions
@@ -60,9 +61,18 @@
 /// State of USB, for suspend and resume
 unsigned char USBState = STATE_IDLE;
 
+/// Number of receive buffers, one USB packet each (power of two)
+#define RXBUFFERS 4
+
 //static unsigned char sendBuffer[DATABUFFERSIZE];
-/// Buffer for storing incoming USB data.
-static unsigned char usbBuffer[DATABUFFERSIZE];
+/// Receive buffers, filled by the UDPHS endpoint DMA in turn. While the parser
+/// works on one buffer the next packets land in the others.
+static unsigned char rxBuffer[RXBUFFERS][DATABUFFERSIZE] __attribute__((aligned(4)));
+/// Bytes in each receive buffer, 0 = free
+static volatile unsigned int rxLength[RXBUFFERS];
+/// Buffer and position the parser reads from
+static unsigned char rxConsume = 0;
+static unsigned int rxReadPos = 0;
 unsigned char isSerialConnected = 0;
 //------------------------------------------------------------------------------
 //         VBus monitoring (optional)
@@ -151,16 +161,47 @@ void USBDCallbacks_Suspended(void)
     USBState = STATE_SUSPEND;
 }
 
-static void (*callback)(unsigned char)=0;
+//------------------------------------------------------------------------------
+/// Re-implemented callback (NOAUTOCALLBACK), class requests for the mass
+/// storage interface go to usb_msd.c, everything else to the CDC driver.
+//------------------------------------------------------------------------------
+void USBDCallbacks_RequestReceived(const USBGenericRequest *request)
+{
+    if (!msd_request_handler(request))
+        CDCDSerialDriver_RequestHandler(request);
+}
 
-void samserial_setcallback(void (*c)(unsigned char)){
-	callback=c;
+//------------------------------------------------------------------------------
+/// Re-implemented callback, (re)starts the mass storage transport when the
+/// host selects a configuration.
+//------------------------------------------------------------------------------
+void USBDDriverCallbacks_ConfigurationChanged(unsigned char cfgnum)
+{
+    msd_configured(cfgnum);
+}
+
+/// Set when all receive buffers are full, the host is NAKed until the parser frees one
+static volatile unsigned char rxPaused = 0;
+
+static void UsbDataReceived(unsigned int buffer,
+                            unsigned char status,
+                            unsigned int received,
+                            unsigned int remaining);
+
+static void UsbStartRead(unsigned int buffer)
+{
+    CDCDSerialDriver_Read(rxBuffer[buffer],
+                          DATABUFFERSIZE,
+                          (TransferCallback) UsbDataReceived,
+                          (void *) buffer);
 }
 
 //------------------------------------------------------------------------------
 /// Callback invoked when data has been received on the USB.
+/// The next read goes straight into the following buffer if it is free,
+/// otherwise the endpoint stays disabled and the host controller NAKs.
 //------------------------------------------------------------------------------
-static void UsbDataReceived(unsigned int unused,
+static void UsbDataReceived(unsigned int buffer,
                             unsigned char status,
                             unsigned int received,
                             unsigned int remaining)
@@ -169,19 +210,19 @@ static void UsbDataReceived(unsigned int unused,
     
     if (status == USBD_STATUS_SUCCESS) {
 
-	
-	int i=0;
-	if(callback)
-		//printf("calling callback\r\n");
-		for(i=0;i<received;++i){
-			//printf("calling callback with %c\r\n",usbBuffer[i]);
-			callback(usbBuffer[i]);
-		}
-        CDCDSerialDriver_Read(usbBuffer,
-                              DATABUFFERSIZE,
-                              (TransferCallback) UsbDataReceived,
-                              0);
-    
+	if (received == 0)
+	{
+		UsbStartRead(buffer);
+		return;
+	}
+
+	rxLength[buffer] = received;
+	buffer = (buffer + 1) & (RXBUFFERS-1);
+
+	if (rxLength[buffer] == 0)
+		UsbStartRead(buffer);
+	else
+		rxPaused = 1;
     
     }
     else {
@@ -189,6 +230,61 @@ static void UsbDataReceived(unsigned int unused,
       //  TRACE_WARNING( "UsbDataReceived: Transfer error\n\r");
     }
 }
+
+//------------------------------------------------------------------------------
+/// Returns the number of received bytes the parser can read at *data.
+//------------------------------------------------------------------------------
+unsigned int samserial_available(const unsigned char** data)
+{
+	unsigned int len = rxLength[rxConsume];
+
+	if (len == 0)
+		return 0;
+
+	*data = &rxBuffer[rxConsume][rxReadPos];
+	return len - rxReadPos;
+}
+
+//------------------------------------------------------------------------------
+/// Marks len bytes returned by samserial_available() as processed. A fully
+/// read buffer goes back to the USB and a held back read is restarted.
+//------------------------------------------------------------------------------
+void samserial_consume(unsigned int len)
+{
+	unsigned char buffer = rxConsume;
+
+	rxReadPos += len;
+	if (rxReadPos < rxLength[buffer])
+		return;
+
+	rxReadPos = 0;
+	rxConsume = (buffer + 1) & (RXBUFFERS-1);
+	rxLength[buffer] = 0;
+
+	//all buffers were full, the freed one is the next to fill
+	if (rxPaused)
+	{
+		rxPaused = 0;
+		UsbStartRead(buffer);
+	}
+}
+
+//------------------------------------------------------------------------------
+/// Free receive space in bytes
+//------------------------------------------------------------------------------
+unsigned int samserial_rxfree()
+{
+	unsigned int free = 0;
+	unsigned char i;
+
+	for(i = 0;i < RXBUFFERS;i++)
+	{
+		if (rxLength[i] == 0)
+			free += DATABUFFERSIZE;
+	}
+	return free;
+}
+
 //volatile int busyflag=0;
 //volatile char _samserial_buffer[128];
 void samserial_print(const char* c)
@@ -196,46 +292,157 @@ void samserial_print(const char* c)
 	usb_printf(c);
 }
 
-volatile char bufferInUse = 0;
+/// Size of the transmit ring (power of two)
+#define TXBUFFERSIZE 2048
+/// Space at the end of the transmit ring only replies may use, telemetry is dropped before
+#define TXRESERVE 512
+
+/// Transmit ring. usb_printf() appends, the write completion sends whatever
+/// collected in the meantime as one bulk IN transfer.
+static unsigned char txBuffer[TXBUFFERSIZE] __attribute__((aligned(4)));
+/// Free running positions, txHead is moved by the main loop, txTail by the USB interrupt
+static volatile unsigned int txHead = 0;
+static volatile unsigned int txTail = 0;
+/// Bytes in the transfer on the way, 0 = endpoint idle
+static volatile unsigned int txSending = 0;
+/// Telemetry lines dropped for lack of space
+unsigned int txDropped = 0;
+
 char printBuffer[256];
 
+static void UsbWriteCompleted(void* pArg,
+                            unsigned char status,
+                            unsigned int received,
+                            unsigned int remaining);
+
+//------------------------------------------------------------------------------
+/// Sends the next chunk of the transmit ring. Called from the write completion
+/// or with the USB interrupt disabled.
+//------------------------------------------------------------------------------
+static void UsbStartWrite(void)
+{
+	unsigned int pos = txTail & (TXBUFFERSIZE-1);
+	unsigned int len = txHead - txTail;
+
+	// not past the end of the ring, and always a short packet, the DMA
+	// doesn't send a zero length packet after a full one
+	if (len > TXBUFFERSIZE - pos)
+		len = TXBUFFERSIZE - pos;
+	if (len > DATABUFFERSIZE - 1)
+		len = DATABUFFERSIZE - 1;
+
+	txSending = len;
+	if (len && CDCDSerialDriver_Write(&txBuffer[pos],len,UsbWriteCompleted,0) != USBD_STATUS_SUCCESS)
+		txSending = 0;
+}
+
 static void UsbWriteCompleted(void* pArg,
                             unsigned char status,
                             unsigned int received,
                             unsigned int remaining)
 {
-	bufferInUse = 0;
+	txTail += txSending;
+	txSending = 0;
+	UsbStartWrite();
 }
 
-void usb_printf(const char * format, ...)
+static unsigned int UsbTxFree(void)
+{
+	return TXBUFFERSIZE - (txHead - txTail);
+}
+
+//------------------------------------------------------------------------------
+/// Copies data into the transmit ring, keeping reserve bytes free.
+/// Returns 0 if it didn't fit.
+//------------------------------------------------------------------------------
+static int usb_write(unsigned int reserve, const void* data, unsigned int len)
 {
+	unsigned int pos, first;
+
 	if (!isSerialConnected)
-		return;
-	
+		return 1;
+
+	if (UsbTxFree() < len + reserve)
+		return 0;
+
+	pos = txHead & (TXBUFFERSIZE-1);
+	first = TXBUFFERSIZE - pos;
+	if (first > len)
+		first = len;
+	memcpy(&txBuffer[pos],data,first);
+	memcpy(txBuffer,(const unsigned char*)data+first,len-first);
+
+	IRQ_DisableIT(AT91C_ID_UDPHS);
+	txHead += len;
+	if (!txSending)
+		UsbStartWrite();
+	IRQ_EnableIT(AT91C_ID_UDPHS);
+	return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Formats into the transmit ring, keeping reserve bytes free.
+/// Returns 0 if the line didn't fit.
+//------------------------------------------------------------------------------
+static int usb_vprintf(unsigned int reserve, const char * format, va_list args)
+{
+	unsigned int str_len;
+
+	if (!isSerialConnected)
+		return 1;
+
+	str_len = vsnprintf(printBuffer,sizeof(printBuffer),format,args);
+	if (str_len >= sizeof(printBuffer))
+		str_len = sizeof(printBuffer) - 1;
+
+	return usb_write(reserve,printBuffer,str_len);
+}
+
+//------------------------------------------------------------------------------
+/// Replies and acknowledges. Never dropped while the host reads, only when the
+/// whole ring stays full for a second (host not reading at all).
+//------------------------------------------------------------------------------
+void usb_printf(const char * format, ...)
+{
 	unsigned int timeout=1000;
-	while(bufferInUse && timeout--)
+	va_list args;
+
+	for(;;)
 	{
+		va_start (args, format);
+		int done = usb_vprintf(0,format,args);
+		va_end (args);
+
+		if (done)
+			return;
+		if (!timeout--)
+			break;
 		delay_ms(1);
 	}
-	
-	if (bufferInUse)
-	{
-		printf("usb_printf timeout\r\n");
-		return;
-	}
-	
-	unsigned int str_len = 0;
+	printf("usb_printf timeout\r\n");
+}
+
+//------------------------------------------------------------------------------
+/// Status output nobody waits for (temperature reports while heating etc).
+/// Dropped instead of waiting when the transmit ring is short of space.
+//------------------------------------------------------------------------------
+void usb_printf_telemetry(const char * format, ...)
+{
 	va_list args;
+
 	va_start (args, format);
-	str_len = vsprintf (printBuffer,format, args);
+	if (!usb_vprintf(TXRESERVE,format,args))
+		txDropped++;
 	va_end (args);
+}
 
-	bufferInUse = 1; 
-	if(CDCDSerialDriver_Write((void *)printBuffer,str_len, UsbWriteCompleted, 0)!= USBD_STATUS_SUCCESS)
-	{		
-		printf("USB FAIL\r\n");
-		bufferInUse = 0;
-	}
+//------------------------------------------------------------------------------
+/// Binary telemetry record, same drop policy as usb_printf_telemetry()
+//------------------------------------------------------------------------------
+void usb_write_telemetry(const void* data, unsigned int len)
+{
+	if (!usb_write(TXRESERVE,data,len))
+		txDropped++;
 }
 
 
@@ -266,7 +473,7 @@ void samserial_init()
         }
         isSerialConnected = 1;
         // Start receiving data on the USB
-        CDCDSerialDriver_Read(usbBuffer,DATABUFFERSIZE,(TransferCallback) UsbDataReceived,0);
+        UsbStartRead(0);
        
 }
 
@@ -1,6 +1,10 @@
 
-void samserial_setcallback(void (*c)(unsigned char));
+unsigned int samserial_available(const unsigned char** data);
+void samserial_consume(unsigned int len);
+unsigned int samserial_rxfree();
 void samserial_print(const char* c);
 void samserial_init();
 void usb_printf(const char * format, ...);
+void usb_printf_telemetry(const char * format, ...);
+void usb_write_telemetry(const void* data, unsigned int len);
 
@@ -108,12 +108,67 @@ volatile unsigned char old_y_max_endstop=0;
 volatile unsigned char old_z_min_endstop=0;
 volatile unsigned char old_z_max_endstop=0;
 
+// Executed position in steps, counted by the stepper interrupt
+volatile long count_position[NUM_AXIS] = {0, 0, 0, 0};
+
+// Checkpoint for the power loss journal: SD line of the block being
+// executed and the logical position before it (from the planner, a G92
+// while moves are queued doesn't move it like count_position)
+volatile unsigned long st_line_pos = PLAN_NO_FILE_POS;
+volatile float st_line_start[NUM_AXIS];
+volatile signed short st_line_feedrate;
+
+// Cortex-M3 cycle counter, measures the time spent in the stepper interrupt
+#define DEMCR			(*(volatile unsigned int *)0xE000EDFC)
+#define DWT_CTRL		(*(volatile unsigned int *)0xE0001000)
+#define DWT_CYCCNT		(*(volatile unsigned int *)0xE0001004)
+
+volatile unsigned int stepper_isr_cycles = 0;
+static unsigned int load_last_cycles = 0;
+
 
 
 void stepper_setup(void)
 {
 	Pin time_pins[]={time_check1,time_check2,X_MIN_PIN,Y_MIN_PIN,Z_MIN_PIN,X_MAX_PIN,Y_MAX_PIN,Z_MAX_PIN};
 	PIO_Configure(time_pins,8);
+
+	//enable the cycle counter
+	DEMCR |= (1<<24);
+	DWT_CYCCNT = 0;
+	DWT_CTRL |= 1;
+}
+
+//--------------------------------------------------
+// Set the executed position (G92, homing), called
+// by plan_set_position with the new step values
+//--------------------------------------------------
+void st_set_position(long x, long y, long z, long e)
+{
+	IRQ_DisableIT(AT91C_ID_TC0);
+	count_position[X_AXIS] = x;
+	count_position[Y_AXIS] = y;
+	count_position[Z_AXIS] = z;
+	count_position[E_AXIS] = e;
+	IRQ_EnableIT(AT91C_ID_TC0);
+}
+
+//--------------------------------------------------
+// Share of CPU time spent in the stepper interrupt since
+// the last call in 1/1000
+//--------------------------------------------------
+unsigned short st_isr_load(void)
+{
+	unsigned int now = DWT_CYCCNT;
+	unsigned int elapsed = now - load_last_cycles;
+	unsigned int busy = stepper_isr_cycles;
+
+	stepper_isr_cycles = 0;
+	load_last_cycles = now;
+
+	if (elapsed == 0)
+		return 0;
+	return (unsigned short)(((unsigned long long)busy * 1000) / elapsed);
 }
 
 void enable_endstops(unsigned char check)
@@ -215,6 +270,7 @@ void trapezoid_generator_reset()
 void TC0_IrqHandler(void)
 {        
 	volatile unsigned int dummy;
+	unsigned int isr_start = DWT_CYCCNT;
 	
 	PIO_Set(&time_check1);
     
@@ -243,6 +299,17 @@ void TC0_IrqHandler(void)
 			#ifdef ADVANCE
 			e_steps[current_block->active_extruder] = 0;
 			#endif
+
+			// first block of a new line
+			if (current_block->file_pos != st_line_pos)
+			{
+				st_line_pos = current_block->file_pos;
+				st_line_start[X_AXIS] = current_block->line_start[X_AXIS];
+				st_line_start[Y_AXIS] = current_block->line_start[Y_AXIS];
+				st_line_start[Z_AXIS] = current_block->line_start[Z_AXIS];
+				st_line_start[E_AXIS] = current_block->line_start[E_AXIS];
+				st_line_feedrate = current_block->feedrate;
+			}
 		} 
 		else
 		{
@@ -458,7 +525,10 @@ void TC0_IrqHandler(void)
 				if(virtual_steps_x)
 					virtual_steps_x--;
 				else
+				{
 					motor_step(X_AXIS);
+					count_position[X_AXIS] += (out_bits & (1<<X_AXIS)) ? -1 : 1;
+				}
 			}
 			else
 				virtual_steps_x++;
@@ -473,7 +543,10 @@ void TC0_IrqHandler(void)
 				if(virtual_steps_y)
 					virtual_steps_y--;
 				else
+				{
 					motor_step(Y_AXIS);
+					count_position[Y_AXIS] += (out_bits & (1<<Y_AXIS)) ? -1 : 1;
+				}
 			}
 			else
 				virtual_steps_y++;
@@ -488,7 +561,10 @@ void TC0_IrqHandler(void)
 				if(virtual_steps_z)
 					virtual_steps_z--;
 				else
+				{
 					motor_step(Z_AXIS);
+					count_position[Z_AXIS] += (out_bits & (1<<Z_AXIS)) ? -1 : 1;
+				}
 			}
 			else
 				virtual_steps_z++;
@@ -504,6 +580,7 @@ void TC0_IrqHandler(void)
 				motor_step(E1_AXIS);
 			else
 				motor_step(E_AXIS);
+			count_position[E_AXIS] += (out_bits & (1<<E_AXIS)) ? -1 : 1;
 				
 			counter_e -= current_block->step_event_count;
 		}
@@ -575,4 +652,5 @@ void TC0_IrqHandler(void)
 	} 
 	motor_unstep();
 	PIO_Clear(&time_check1);
+	stepper_isr_cycles += DWT_CYCCNT - isr_start;
 }
@@ -31,6 +31,13 @@ extern const Pin Z_MAX_PIN;
 void ConfigureTc0_Stepper(void);
 void stepper_setup(void);
 void enable_endstops(unsigned char check);
+void st_set_position(long x, long y, long z, long e);
+unsigned short st_isr_load(void);
+
+extern volatile long count_position[];
+extern volatile unsigned long st_line_pos;
+extern volatile float st_line_start[];
+extern volatile signed short st_line_feedrate;
  
   
 #endif /* end of include guard: STEPPER_CONTROL_H_3FACLIDQ */
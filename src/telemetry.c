@@ -0,0 +1,94 @@
+/*
+ Telemetry
+ Periodic binary status record, built and sent from the main loop so the
+ host doesn't need to poll M105/M114/M27 through the G-code parser.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <inttypes.h>
+
+#include "init_configuration.h"
+#include "parameters.h"
+#include "heaters.h"
+#include "planner.h"
+#include "stepper_control.h"
+#include "sdcard.h"
+#include "serial.h"
+#include "binary_protocol.h"
+#include "telemetry.h"
+
+extern volatile unsigned long timestamp;
+extern unsigned int txDropped;
+
+static unsigned int telemetry_period = 0;		// ms between records, 0 = off
+static unsigned long telemetry_last = 0;
+static uint8_t telemetry_seq = 0;
+
+
+static uint8_t* put16(uint8_t* ptr, uint16_t value)
+{
+	*ptr++ = value & 0xFF;
+	*ptr++ = value >> 8;
+	return ptr;
+}
+
+static uint8_t* put32(uint8_t* ptr, uint32_t value)
+{
+	ptr = put16(ptr,value & 0xFFFF);
+	return put16(ptr,value >> 16);
+}
+
+//--------------------------------------------------
+// 0 switches telemetry off, rates above
+// TELEMETRY_MAX_RATE are limited
+//--------------------------------------------------
+void telemetry_set_rate(unsigned int rate)
+{
+	if (rate > TELEMETRY_MAX_RATE)
+		rate = TELEMETRY_MAX_RATE;
+
+	telemetry_period = rate ? 1000 / rate : 0;
+	telemetry_last = timestamp;
+	st_isr_load();
+}
+
+void telemetry_update(void)
+{
+	uint8_t payload[BINPROTO_MAX_PAYLOAD];
+	uint8_t frame[BINPROTO_MAX_PAYLOAD + 6];
+	uint8_t* ptr = payload;
+	unsigned char i;
+
+	if (!telemetry_period || (timestamp - telemetry_last) < telemetry_period)
+		return;
+	telemetry_last = timestamp;
+
+	ptr = put32(ptr,timestamp);
+	for(i = 0; i < MAX_EXTRUDER; i++)
+	{
+		ptr = put16(ptr,heaters[i].akt_temp);
+		ptr = put16(ptr,heaters[i].target_temp);
+		*ptr++ = heaters[i].pwm;
+	}
+	ptr = put16(ptr,heaters[HEATER_IDX_BED].akt_temp);
+	ptr = put16(ptr,heaters[HEATER_IDX_BED].target_temp);
+	for(i = 0; i < NUM_AXIS; i++)
+		ptr = put32(ptr,count_position[i]);
+	*ptr++ = calc_plannerpuffer_fill();
+	ptr = put32(ptr,sdcard_getposition());
+	ptr = put16(ptr,st_isr_load());
+	ptr = put16(ptr,txDropped);
+
+	usb_write_telemetry(frame,binproto_encode(BINPROTO_TYPE_TELEMETRY,telemetry_seq++,payload,ptr - payload,frame));
+}
@@ -0,0 +1,42 @@
+/*
+ Telemetry
+ Periodic binary status record, enabled with M542 S<rate in Hz>
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef TELEMETRY_H_8DN3QV5C
+#define TELEMETRY_H_8DN3QV5C
+
+// The record is sent in a binary protocol frame of type BINPROTO_TYPE_TELEMETRY
+// (see binary_protocol.h), the SYNC byte separates it from the ASCII replies.
+// Payload, all values little endian:
+//
+//   uint32  timestamp in ms
+//   per extruder (MAX_EXTRUDER):
+//     int16   temperature
+//     int16   target temperature
+//     uint8   heater pwm
+//   int16   bed temperature
+//   int16   bed target temperature
+//   int32   executed position X Y Z E in steps
+//   uint8   used planner blocks
+//   uint32  SD replay file offset (0 when not printing)
+//   uint16  stepper interrupt load in 1/1000
+//   uint16  dropped telemetry records
+#define TELEMETRY_MAX_RATE	100
+
+void telemetry_set_rate(unsigned int rate);
+void telemetry_update(void);
+
+#endif /* end of include guard: TELEMETRY_H_8DN3QV5C */
@@ -0,0 +1,662 @@
+/*
+ USB mass storage
+ Bulk-only transport with the SCSI block commands. The transport runs in the
+ main loop (msd_update), the USB and SD card transfers complete in the
+ background on DMA. Card reads and writes are overlapped with the USB
+ transfers using two buffers, so the card and the bus are busy at the
+ same time and the main loop keeps running.
+
+ The card is only offered to the host while msd_set_medium() has handed it
+ over (see sdcard_usb_export), otherwise the drive reports "no medium". It's
+ taken back only while msd_medium_idle() and not while the host prevents
+ the removal.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <board.h>
+#include <inttypes.h>
+#include <string.h>
+#include <usb/device/core/USBD.h>
+#include <usb/device/cdc-serial/CDCDSerialDriverDescriptors.h>
+
+#include "usb_msd.h"
+
+#define MSD_BLOCK_SIZE		512
+#define MSD_CHUNK_BLOCKS	8		// blocks per USB transfer / SD access
+#define MSD_BUFFER_SIZE		(MSD_BLOCK_SIZE * MSD_CHUNK_BLOCKS)
+
+#define MSD_CBW_SIGNATURE	0x43425355
+#define MSD_CSW_SIGNATURE	0x53425355
+#define MSD_CBW_SIZE		31
+#define MSD_CSW_SIZE		13
+#define MSD_CBW_DIR_IN		0x80
+
+#define MSD_CSW_PASSED		0
+#define MSD_CSW_FAILED		1
+
+// class specific requests
+#define MSD_REQ_GET_MAX_LUN	0xFE
+#define MSD_REQ_RESET		0xFF
+
+// SCSI commands
+#define SCSI_TEST_UNIT_READY		0x00
+#define SCSI_REQUEST_SENSE			0x03
+#define SCSI_INQUIRY				0x12
+#define SCSI_MODE_SENSE_6			0x1A
+#define SCSI_START_STOP_UNIT		0x1B
+#define SCSI_PREVENT_ALLOW_REMOVAL	0x1E
+#define SCSI_READ_FORMAT_CAPACITIES	0x23
+#define SCSI_READ_CAPACITY_10		0x25
+#define SCSI_READ_10				0x28
+#define SCSI_WRITE_10				0x2A
+#define SCSI_VERIFY_10				0x2F
+#define SCSI_SYNCHRONIZE_CACHE		0x35
+#define SCSI_MODE_SENSE_10			0x5A
+
+// sense keys, additional sense codes
+#define SENSE_NONE					0x00
+#define SENSE_NOT_READY				0x02
+#define SENSE_MEDIUM_ERROR			0x03
+#define SENSE_ILLEGAL_REQUEST		0x05
+#define SENSE_UNIT_ATTENTION		0x06
+#define SENSE_DATA_PROTECT			0x07
+
+#define ASC_INVALID_COMMAND			0x20
+#define ASC_LBA_OUT_OF_RANGE		0x21
+#define ASC_WRITE_PROTECTED			0x27
+#define ASC_MEDIUM_CHANGED			0x28
+#define ASC_MEDIUM_NOT_PRESENT		0x3A
+#define ASC_READ_ERROR				0x11
+#define ASC_WRITE_ERROR				0x0C
+
+enum MsdState {
+	MSD_IDLE,			// not configured
+	MSD_CBW,			// waiting for a command block
+	MSD_REPLY,			// short reply for a command is on the way
+	MSD_READ,			// READ(10) data phase
+	MSD_WRITE,			// WRITE(10) data phase
+	MSD_PAD,			// fill the rest of an IN data phase after an error
+	MSD_DISCARD,		// drop OUT data the command doesn't use
+	MSD_CSW,			// status is on the way
+};
+
+typedef struct
+{
+	uint32_t dCBWSignature;
+	uint32_t dCBWTag;
+	uint32_t dCBWDataTransferLength;
+	uint8_t bmCBWFlags;
+	uint8_t bCBWLUN;
+	uint8_t bCBWCBLength;
+	uint8_t CBWCB[16];
+} __attribute__((packed)) MsdCbw;
+
+typedef struct
+{
+	uint32_t dCSWSignature;
+	uint32_t dCSWTag;
+	uint32_t dCSWDataResidue;
+	uint8_t bCSWStatus;
+} __attribute__((packed)) MsdCsw;
+
+static unsigned char msdBuffer[2][MSD_BUFFER_SIZE] __attribute__((aligned(4)));
+static MsdCbw cbw __attribute__((aligned(4)));
+static MsdCsw csw __attribute__((aligned(4)));
+
+static volatile unsigned char msdBusy = 0;			// USB transfer on the way
+static volatile unsigned char msdStatus;			// result of the last transfer
+static volatile unsigned int msdTransferred;
+static volatile unsigned char sdBusy = 0;			// card transfer on the way
+static volatile unsigned char sdStatus;
+
+static unsigned char state = MSD_IDLE;
+static unsigned int dataLeft;		// bytes of the data phase the host still expects
+static unsigned int lba;			// next block on the card
+static unsigned int blocksLeft;		// blocks still to read from the card / to receive
+static unsigned int chunkBlocks;	// blocks in the buffer on the way
+static unsigned char chunkBuffer;	// buffer on the way
+static unsigned char ioError;
+static unsigned char writePending;	// card write started, result not checked yet
+
+static unsigned char senseKey, senseAsc;
+
+static Media* medium = 0;
+static unsigned char mediumChanged = 0;
+static unsigned char ejectRequested = 0;
+static unsigned char preventRemoval = 0;
+
+static const unsigned char inquiryData[36] = {
+	0x00,			// direct access block device
+	0x80,			// removable
+	0x04,			// SPC-2
+	0x02,			// response data format
+	31,				// additional length
+	0, 0, 0,
+	'4','p','i',' ',' ',' ',' ',' ',
+	'S','D',' ','c','a','r','d',' ',' ',' ',' ',' ',' ',' ',' ',' ',
+	'1','.','0','0'
+};
+
+
+static void MsdTransferDone(void* arg,
+                            unsigned char status,
+                            unsigned int transferred,
+                            unsigned int remaining)
+{
+	msdStatus = status;
+	msdTransferred = transferred;
+	msdBusy = 0;
+}
+
+static void MsdMediaDone(void* arg,
+                         unsigned char status,
+                         unsigned int transferred,
+                         unsigned int remaining)
+{
+	sdStatus = status;
+	sdBusy = 0;
+}
+
+static void msd_media_read(void* data, unsigned int blocks)
+{
+	// card taken away in the middle of a command
+	if (!medium)
+	{
+		sdStatus = MED_STATUS_ERROR;
+		return;
+	}
+	sdBusy = 1;
+	if (medium->read(medium,lba,data,blocks,(MediaCallback) MsdMediaDone,0) != MED_STATUS_SUCCESS)
+	{
+		sdStatus = MED_STATUS_ERROR;
+		sdBusy = 0;
+	}
+}
+
+static void msd_media_write(void* data, unsigned int blocks)
+{
+	writePending = 1;
+	if (!medium)
+	{
+		sdStatus = MED_STATUS_ERROR;
+		return;
+	}
+	sdBusy = 1;
+	if (medium->write(medium,lba,data,blocks,(MediaCallback) MsdMediaDone,0) != MED_STATUS_SUCCESS)
+	{
+		sdStatus = MED_STATUS_ERROR;
+		sdBusy = 0;
+	}
+}
+
+static void msd_send(const void* data, unsigned int len)
+{
+	msdBusy = 1;
+	if (USBD_Write(CDCDSerialDriverDescriptors_MSDIN,data,len,(TransferCallback) MsdTransferDone,0) != USBD_STATUS_SUCCESS)
+	{
+		msdStatus = USBD_STATUS_ABORTED;
+		msdBusy = 0;
+	}
+}
+
+static void msd_receive(void* data, unsigned int len)
+{
+	msdBusy = 1;
+	if (USBD_Read(CDCDSerialDriverDescriptors_MSDOUT,data,len,(TransferCallback) MsdTransferDone,0) != USBD_STATUS_SUCCESS)
+	{
+		msdStatus = USBD_STATUS_ABORTED;
+		msdBusy = 0;
+	}
+}
+
+static uint32_t get_be32(const uint8_t* ptr)
+{
+	return ((uint32_t)ptr[0] << 24) | ((uint32_t)ptr[1] << 16) | ((uint32_t)ptr[2] << 8) | ptr[3];
+}
+
+static void put_be32(uint8_t* ptr, uint32_t value)
+{
+	ptr[0] = value >> 24;
+	ptr[1] = value >> 16;
+	ptr[2] = value >> 8;
+	ptr[3] = value;
+}
+
+static void msd_sense(unsigned char key, unsigned char asc)
+{
+	senseKey = key;
+	senseAsc = asc;
+	if (key != SENSE_NONE)
+		csw.bCSWStatus = MSD_CSW_FAILED;
+}
+
+static void msd_wait_cbw(void)
+{
+	state = MSD_CBW;
+	msd_receive(&cbw,MSD_CBW_SIZE);
+}
+
+static void msd_send_csw(void)
+{
+	csw.dCSWSignature = MSD_CSW_SIGNATURE;
+	csw.dCSWTag = cbw.dCBWTag;
+	csw.dCSWDataResidue = dataLeft;
+	state = MSD_CSW;
+	msd_send(&csw,MSD_CSW_SIZE);
+}
+
+//--------------------------------------------------
+// End of a command without (further) data, takes
+// care of data the host still wants to move
+//--------------------------------------------------
+static void msd_finish(void)
+{
+	if (dataLeft == 0)
+		msd_send_csw();
+	else if (cbw.bmCBWFlags & MSD_CBW_DIR_IN)
+	{
+		// a short (here empty) packet ends the host's IN transfer
+		state = MSD_REPLY;
+		msd_send(msdBuffer[0],0);
+	}
+	else
+		state = MSD_DISCARD;
+}
+
+//--------------------------------------------------
+// Short IN reply (inquiry, sense, capacity ...)
+//--------------------------------------------------
+static void msd_reply(const void* data, unsigned int len)
+{
+	if (!(cbw.bmCBWFlags & MSD_CBW_DIR_IN) || dataLeft == 0)
+	{
+		msd_finish();
+		return;
+	}
+	if (len > dataLeft)
+		len = dataLeft;
+	if (data != msdBuffer[0])
+		memcpy(msdBuffer[0],data,len);
+	dataLeft -= len;
+	state = MSD_REPLY;
+	msd_send(msdBuffer[0],len);
+}
+
+static unsigned char msd_check_medium(void)
+{
+	if (!medium)
+	{
+		msd_sense(SENSE_NOT_READY,ASC_MEDIUM_NOT_PRESENT);
+		return 0;
+	}
+	if (mediumChanged)
+	{
+		mediumChanged = 0;
+		msd_sense(SENSE_UNIT_ATTENTION,ASC_MEDIUM_CHANGED);
+		return 0;
+	}
+	return 1;
+}
+
+//--------------------------------------------------
+// READ(10) and WRITE(10), checks and sets up the data phase
+//--------------------------------------------------
+static void msd_start_transfer(unsigned char write)
+{
+	unsigned int blocks;
+
+	lba = get_be32(&cbw.CBWCB[2]);
+	blocks = (cbw.CBWCB[7] << 8) | cbw.CBWCB[8];
+
+	if (!msd_check_medium())
+	{
+		msd_finish();
+		return;
+	}
+	if (lba + blocks > medium->size)
+	{
+		msd_sense(SENSE_ILLEGAL_REQUEST,ASC_LBA_OUT_OF_RANGE);
+		msd_finish();
+		return;
+	}
+	if (write && medium->protected)
+	{
+		msd_sense(SENSE_DATA_PROTECT,ASC_WRITE_PROTECTED);
+		msd_finish();
+		return;
+	}
+	// never move more than the host asked for
+	if (blocks * MSD_BLOCK_SIZE > dataLeft || ((cbw.bmCBWFlags & MSD_CBW_DIR_IN) ? write : !write))
+	{
+		msd_sense(SENSE_ILLEGAL_REQUEST,ASC_INVALID_COMMAND);
+		msd_finish();
+		return;
+	}
+
+	blocksLeft = blocks;
+	chunkBlocks = 0;
+	chunkBuffer = 1;
+	ioError = 0;
+	writePending = 0;
+	state = write ? MSD_WRITE : MSD_READ;
+}
+
+static void msd_command(void)
+{
+	unsigned char reply[20];
+
+	csw.bCSWStatus = MSD_CSW_PASSED;
+	dataLeft = cbw.dCBWDataTransferLength;
+	memset(reply,0,sizeof(reply));
+
+	switch(cbw.CBWCB[0])
+	{
+		case SCSI_TEST_UNIT_READY:
+			msd_check_medium();
+			msd_finish();
+			break;
+		case SCSI_REQUEST_SENSE:
+			reply[0] = 0x70;		// current error, fixed format
+			reply[2] = senseKey;
+			reply[7] = 10;			// additional length
+			reply[12] = senseAsc;
+			senseKey = SENSE_NONE;
+			senseAsc = 0;
+			msd_reply(reply,18);
+			break;
+		case SCSI_INQUIRY:
+			msd_reply(inquiryData,sizeof(inquiryData));
+			break;
+		case SCSI_MODE_SENSE_6:
+			reply[0] = 3;
+			reply[2] = (medium && medium->protected) ? 0x80 : 0;
+			msd_reply(reply,4);
+			break;
+		case SCSI_MODE_SENSE_10:
+			reply[1] = 6;
+			reply[3] = (medium && medium->protected) ? 0x80 : 0;
+			msd_reply(reply,8);
+			break;
+		case SCSI_START_STOP_UNIT:
+			// eject from the host gives the card back to the firmware
+			if ((cbw.CBWCB[4] & 0x03) == 0x02)
+				ejectRequested = 1;
+			msd_finish();
+			break;
+		case SCSI_PREVENT_ALLOW_REMOVAL:
+			preventRemoval = cbw.CBWCB[4] & 0x01;
+			msd_finish();
+			break;
+		case SCSI_READ_FORMAT_CAPACITIES:
+			if (!msd_check_medium())
+			{
+				msd_finish();
+				break;
+			}
+			reply[3] = 8;			// capacity list length
+			put_be32(&reply[4],medium->size);
+			put_be32(&reply[8],MSD_BLOCK_SIZE);
+			reply[8] = 0x02;		// formatted media
+			msd_reply(reply,12);
+			break;
+		case SCSI_READ_CAPACITY_10:
+			if (!msd_check_medium())
+			{
+				msd_finish();
+				break;
+			}
+			put_be32(&reply[0],medium->size - 1);
+			put_be32(&reply[4],MSD_BLOCK_SIZE);
+			msd_reply(reply,8);
+			break;
+		case SCSI_READ_10:
+			msd_start_transfer(0);
+			break;
+		case SCSI_WRITE_10:
+			msd_start_transfer(1);
+			break;
+		case SCSI_VERIFY_10:
+		case SCSI_SYNCHRONIZE_CACHE:
+			msd_check_medium();
+			msd_finish();
+			break;
+		default:
+			msd_sense(SENSE_ILLEGAL_REQUEST,ASC_INVALID_COMMAND);
+			msd_finish();
+			break;
+	}
+}
+
+//--------------------------------------------------
+// READ(10): send one buffer while the card fills the other,
+// both transfers run on DMA in the background
+//--------------------------------------------------
+static void msd_read_step(void)
+{
+	unsigned char next = chunkBuffer ^ 1;
+	unsigned int blocks;
+
+	// the buffer read last time goes out now
+	if (chunkBlocks)
+	{
+		if (sdStatus != MED_STATUS_SUCCESS)
+		{
+			// the data phase must be completed anyway
+			msd_sense(SENSE_MEDIUM_ERROR,ASC_READ_ERROR);
+			blocksLeft = 0;
+			chunkBlocks = 0;
+			memset(msdBuffer[chunkBuffer],0,MSD_BUFFER_SIZE);
+			state = MSD_PAD;
+			return;
+		}
+		dataLeft -= chunkBlocks * MSD_BLOCK_SIZE;
+		msd_send(msdBuffer[chunkBuffer],chunkBlocks * MSD_BLOCK_SIZE);
+		chunkBlocks = 0;
+	}
+
+	if (blocksLeft == 0)
+	{
+		if (!msdBusy)
+			msd_finish();
+		return;
+	}
+
+	blocks = (blocksLeft > MSD_CHUNK_BLOCKS) ? MSD_CHUNK_BLOCKS : blocksLeft;
+	msd_media_read(msdBuffer[next],blocks);
+	lba += blocks;
+	blocksLeft -= blocks;
+	chunkBuffer = next;
+	chunkBlocks = blocks;
+}
+
+//--------------------------------------------------
+// WRITE(10): receive into one buffer while the other
+// is written to the card
+//--------------------------------------------------
+static void msd_write_step(void)
+{
+	unsigned char done = chunkBuffer;
+	unsigned int doneBlocks = chunkBlocks;
+	unsigned int blocks;
+
+	// result of the card write started last time
+	if (writePending)
+	{
+		if (sdStatus != MED_STATUS_SUCCESS)
+			ioError = 1;
+		writePending = 0;
+	}
+
+	if (doneBlocks)
+	{
+		if (msdStatus != USBD_STATUS_SUCCESS || msdTransferred != doneBlocks * MSD_BLOCK_SIZE)
+			ioError = 1;
+		dataLeft -= doneBlocks * MSD_BLOCK_SIZE;
+	}
+
+	chunkBlocks = 0;
+	if (blocksLeft)
+	{
+		blocks = (blocksLeft > MSD_CHUNK_BLOCKS) ? MSD_CHUNK_BLOCKS : blocksLeft;
+		blocksLeft -= blocks;
+		chunkBuffer = done ^ 1;
+		chunkBlocks = blocks;
+		msd_receive(msdBuffer[chunkBuffer],blocks * MSD_BLOCK_SIZE);
+	}
+
+	if (doneBlocks && !ioError)
+	{
+		msd_media_write(msdBuffer[done],doneBlocks);
+		lba += doneBlocks;
+	}
+
+	if (!chunkBlocks && !writePending)
+	{
+		if (ioError)
+			msd_sense(SENSE_MEDIUM_ERROR,ASC_WRITE_ERROR);
+		msd_finish();
+	}
+}
+
+//--------------------------------------------------
+// Main loop part of the transport
+//--------------------------------------------------
+void msd_update(void)
+{
+	unsigned int len;
+
+	if (msdBusy || sdBusy)
+		return;
+
+	switch(state)
+	{
+		case MSD_IDLE:
+			break;
+		case MSD_CBW:
+			if (msdStatus == USBD_STATUS_SUCCESS && msdTransferred == MSD_CBW_SIZE
+				&& cbw.dCBWSignature == MSD_CBW_SIGNATURE && cbw.bCBWLUN == 0)
+				msd_command();
+			else
+				msd_wait_cbw();
+			break;
+		case MSD_REPLY:
+			// whatever the host wanted on top is reported as residue
+			msd_send_csw();
+			break;
+		case MSD_READ:
+			msd_read_step();
+			break;
+		case MSD_WRITE:
+			msd_write_step();
+			break;
+		case MSD_PAD:
+			if (dataLeft == 0)
+			{
+				msd_send_csw();
+				break;
+			}
+			len = (dataLeft > MSD_BUFFER_SIZE) ? MSD_BUFFER_SIZE : dataLeft;
+			dataLeft -= len;
+			msd_send(msdBuffer[chunkBuffer],len);
+			break;
+		case MSD_DISCARD:
+			if (dataLeft == 0)
+			{
+				msd_send_csw();
+				break;
+			}
+			len = (dataLeft > MSD_BUFFER_SIZE) ? MSD_BUFFER_SIZE : dataLeft;
+			dataLeft -= len;
+			msd_receive(msdBuffer[0],len);
+			break;
+		case MSD_CSW:
+			msd_wait_cbw();
+			break;
+	}
+}
+
+//--------------------------------------------------
+// Called from the USB interrupt on SET_CONFIGURATION
+//--------------------------------------------------
+void msd_configured(unsigned char cfgnum)
+{
+	senseKey = SENSE_NONE;
+	senseAsc = 0;
+	if (cfgnum)
+		msd_wait_cbw();
+	else
+		state = MSD_IDLE;
+}
+
+//--------------------------------------------------
+// Class requests for the mass storage interface,
+// returns 0 if the request is not for us
+//--------------------------------------------------
+unsigned char msd_request_handler(const USBGenericRequest *request)
+{
+	static unsigned char maxLun = 0;
+
+	if (USBGenericRequest_GetType(request) != USBGenericRequest_CLASS
+		|| USBGenericRequest_GetRecipient(request) != USBGenericRequest_INTERFACE
+		|| USBGenericRequest_GetIndex(request) != CDCDSerialDriverDescriptors_MSDINTERFACE)
+		return 0;
+
+	switch(USBGenericRequest_GetRequest(request))
+	{
+		case MSD_REQ_GET_MAX_LUN:
+			USBD_Write(0,&maxLun,1,0,0);
+			break;
+		case MSD_REQ_RESET:
+			// the host clears the endpoint halts afterwards and sends a new CBW
+			msdBusy = 0;
+			state = MSD_CBW;
+			msdStatus = USBD_STATUS_ABORTED;
+			USBD_Write(0,0,0,0,0);
+			break;
+		default:
+			USBD_Stall(0);
+			break;
+	}
+	return 1;
+}
+
+//--------------------------------------------------
+// Offer a medium to the host (NULL = no medium)
+//--------------------------------------------------
+void msd_set_medium(Media* media)
+{
+	medium = media;
+	mediumChanged = 1;
+	ejectRequested = 0;
+	preventRemoval = 0;
+}
+
+unsigned char msd_eject_requested(void)
+{
+	return ejectRequested;
+}
+
+unsigned char msd_removal_prevented(void)
+{
+	return preventRemoval;
+}
+
+//--------------------------------------------------
+// 1 while no READ(10)/WRITE(10) uses the medium and no card
+// transfer is on the way, it can be taken away then
+//--------------------------------------------------
+unsigned char msd_medium_idle(void)
+{
+	return !sdBusy && !writePending && state != MSD_READ && state != MSD_WRITE;
+}
@@ -0,0 +1,34 @@
+/*
+ USB mass storage
+ Bulk-only transport with the SCSI block commands, exports the SD card as
+ a USB drive next to the CDC serial port.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef USB_MSD_H_6RJ2WK9E
+#define USB_MSD_H_6RJ2WK9E
+
+#include <memories/Media.h>
+#include <usb/common/core/USBGenericRequest.h>
+
+void msd_configured(unsigned char cfgnum);
+unsigned char msd_request_handler(const USBGenericRequest *request);
+void msd_update(void);
+
+void msd_set_medium(Media* media);
+unsigned char msd_eject_requested(void);
+unsigned char msd_removal_prevented(void);
+unsigned char msd_medium_idle(void);
+
+#endif /* end of include guard: USB_MSD_H_6RJ2WK9E */